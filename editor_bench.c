@@ -0,0 +1,420 @@
+/* Benchmark for the editor, replaying keystrokes through a pty.
+ *
+ * Each script of keys is written to the master side of a pty by a thread
+ * of its own, while linenoiseCtxRead() edits lines on the slave side until
+ * a ctrl-D on an empty line ends the script. Another thread reads and
+ * throws away whatever the editor writes.
+ *
+ * With no arguments, a set of built in scripts is run. Otherwise each
+ * argument is a file of recorded keystrokes to replay.
+ */
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "linenoise.h"
+
+#define HISTORY_LINES 1000000
+#define CANDIDATES 50000
+
+struct keys {
+    char *buf;
+    size_t len;
+    size_t max;
+};
+
+struct replay {
+    int fd;
+    const struct keys *keys;
+};
+
+static unsigned long allocs;
+
+static void *count_malloc(size_t size)
+{
+    allocs++;
+    return malloc(size);
+}
+
+static void *count_realloc(void *ptr, size_t size)
+{
+    allocs++;
+    return realloc(ptr, size);
+}
+
+static void keys_add(struct keys *k, const char *str, size_t len)
+{
+    if (k->len + len > k->max) {
+        while (k->len + len > k->max) {
+            k->max = k->max ? k->max * 2 : 4096;
+        }
+        k->buf = realloc(k->buf, k->max);
+        if (k->buf == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(k->buf + k->len, str, len);
+    k->len += len;
+}
+
+static void keys_str(struct keys *k, const char *str)
+{
+    keys_add(k, str, strlen(str));
+}
+
+static void keys_repeat(struct keys *k, const char *str, int n)
+{
+    while (n--) {
+        keys_str(k, str);
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Writes the keys to the master side of the pty */
+static void *writer(void *arg)
+{
+    struct replay *r = arg;
+    size_t n = 0;
+
+    while (n < r->keys->len) {
+        ssize_t w = write(r->fd, r->keys->buf + n, r->keys->len - n);
+        if (w <= 0) {
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            break;
+        }
+        n += w;
+    }
+    return NULL;
+}
+
+/* Reads and discards the output of the editor, so that it never blocks */
+static void *reader(void *arg)
+{
+    int fd = *(int *)arg;
+    char buf[65536];
+
+    while (read(fd, buf, sizeof(buf)) > 0 || errno == EINTR) {
+    }
+    return NULL;
+}
+
+/* The time under which 'pct' percent of the keys were shown, from the histogram */
+static unsigned long percentile(const linenoiseStats *stats, int pct)
+{
+    unsigned long n = 0;
+    int i;
+
+    for (i = 0; i < LINENOISE_STATS_BUCKETS - 1; i++) {
+        n += stats->key_latency[i];
+        if (n * 100 >= stats->keys * pct) {
+            break;
+        }
+    }
+    return 1UL << i;
+}
+
+/* Replays 'keys', reading the lines with linenoiseCtxReadInto() if 'into' is set */
+static void run(const char *name, linenoiseContext *ctx, int master, const struct keys *keys, int into)
+{
+    linenoiseBuf lb = { NULL, 0, 0 };
+    struct replay r;
+    pthread_t thread;
+    linenoiseStats stats;
+    unsigned long start_allocs;
+    double start;
+    double t;
+    char *line;
+    int lines = 0;
+
+    r.fd = master;
+    r.keys = keys;
+
+    linenoiseCtxSetStats(ctx, 0);
+    linenoiseCtxSetStats(ctx, 1);
+    start_allocs = allocs;
+    start = now();
+    pthread_create(&thread, NULL, writer, &r);
+    if (into) {
+        while (linenoiseCtxReadInto(ctx, "bench> ", &lb) == 0) {
+            lines++;
+        }
+    }
+    else {
+        while ((line = linenoiseCtxRead(ctx, "bench> ")) != NULL) {
+            linenoiseFree(line);
+            lines++;
+        }
+    }
+    t = now() - start;
+    pthread_join(thread, NULL);
+    linenoiseCtxGetStats(ctx, &stats);
+    linenoiseBufFree(&lb);
+
+    printf("%-16s %8lu keys %5d lines %9.1f ms %10.0f keys/s %10.0f KB/s in %8.1f bytes/key %8lu allocs %5.2f/line  p50 <%luus p99 <%luus max %luus\n",
+        name, stats.keys, lines, t * 1000, stats.keys / t, keys->len / t / 1024,
+        stats.keys ? (double)stats.bytes_written / stats.keys : 0.0,
+        allocs - start_allocs, lines ? (double)(allocs - start_allocs) / lines : 0.0, percentile(&stats, 50), percentile(&stats, 99), stats.key_max_us);
+}
+
+static void end_script(struct keys *k)
+{
+    /* Ends any line left unfinished, then the script */
+    keys_str(k, "\r\x04");
+}
+
+/* Lines typed a char at a time, with some editing along the way */
+static void script_typing(struct keys *k)
+{
+    char buf[100];
+    int i;
+
+    for (i = 0; i < 2000; i++) {
+        snprintf(buf, sizeof(buf), "SELECT name, id FROM users WHERE id > %d;", i);
+        keys_str(k, buf);
+        keys_str(k, "\x01\x1b[C\x1b[Cx\x05\x08\x17\r");
+    }
+    end_script(k);
+}
+
+/* A line of thousands of utf-8 chars, then moving through it and editing it */
+static void script_utf8(struct keys *k)
+{
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        keys_repeat(k, "h\xc3\xa9llo w\xc3\xb6rld \xce\xb1\xce\xb2\xce\xb3 \xe2\x82\xac ", 200);
+        keys_repeat(k, "\x1b[D", 2000);
+        keys_repeat(k, "x\x08", 200);
+        keys_repeat(k, "\x1b[C", 2000);
+        keys_str(k, "\x01\x05\x01");
+        keys_repeat(k, "\x04", 100);
+        keys_str(k, "\r");
+    }
+    end_script(k);
+}
+
+/* The same with wide chars, 4 byte chars and combining marks */
+static void script_wide(struct keys *k)
+{
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        keys_repeat(k, "\xe4\xb8\xad\xe6\x96\x87 \xf0\x9f\x98\x80 e\xcc\x81 ", 200);
+        keys_repeat(k, "\x1b[D", 1400);
+        keys_repeat(k, "x\x08", 200);
+        keys_repeat(k, "\x1b[C", 1400);
+        keys_str(k, "\x01\x05\x01");
+        keys_repeat(k, "\x04", 100);
+        keys_str(k, "\r");
+    }
+    end_script(k);
+}
+
+/* Large pastes */
+static void script_paste(struct keys *k)
+{
+    int i;
+
+    for (i = 0; i < 20; i++) {
+        keys_str(k, "\x1b[200~");
+        keys_repeat(k, "pasted text, ", 5000);
+        keys_str(k, "\x1b[201~\r");
+    }
+    end_script(k);
+}
+
+/* Reverse searches of the history */
+static void script_search(struct keys *k)
+{
+    int i;
+
+    for (i = 0; i < 20; i++) {
+        keys_str(k, "\x12");
+        keys_str(k, "id > 99999");
+        keys_repeat(k, "\x12", 10);
+        keys_repeat(k, "\x08", 4);
+        keys_str(k, "1");
+        keys_str(k, "\x07");
+    }
+    end_script(k);
+}
+
+/* Each tab shows the next of many completions */
+static void script_complete(struct keys *k)
+{
+    int i;
+
+    for (i = 0; i < 50; i++) {
+        keys_str(k, "cand");
+        keys_repeat(k, "\t", 20);
+        keys_str(k, "\r");
+    }
+    end_script(k);
+}
+
+static void completion(const char *buf, linenoiseCompletions *lc)
+{
+    char str[32];
+    int i;
+
+    if (strncmp(buf, "cand", 4) == 0) {
+        for (i = 0; i < CANDIDATES; i++) {
+            snprintf(str, sizeof(str), "candidate_%05d", i);
+            linenoiseAddCompletion(lc, str);
+        }
+    }
+}
+
+/* Digits in one colour and keywords in another, as a program might */
+static void highlight(const char *buf, linenoiseHighlights *hl)
+{
+    int i;
+
+    for (i = 0; buf[i]; i++) {
+        if (buf[i] >= '0' && buf[i] <= '9') {
+            linenoiseAddHighlight(hl, i, 1, 33, 0);
+        }
+        else if (strncmp(buf + i, "SELECT", 6) == 0 || strncmp(buf + i, "FROM", 4) == 0) {
+            linenoiseAddHighlight(hl, i, buf[i] == 'S' ? 6 : 4, 34, 1);
+        }
+    }
+}
+
+static char *hints(const char *buf, int *color, int *bold)
+{
+    (void)bold;
+    *color = 90;
+    return strncmp(buf, "SELECT", 6) == 0 && strchr(buf, ';') == NULL ? (char *)" WHERE ...;" : NULL;
+}
+
+static void load_history(linenoiseContext *ctx)
+{
+    char buf[100];
+    int i;
+
+    linenoiseCtxHistorySetMaxLen(ctx, HISTORY_LINES);
+    for (i = 0; i < HISTORY_LINES; i++) {
+        if (i % 10 == 0) {
+            snprintf(buf, sizeof(buf), "printf 'line %d\\n' | grep -c line", i);
+        }
+        else {
+            snprintf(buf, sizeof(buf), "SELECT name, id FROM users WHERE id > %d;", i);
+        }
+        linenoiseCtxHistoryAdd(ctx, buf);
+    }
+}
+
+static int read_file(const char *filename, struct keys *k)
+{
+    char buf[65536];
+    FILE *fp = fopen(filename, "rb");
+    size_t n;
+
+    if (fp == NULL) {
+        perror(filename);
+        return -1;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        keys_add(k, buf, n);
+    }
+    fclose(fp);
+    end_script(k);
+    return 0;
+}
+
+static void bench(const char *name, linenoiseContext *ctx, int master, void (*script)(struct keys *), int into)
+{
+    struct keys k = { NULL, 0, 0 };
+
+    script(&k);
+    run(name, ctx, master, &k, into);
+    free(k.buf);
+}
+
+int main(int argc, char **argv)
+{
+    struct winsize ws = { 24, 80, 0, 0 };
+    struct termios raw;
+    linenoiseContext *ctx;
+    pthread_t thread;
+    int master;
+    int slave;
+    int i;
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        perror("posix_openpt");
+        return 1;
+    }
+    slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave == -1) {
+        perror("open");
+        return 1;
+    }
+    ioctl(slave, TIOCSWINSZ, &ws);
+
+    /* Keys arriving between lines must not be taken by the line discipline */
+    tcgetattr(slave, &raw);
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(slave, TCSANOW, &raw);
+
+    pthread_create(&thread, NULL, reader, &master);
+
+    linenoiseSetAllocator(count_malloc, count_realloc, free);
+    ctx = linenoiseCtxCreate(slave, slave);
+    linenoiseCtxSetCompletionCallback(ctx, completion);
+
+    if (argc > 1) {
+        for (i = 1; i < argc; i++) {
+            struct keys k = { NULL, 0, 0 };
+
+            if (read_file(argv[i], &k) == 0) {
+                run(argv[i], ctx, master, &k, 0);
+            }
+            free(k.buf);
+        }
+    }
+    else {
+        bench("typing", ctx, master, script_typing, 0);
+        bench("read into", ctx, master, script_typing, 1);
+        linenoiseCtxSetHighlightCallback(ctx, highlight);
+        linenoiseCtxSetHintsCallback(ctx, hints);
+        bench("highlighted", ctx, master, script_typing, 0);
+        linenoiseCtxSetHighlightCallback(ctx, NULL);
+        linenoiseCtxSetHintsCallback(ctx, NULL);
+        bench("utf-8 line", ctx, master, script_utf8, 0);
+        bench("wide chars", ctx, master, script_wide, 0);
+        linenoiseCtxSetMultiLine(ctx, 1);
+        bench("multi-line", ctx, master, script_utf8, 0);
+        linenoiseCtxSetMultiLine(ctx, 0);
+        bench("paste", ctx, master, script_paste, 0);
+        bench("complete", ctx, master, script_complete, 0);
+        load_history(ctx);
+        bench("search", ctx, master, script_search, 0);
+    }
+
+    linenoiseCtxFree(ctx);
+    close(slave);
+    return 0;
+}
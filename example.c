@@ -1,5 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/select.h>
+#endif
 #include "linenoise.h"
 
 #ifndef NO_COMPLETION
@@ -11,6 +15,34 @@ void completion(const char *buf, linenoiseCompletions *lc) {
 }
 #endif
 
+char *hints(const char *buf, int *color, int *bold) {
+    if (!strcmp(buf,"git remote add")) {
+        *color = 35;
+        *bold = 0;
+        return (char *)" <name> <url>";
+    }
+    return NULL;
+}
+
+/* Shows the first word in bold and anything quoted in green */
+void highlight(const char *buf, linenoiseHighlights *hl) {
+    int i = 0;
+    int start;
+
+    while (buf[i] == ' ') i++;
+    start = i;
+    while (buf[i] && buf[i] != ' ') i++;
+    linenoiseAddHighlight(hl, start, i - start, 0, 1);
+    for (; buf[i]; i++) {
+        if (buf[i] == '"' || buf[i] == '\'') {
+            start = i++;
+            while (buf[i] && buf[i] != buf[start]) i++;
+            linenoiseAddHighlight(hl, start, i - start + 1, 32, 0);
+            if (!buf[i]) break;
+        }
+    }
+}
+
 static int in_string = 0;
 static size_t string_start = 0;
 
@@ -71,8 +103,61 @@ int foundhelp(const char *buf, size_t len, char c) {
     return 1;
 }
 
-int main(void) {
+#ifndef _WIN32
+/* Like linenoise(), but prints a message every second while waiting for input */
+static char *async_linenoise(const char *prompt)
+{
+    static int ticks = 0;
+    char *line = linenoiseEditMore;
+    int fd = linenoiseEditStart(prompt);
+
+    if (fd == -1) {
+        return linenoise(prompt);
+    }
+    while (line == linenoiseEditMore) {
+        struct timeval tv = { 1, 0 };
+        fd_set fds;
+        int rc = 1;
+
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        if (!linenoiseEditPending()) {
+            rc = select(fd + 1, &fds, NULL, NULL, &tv);
+        }
+        if (rc == 0) {
+            linenoiseHide();
+            printf("tick %d\n", ++ticks);
+            linenoiseShow();
+        }
+        else if (rc > 0) {
+            line = linenoiseEditFeed();
+        }
+    }
+    linenoiseEditStop();
+    return line;
+}
+#endif
+
+int main(int argc, char **argv) {
     char *line;
+    char *(*readline)(const char *) = linenoise;
+
+    while (argc > 1) {
+        argc--;
+        argv++;
+        if (strcmp(*argv, "--multiline") == 0) {
+            linenoiseSetMultiLine(1);
+        }
+        else if (strcmp(*argv, "--hints") == 0) {
+            linenoiseSetHintsCallback(hints);
+            linenoiseSetHighlightCallback(highlight);
+        }
+#ifndef _WIN32
+        else if (strcmp(*argv, "--async") == 0) {
+            readline = async_linenoise;
+        }
+#endif
+    }
 
 #ifndef NO_COMPLETION
     linenoiseSetCompletionCallback(completion);
@@ -83,12 +168,12 @@ int main(void) {
     linenoiseSetCharacterCallback(foundquote, '\'');
     linenoiseSetCharacterCallback(foundhelp, '?');
 
-    while((line = linenoise("hello> ")) != NULL) {
+    while((line = readline("hello> ")) != NULL) {
 		reset_string_mode();
         if (line[0] != '\0') {
             printf("echo: '%s'\n", line);
             linenoiseHistoryAdd(line);
-            linenoiseHistorySave("history.txt"); /* Save every new entry */
+            linenoiseHistoryAppend("history.txt"); /* Save every new entry */
         }
         free(line);
     }
@@ -0,0 +1,79 @@
+/* Benchmark for linenoiseHistoryLoad().
+ *
+ * Writes a history file of FILE_LINES lines, then times loading it
+ * with a range of history max lengths.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "linenoise.h"
+
+#define FILE_LINES 200000
+#define ITERATIONS 10
+
+static const char *filename = "history_bench.txt";
+
+static int make_file(void)
+{
+    FILE *fp = fopen(filename, "w");
+    int i;
+
+    if (fp == NULL) {
+        perror(filename);
+        return -1;
+    }
+    for (i = 0; i < FILE_LINES; i++) {
+        if (i % 10 == 0) {
+            fprintf(fp, "printf 'line %d\\\\n' | grep -c \\\\\\\\line\n", i);
+        }
+        else {
+            fprintf(fp, "SELECT name, id FROM users WHERE id > %d;\n", i);
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+static double elapsed(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void bench(int max_len)
+{
+    clock_t start;
+    double t;
+    int len = 0;
+    int i;
+
+    start = clock();
+    for (i = 0; i < ITERATIONS; i++) {
+        linenoiseHistoryFree();
+        linenoiseHistorySetMaxLen(max_len);
+        if (linenoiseHistoryLoad(filename) != 0) {
+            printf("max len %6d: load failed\n", max_len);
+            return;
+        }
+    }
+    t = elapsed(start);
+    linenoiseHistory(&len);
+    printf("max len %6d: %6d lines loaded in %8.3f ms\n", max_len, len, t * 1000 / ITERATIONS);
+}
+
+int main(void)
+{
+    if (make_file() != 0) {
+        return 1;
+    }
+    printf("%d line history file\n", FILE_LINES);
+    bench(100);
+    bench(1000);
+    bench(10000);
+    bench(100000);
+    bench(FILE_LINES);
+
+    linenoiseHistoryFree();
+    remove(filename);
+    return 0;
+}
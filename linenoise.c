@@ -107,6 +107,7 @@
 #ifdef _WIN32 /* Windows platform, either MinGW or Visual Studio (MSVC) */
 #include <windows.h>
 #include <fcntl.h>
+#include <io.h>
 #define USE_WINCONSOLE
 #ifdef __MINGW32__
 #define HAVE_UNISTD_H
@@ -124,8 +125,13 @@
 #endif
 #else
 #include <termios.h>
+#include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/poll.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <signal.h>
 #define USE_TERMIOS
 #define HAVE_UNISTD_H
 #endif
@@ -138,6 +144,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
 
 #include "linenoise.h"
@@ -145,1262 +152,6453 @@
 
 #define LINENOISE_DEFAULT_HISTORY_MAX_LEN 100
 #define LINENOISE_MAX_LINE 4096
-static linenoiseCharacterCallback *characterCallback[256] = { NULL };
+#define LINENOISE_INLINE_LINE 256 /* Lines shorter than this are edited without allocating */
+#define LINENOISE_READ_CHUNK 4096 /* Pasted text is read this much at a time */
+#define LINENOISE_STREAM_CHUNK 65536 /* Input which isn't a terminal is read into at least this much room */
+#define LINENOISE_PASTE_TIMEOUT 1000 /* Give up on a paste which doesn't end within this many ms */
+#define LINENOISE_ESCAPE_TIMEOUT 50 /* Default wait for the rest of an escape sequence, in ms */
+
+#if !defined(__GNUC__) && !defined(NO_SHARED_HISTORY)
+/* The shared history needs the gcc/clang atomic builtins */
+#define NO_SHARED_HISTORY
+#endif
+
+#if !defined(NO_COMPLETION) && !defined(NO_ASYNC_COMPLETION) && defined(USE_TERMIOS) && defined(__GNUC__)
+/* Asynchronous completion needs a pipe to wake the editor and the gcc/clang atomic builtins */
+#define USE_ASYNC_COMPLETION
+#endif
 
 #define ctrl(C) ((C) - '@')
 
 /* Use -ve numbers here to co-exist with normal unicode chars */
 enum {
     SPECIAL_NONE,
-    SPECIAL_UP = -20,
-    SPECIAL_DOWN = -21,
-    SPECIAL_LEFT = -22,
-    SPECIAL_RIGHT = -23,
-    SPECIAL_DELETE = -24,
-    SPECIAL_HOME = -25,
-    SPECIAL_END = -26,
+    SPECIAL_UP = LINENOISE_KEY_UP,
+    SPECIAL_DOWN = LINENOISE_KEY_DOWN,
+    SPECIAL_LEFT = LINENOISE_KEY_LEFT,
+    SPECIAL_RIGHT = LINENOISE_KEY_RIGHT,
+    SPECIAL_DELETE = LINENOISE_KEY_DELETE,
+    SPECIAL_HOME = LINENOISE_KEY_HOME,
+    SPECIAL_END = LINENOISE_KEY_END,
+    SPECIAL_PASTE = -27,    /* Start of a bracketed paste */
+    SPECIAL_WAKE = -28,     /* Something was written to the wake pipe */
+    SPECIAL_INSERT = LINENOISE_KEY_INSERT,
+    SPECIAL_PAGE_UP = LINENOISE_KEY_PAGE_UP,
+    SPECIAL_PAGE_DOWN = LINENOISE_KEY_PAGE_DOWN,
+    SPECIAL_BACKTAB = LINENOISE_KEY_BACKTAB,
+    SPECIAL_CTRL_LEFT = LINENOISE_KEY_CTRL_LEFT,
+    SPECIAL_CTRL_RIGHT = LINENOISE_KEY_CTRL_RIGHT,
+    SPECIAL_CTRL_DELETE = LINENOISE_KEY_CTRL_DELETE,
+    SPECIAL_F1 = LINENOISE_KEY_F(1), /* F1 to F12 are SPECIAL_F1 - 0 to SPECIAL_F1 - 11 */
+    SPECIAL_META = LINENOISE_KEY_META(0), /* Alt with a char c below 128 is SPECIAL_META - c */
+};
+
+/* Keys from KEYMAP_FIRST for KEYMAP_SIZE are bound in a table, the rest in a hash table */
+#define KEYMAP_FIRST -256
+#define KEYMAP_SIZE 512
+
+struct key_binding {
+    int key;            /* Only used in the hash table */
+    int action;         /* One of LINENOISE_ACTION_* */
+    linenoiseKeyCallback *fn; /* Called first if set */
+    void *userdata;
+    linenoiseCharacterCallback *charfn; /* Set with linenoiseCtxSetCharacterCallback() */
+};
+
+/* The keys bound to begin with. Other chars are inserted and other keys do nothing */
+static const struct {
+    int key;
+    int action;
+} default_bindings[] = {
+    { '\r', LINENOISE_ACTION_ENTER },
+    { ctrl('C'), LINENOISE_ACTION_INTERRUPT },
+    { ctrl('D'), LINENOISE_ACTION_EOF },
+    { 127, LINENOISE_ACTION_BACKSPACE },
+    { ctrl('H'), LINENOISE_ACTION_BACKSPACE },
+    { SPECIAL_DELETE, LINENOISE_ACTION_DELETE },
+    { ctrl('W'), LINENOISE_ACTION_DELETE_WORD_LEFT },
+    { SPECIAL_META - 127, LINENOISE_ACTION_DELETE_WORD_LEFT },
+    { SPECIAL_META - ctrl('H'), LINENOISE_ACTION_DELETE_WORD_LEFT },
+    { SPECIAL_META - 'd', LINENOISE_ACTION_DELETE_WORD_RIGHT },
+    { SPECIAL_CTRL_DELETE, LINENOISE_ACTION_DELETE_WORD_RIGHT },
+    { ctrl('U'), LINENOISE_ACTION_DELETE_TO_START },
+    { ctrl('K'), LINENOISE_ACTION_DELETE_TO_END },
+    { ctrl('B'), LINENOISE_ACTION_LEFT },
+    { SPECIAL_LEFT, LINENOISE_ACTION_LEFT },
+    { ctrl('F'), LINENOISE_ACTION_RIGHT },
+    { SPECIAL_RIGHT, LINENOISE_ACTION_RIGHT },
+    { SPECIAL_META - 'b', LINENOISE_ACTION_WORD_LEFT },
+    { SPECIAL_CTRL_LEFT, LINENOISE_ACTION_WORD_LEFT },
+    { SPECIAL_META - 'f', LINENOISE_ACTION_WORD_RIGHT },
+    { SPECIAL_CTRL_RIGHT, LINENOISE_ACTION_WORD_RIGHT },
+    { ctrl('A'), LINENOISE_ACTION_HOME },
+    { SPECIAL_HOME, LINENOISE_ACTION_HOME },
+    { ctrl('E'), LINENOISE_ACTION_END },
+    { SPECIAL_END, LINENOISE_ACTION_END },
+    { ctrl('P'), LINENOISE_ACTION_HISTORY_PREV },
+    { SPECIAL_UP, LINENOISE_ACTION_HISTORY_PREV },
+    { ctrl('N'), LINENOISE_ACTION_HISTORY_NEXT },
+    { SPECIAL_DOWN, LINENOISE_ACTION_HISTORY_NEXT },
+    { ctrl('R'), LINENOISE_ACTION_SEARCH },
+    { '\t', LINENOISE_ACTION_COMPLETE },
+    { ctrl('T'), LINENOISE_ACTION_TRANSPOSE },
+    { ctrl('V'), LINENOISE_ACTION_QUOTE },
+    { ctrl('L'), LINENOISE_ACTION_CLEAR_SCREEN },
+};
+
+static int key_default(int key)
+{
+    int i;
+
+    for (i = 0; i < (int)(sizeof(default_bindings) / sizeof(*default_bindings)); i++) {
+        if (default_bindings[i].key == key) {
+            return default_bindings[i].action;
+        }
+    }
+    return key >= ' ' && key != 127 ? LINENOISE_ACTION_INSERT : LINENOISE_ACTION_NONE;
+}
+
+
+/* All memory is allocated through these, see linenoiseSetAllocator() */
+static void *(*mallocFn)(size_t) = malloc;
+static void *(*reallocFn)(void *, size_t) = realloc;
+static void (*freeFn)(void *) = free;
+
+static char *ln_strdup(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = (char *)mallocFn(len);
+
+    if (copy) {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
+
+/* The history is a circular buffer of 'max_len' slots.
+ * The oldest entry is in slot 'head' and there are 'len' entries.
+ */
+struct history {
+    char **lines;   /* NULL for a line not yet read from 'file' */
+    time_t *times;  /* When each line was added, or 0 if not known. Indexed like 'lines' */
+    int max_len;
+    int len;
+    int head;
+    unsigned seq;   /* Sequence number of the next line to be added */
+    unsigned written; /* 'seq' when the history file was last brought up to date */
+    struct history_file *file; /* The binary history file the lines were loaded from */
+    int erase_dups;     /* Erase older duplicates of a line added, see linenoiseCtxSetHistoryEraseDups() */
+    int erased;         /* Number of slots of erased lines */
+    struct history_dup *dups; /* Where to find each distinct line, if 'erase_dups' */
+    int dups_size;      /* Number of entries in 'dups', a power of 2 */
+#ifndef NO_HISTORY_ARENA
+    struct history_chunk *chunks; /* The first chunk is the one currently being allocated from */
+    size_t arena_size;  /* Total bytes in all chunks */
+    size_t arena_live;  /* Bytes used by live lines */
+#endif
+#ifndef NO_HISTORY_INDEX
+    struct trigram *index;
+    int index_size;     /* Number of buckets, a power of 2 */
+    int index_used;     /* Number of buckets in use */
+    unsigned index_next; /* Sequence number of the next line to index, 'seq' once complete */
+#endif
+};
+
+#ifndef NO_HISTORY_ARENA
+/* History lines are bump-allocated from a list of chunks rather than
+ * allocated individually. Each line is preceded by a pointer to its chunk
+ * so that the chunk can be released once none of its lines are in use.
+ * Since the history discards its oldest lines first, chunks tend to empty
+ * in the order they were filled.
+ */
+#define HISTORY_CHUNK_MIN 1024
+#define HISTORY_CHUNK_MAX 65536
+
+struct history_chunk {
+    struct history_chunk *prev;
+    struct history_chunk *next;
+    size_t size;    /* Bytes available in 'data' */
+    size_t used;    /* Bytes handed out from 'data' */
+    int live;       /* Number of lines still allocated from this chunk */
+    char data[1];
+};
+
+#define HISTORY_ALIGN(N) (((N) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+/* Allocates a new chunk of 'size' bytes and makes it the current chunk */
+static struct history_chunk *history_chunk_new(struct history *h, size_t size)
+{
+    struct history_chunk *chunk = (struct history_chunk *)mallocFn(sizeof(*chunk) + size);
+
+    if (chunk) {
+        chunk->size = size;
+        chunk->used = 0;
+        chunk->live = 0;
+        chunk->prev = NULL;
+        chunk->next = h->chunks;
+        if (h->chunks) {
+            h->chunks->prev = chunk;
+        }
+        h->chunks = chunk;
+        h->arena_size += size;
+    }
+    return chunk;
+}
+
+static char *history_strdup(struct history *h, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    size_t need = HISTORY_ALIGN(sizeof(struct history_chunk *) + len);
+    struct history_chunk *chunk = h->chunks;
+    char *p;
+
+    if (chunk == NULL || chunk->size - chunk->used < need) {
+        size_t size = h->arena_live / 2;
+
+        if (size < HISTORY_CHUNK_MIN) size = HISTORY_CHUNK_MIN;
+        if (size > HISTORY_CHUNK_MAX) size = HISTORY_CHUNK_MAX;
+        if (size < need) size = need;
+
+        chunk = history_chunk_new(h, size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+    }
+
+    p = chunk->data + chunk->used;
+    memcpy(p, &chunk, sizeof(chunk));
+    p += sizeof(chunk);
+    memcpy(p, str, len);
+    chunk->used += need;
+    chunk->live++;
+    h->arena_live += need;
+    return p;
+}
+
+static void history_strfree(struct history *h, char *str)
+{
+    struct history_chunk *chunk;
+
+    if (str == NULL) {
+        return;
+    }
+    memcpy(&chunk, str - sizeof(chunk), sizeof(chunk));
+    h->arena_live -= HISTORY_ALIGN(sizeof(chunk) + strlen(str) + 1);
+    if (--chunk->live) {
+        return;
+    }
+    if (chunk == h->chunks) {
+        /* Still the current chunk, so just start again from the beginning */
+        chunk->used = 0;
+        return;
+    }
+    chunk->prev->next = chunk->next;
+    if (chunk->next) {
+        chunk->next->prev = chunk->prev;
+    }
+    h->arena_size -= chunk->size;
+    freeFn(chunk);
+}
+
+static void history_arena_free(struct history_chunk *chunk)
+{
+    while (chunk) {
+        struct history_chunk *next = chunk->next;
+        freeFn(chunk);
+        chunk = next;
+    }
+}
+#else
+#define history_strdup(H, S) ln_strdup(S)
+#define history_strfree(H, S) freeFn(S)
+#endif
+
+/* Where a char of the current line is, so that nothing needs to rescan the line */
+struct charpos {
+    int offset; /* Byte offset in 'buf' */
+    int col;    /* Display column, relative to the start of 'buf' */
+};
+
+/* The history lines matching a reverse-i-search query.
+ * Each character added to the query narrows the matches of the previous
+ * query, so a search only ever looks at lines which can still match.
+ */
+struct search_level {
+    unsigned *seqs; /* Ascending sequence numbers, or NULL to scan the whole history */
+    int len;
+};
+
+/* State of a reverse-i-search, see searchChar() */
+struct search {
+    char rbuf[50];      /* The query */
+    char rprompt[80];   /* The prompt showing the query */
+    struct search_level levels[50]; /* Matches for the query up to each char of 'rbuf' */
+    int rchars;         /* Number of chars in 'rbuf' */
+    int rlen;           /* Number of bytes in 'rbuf' */
+    int searchpos;      /* History index of the match shown */
+};
+
+/**
+ * Input which isn't a terminal, read a block at a time. Lines are handed
+ * out where they are in 'buf', see stream_line().
+ */
+struct stream {
+    char *buf;
+    size_t len;         /* Bytes in 'buf' */
+    size_t max;         /* Size of 'buf' */
+    size_t pos;         /* Start of the next line */
+    size_t scanned;     /* Bytes from 'pos' on known to hold no newline */
+    int eof;            /* Nothing more will be read */
 };
 
-static int history_max_len = LINENOISE_DEFAULT_HISTORY_MAX_LEN;
-static int history_len = 0;
-static char **history = NULL;
+/* What the chars typed are being used for, see editChar() */
+enum {
+    EDIT_NORMAL,        /* Editing the line */
+    EDIT_COMPLETE,      /* Cycling through completions */
+    EDIT_SEARCH,        /* Reverse incremental search */
+    EDIT_QUOTE,         /* Inserting the next char as is, after ctrl-V */
+};
 
-static linenoiseHistoryCallback *historyCallback = NULL;
+/* Returned by editChar() while the line is not finished */
+#define EDIT_MORE -2
+
+/* What to write for a column showing a char with zero width chars after it */
+struct cell_text {
+    const char *text;
+    int len;
+};
 
 /* Structure to contain the status of the current (being edited) line */
 struct current {
+    linenoiseContext *ctx; /* The context this line is being edited in */
     char *buf;  /* Current buffer. Always null terminated */
     int bufmax; /* Size of the buffer, including space for the null termination */
     int len;    /* Number of bytes in 'buf' */
     int chars;  /* Number of chars in 'buf' (utf-8 chars) */
     int pos;    /* Cursor position, measured in chars */
+    struct charpos *layout; /* Position of each char, plus an entry for the end of 'buf'. 'bufmax' entries */
+    char inbuf[LINENOISE_INLINE_LINE]; /* 'buf' until the line outgrows it */
+    struct charpos inlayout[LINENOISE_INLINE_LINE]; /* Likewise for 'layout' */
     int cols;   /* Size of the window, in chars */
+    int rows;   /* Screen rows, or 0 if not known */
     const char *prompt;
+    char *outbuf; /* Pending terminal output, written by outputFlush() */
+    int outlen; /* Number of bytes in 'outbuf' */
+    int outmax; /* Size of 'outbuf' */
+    unsigned *cells; /* What refreshLine() is about to show, one entry per column, see screen_build() */
+    unsigned *shown; /* What is on the screen, likewise */
+    int shown_len; /* Columns in 'shown', or -1 if what is on the screen isn't known */
+    int shown_x; /* Column of the cursor */
+    int shown_row; /* Row of the cursor, counting from the first row of the line */
+    int shown_rows; /* Rows the line takes up on the screen, 0 if it isn't there yet */
+    int cells_max; /* Entries allocated for each of 'cells' and 'shown' */
+    struct cell_text *texts; /* The text of each CELL_TEXT in 'cells', allocated once needed */
+    unsigned version; /* Changed whenever 'buf' is, so that what is worked out from it can be kept */
+    unsigned char *attrs; /* The attribute of each byte of 'buf' from the highlight callback, see CELL_ATTR */
+    int attrs_max; /* Size of 'attrs' */
+    unsigned attrs_version; /* The 'version' which 'attrs' is for, or 0 if none */
+    char *hint; /* The hint for 'buf' from the hints callback, or NULL if none */
+    unsigned hint_attr; /* How 'hint' is shown */
+    unsigned hint_version; /* The 'version' which 'hint' is for, or 0 if none */
+    int mode;   /* One of EDIT_... */
+    int history_index; /* 0 is the line being edited, 1 the most recent history entry and so on */
+    char *saved; /* The line being edited while browsing the history, or NULL */
+#ifndef NO_COMPLETION
+    size_t completion; /* Index of the completion shown, or their number for the original line */
+    int origpos; /* Cursor position before completion */
+    int listed; /* Rows of completions listed so far, see completeList() */
+#endif
+#ifdef USE_ASYNC_COMPLETION
+    linenoiseCompletionRequest *request; /* The asynchronous completion still running, or NULL */
+#endif
+    struct search search;
 #if defined(USE_TERMIOS)
-    int fd;     /* Terminal fd */
+    int fd;     /* Terminal input fd */
+    int outfd;  /* Terminal output fd */
 #elif defined(USE_WINCONSOLE)
     HANDLE outh; /* Console output handle */
     HANDLE inh; /* Console input handle */
-    int rows;   /* Screen rows */
     int x;      /* Current column during output */
     int y;      /* Current row */
+    int outx;   /* Column at which 'outbuf' starts */
 #endif
 };
 
-static int fd_read(struct current *current);
-static int getWindowSize(struct current *current);
+/* State of linenoiseCtxEditStart() and friends */
+enum {
+    EDIT_IDLE,          /* Not started */
+    EDIT_ACTIVE,        /* Waiting for input */
+    EDIT_DONE,          /* The line was returned, waiting for linenoiseCtxEditStop() */
+};
 
-void linenoiseHistoryFree(void) {
-    if (history) {
-        int j;
+/**
+ * The buffers of the last line edited, which the context keeps so that the
+ * next line can use them again rather than allocating its own, see outputFree()
+ */
+struct spare {
+    char *buf;          /* 'buf' of a line which outgrew 'inbuf', or NULL */
+    struct charpos *layout;
+    int bufmax;
+    char *outbuf;
+    int outmax;
+    unsigned *cells;
+    unsigned *shown;
+    struct cell_text *texts;
+    int cells_max;
+    unsigned char *attrs;
+    int attrs_max;
+};
+
+/* Everything belonging to one terminal. The functions without a context
+ * argument use the default context, which is on stdin.
+ */
+struct linenoiseContext {
+    struct history history;
+    linenoiseSharedHistory *shared; /* If set, 'history' is a copy of its lines */
+    int history_format; /* See linenoiseCtxSetHistoryFormat() */
+    unsigned synced;    /* Sequence number of the next line of 'shared' to copy */
+    unsigned appended;  /* Sequence number in 'shared' from which its own lines are still to be written */
+    unsigned id;        /* Marks the lines this context added to 'shared', see ctx_init() */
+#ifndef NO_COMPLETION
+    linenoiseCompletionCallback *completionCallback;
+    linenoiseCompletions completions; /* The completions being cycled through, kept to reuse their memory */
+    char *completion_line; /* The line they are the completions of */
+    size_t completion_max; /* Size of 'completion_line' */
+    int completion_cache;  /* See linenoiseCtxSetCompletionCache() */
+    int completion_cached; /* 'completions' are all there are of 'completion_line' */
+    int completion_mode;   /* See linenoiseCtxSetCompletionMode() */
+#endif
+#ifdef USE_ASYNC_COMPLETION
+    linenoiseAsyncCompletionCallback *asyncCompletionCallback;
+    void *asyncCompletionData;
+#endif
+    struct key_binding keys[KEYMAP_SIZE]; /* The keys from KEYMAP_FIRST, see linenoiseCtxBindKey() */
+    struct key_binding *keys_extra; /* Any others bound, hashed by key */
+    int keys_extra_max; /* Size of 'keys_extra', a power of 2 */
+    int keys_extra_len; /* Number of keys in 'keys_extra' */
+    linenoiseHistoryCallback *historyCallback;
+    linenoiseHintsCallback *hintsCallback;
+    linenoiseFreeHintsCallback *freeHintsCallback;
+    linenoiseHighlightCallback *highlightCallback;
+    int refresh_writes; /* Number of terminal writes issued by the most recent refreshLine() */
+    int cols;           /* The window size last found, or 0 if it needs finding again */
+    int rows;
+    int multiline;      /* Wrap long lines onto more rows, see linenoiseCtxSetMultiLine() */
+    int stats_enabled;  /* Keep 'stats', see linenoiseCtxSetStats() */
+    linenoiseStats stats;
+    long long input_time; /* When the key being handled was taken from the input, for 'stats' */
+#if defined(USE_TERMIOS)
+    int infd;
+    int outfd;
+    struct termios orig_termios; /* in order to restore at exit */
+    int rawmode;        /* for atexit() function to check if restore is needed*/
+    int bracketed_paste; /* Ask the terminal to mark pasted text, see linenoiseCtxSetBracketedPaste() */
+    int escape_timeout; /* See linenoiseCtxSetEscapeTimeout() */
+    int history_fsync;  /* See linenoiseCtxSetHistoryFsync() */
+    off_t compact_size; /* linenoiseCtxHistoryAppend() compacts the file once it is bigger than this */
+    /* Input is read from the terminal as much as is available at a time and
+     * handed out from here. It outlives a single call to linenoise() so that
+     * typed-ahead input isn't lost.
+     */
+    char inputbuf[LINENOISE_READ_CHUNK];
+    int inputlen;       /* Number of bytes in 'inputbuf' */
+    int inputpos;       /* Next byte of 'inputbuf' to return */
+    int wakefd[2];      /* Pipe written to wake the editor, see linenoiseCtxWakeFd() */
+    int winch;          /* Counted in 'winch_users' */
+    unsigned winch_seen; /* 'winch_count' when 'cols' was found */
+#elif defined(USE_WINCONSOLE)
+    DWORD orig_consolemode;
+#endif
+    struct current edit; /* The line being edited with linenoiseCtxEditStart() */
+    struct stream stream; /* The standard input of the default context, when not a terminal */
+    struct spare spare; /* Buffers to use again for the next line */
+    char *view;         /* The line last returned from the terminal by linenoiseCtxReadView() */
+    int edit_state;     /* One of EDIT_IDLE... */
+};
+
+static void ctx_init(linenoiseContext *ctx)
+{
+#ifndef NO_SHARED_HISTORY
+    /* Unlike its address, which a later context may be given once it is freed */
+    static unsigned ids;
+#endif
+    int i;
 
-        for (j = 0; j < history_len; j++)
-            free(history[j]);
-        free(history);
-        history = NULL;
+    memset(ctx, 0, sizeof(*ctx));
+#ifndef NO_SHARED_HISTORY
+    ctx->id = __atomic_add_fetch(&ids, 1, __ATOMIC_RELAXED);
+#endif
+    ctx->history.max_len = LINENOISE_DEFAULT_HISTORY_MAX_LEN;
+    for (i = 0; i < KEYMAP_SIZE; i++) {
+        ctx->keys[i].action = key_default(KEYMAP_FIRST + i);
     }
+#if defined(USE_TERMIOS)
+    ctx->infd = STDIN_FILENO;
+    ctx->outfd = STDIN_FILENO;
+    ctx->bracketed_paste = 1;
+    ctx->escape_timeout = LINENOISE_ESCAPE_TIMEOUT;
+    ctx->wakefd[0] = -1;
+    ctx->wakefd[1] = -1;
+#endif
+    ctx->edit_state = EDIT_IDLE;
 }
 
-#if defined(USE_TERMIOS)
-static void linenoiseAtExit(void);
-static struct termios orig_termios; /* in order to restore at exit */
-static int rawmode = 0; /* for atexit() function to check if restore is needed*/
-static int atexit_registered = 0; /* register atexit just 1 time */
+/* Position of 'key' in a hash table of 'max' slots, if it isn't taken by another */
+static int key_hash(int key, int max)
+{
+    return (int)(((unsigned)key * 2654435761u) & (unsigned)(max - 1));
+}
 
-static const char *unsupported_term[] = {"dumb","cons25",NULL};
+/**
+ * Returns the binding of 'key', which is only NULL for a key beyond 'keys'
+ * which was never bound. If 'add' is set, such a key is given a binding
+ * with its default action, and NULL is returned only if out of memory.
+ */
+static struct key_binding *key_binding(linenoiseContext *ctx, int key, int add)
+{
+    struct key_binding *b;
+    int i;
 
-static int isUnsupportedTerm(void) {
-    char *term = getenv("TERM");
+    if (key >= KEYMAP_FIRST && key < KEYMAP_FIRST + KEYMAP_SIZE) {
+        return &ctx->keys[key - KEYMAP_FIRST];
+    }
+    if (ctx->keys_extra_max) {
+        /* Linear probing. Key 0 is never here, so marks a free slot */
+        for (i = key_hash(key, ctx->keys_extra_max); ctx->keys_extra[i].key; i = (i + 1) & (ctx->keys_extra_max - 1)) {
+            if (ctx->keys_extra[i].key == key) {
+                return &ctx->keys_extra[i];
+            }
+        }
+    }
+    if (!add) {
+        return NULL;
+    }
+    if ((ctx->keys_extra_len + 1) * 2 > ctx->keys_extra_max) {
+        /* Keep it no more than half full */
+        int max = ctx->keys_extra_max ? ctx->keys_extra_max * 2 : 16;
+        struct key_binding *keys = (struct key_binding *)mallocFn(max * sizeof(*keys));
 
-    if (term) {
-        int j;
-        for (j = 0; unsupported_term[j]; j++) {
-            if (strcasecmp(term, unsupported_term[j]) == 0) {
-                return 1;
+        if (keys == NULL) {
+            return NULL;
+        }
+        memset(keys, 0, max * sizeof(*keys));
+        for (i = 0; i < ctx->keys_extra_max; i++) {
+            if (ctx->keys_extra[i].key) {
+                int j = key_hash(ctx->keys_extra[i].key, max);
+
+                while (keys[j].key) {
+                    j = (j + 1) & (max - 1);
+                }
+                keys[j] = ctx->keys_extra[i];
             }
         }
+        freeFn(ctx->keys_extra);
+        ctx->keys_extra = keys;
+        ctx->keys_extra_max = max;
     }
-    return 0;
+    for (i = key_hash(key, ctx->keys_extra_max); ctx->keys_extra[i].key; i = (i + 1) & (ctx->keys_extra_max - 1)) {
+    }
+    b = &ctx->keys_extra[i];
+    b->key = key;
+    b->action = key_default(key);
+    ctx->keys_extra_len++;
+    return b;
 }
 
-static int enableRawMode(struct current *current) {
-    struct termios raw;
+/* The action of 'key', one of LINENOISE_ACTION_* */
+static int key_action(linenoiseContext *ctx, int key)
+{
+    struct key_binding *b = key_binding(ctx, key, 0);
 
-    current->fd = STDIN_FILENO;
+    return b ? b->action : key > 0 ? LINENOISE_ACTION_INSERT : LINENOISE_ACTION_NONE;
+}
 
-    if (!isatty(current->fd) || isUnsupportedTerm() ||
-        tcgetattr(current->fd, &orig_termios) == -1) {
-fatal:
-        errno = ENOTTY;
-        return -1;
-    }
+static linenoiseContext default_context;
+static int default_context_ready = 0;
 
-    if (!atexit_registered) {
-        atexit(linenoiseAtExit);
-        atexit_registered = 1;
+static linenoiseContext *default_ctx(void)
+{
+    if (!default_context_ready) {
+        ctx_init(&default_context);
+        default_context_ready = 1;
     }
+    return &default_context;
+}
 
-    raw = orig_termios;  /* modify the original mode */
-    /* input modes: no break, no CR to NL, no parity check, no strip char,
-     * no start/stop output control. */
-    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-    /* output modes - disable post processing */
-    raw.c_oflag &= ~(OPOST);
-    /* control modes - set 8 bit chars */
-    raw.c_cflag |= (CS8);
-    /* local modes - choing off, canonical off, no extended functions,
-     * no signal chars (^Z,^C) */
-    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN) | ISIG;
-    /* control chars - set return condition: min number of bytes and timer.
-     * We want read to return every single byte, without timeout. */
-    raw.c_cc[VMIN] = 1; raw.c_cc[VTIME] = 0; /* 1 byte, no timer */
+static int fd_read(struct current *current);
+#ifndef NO_COMPLETION
+static void completion_free(linenoiseContext *ctx);
+#endif
+static int getWindowSize(struct current *current);
+static void outputFlush(struct current *current);
 
-    /* put terminal in raw mode after flushing */
-    if (tcsetattr(current->fd,TCSADRAIN,&raw) < 0) {
-        goto fatal;
-    }
-    rawmode = 1;
+/* Microseconds since some time in the past */
+static long long stats_now(void)
+{
+#ifdef USE_WINCONSOLE
+    LARGE_INTEGER freq, now;
 
-    current->cols = 0;
-    return 0;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return now.QuadPart / freq.QuadPart * 1000000 + now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#endif
 }
 
-static void disableRawMode(struct current *current) {
-    /* Don't even check the return value as it's too late. */
-    if (rawmode && tcsetattr(current->fd,TCSADRAIN,&orig_termios) != -1)
-        rawmode = 0;
+/* Starts timing something for the stats. Returns 0 if they aren't being kept */
+static long long stats_start(linenoiseContext *ctx)
+{
+    return ctx->stats_enabled ? stats_now() : 0;
 }
 
-/* At exit we'll try to fix the terminal to the initial conditions. */
-static void linenoiseAtExit(void) {
-    if (rawmode) {
-        tcsetattr(STDIN_FILENO, TCSADRAIN, &orig_termios);
+/* Counts something timed from 'start' into '*count' and '*us' */
+static void stats_time(linenoiseContext *ctx, unsigned long *count, unsigned long long *us, long long start)
+{
+    if (ctx->stats_enabled) {
+        (*count)++;
+        *us += stats_now() - start;
     }
-    linenoiseHistoryFree();
 }
 
-/* gcc/glibc insists that we care about the return code of write! */
-#define IGNORE_RC(EXPR) if (EXPR) {}
-
-/* This is fdprintf() on some systems, but use a different
- * name to avoid conflicts
- */
-static void fd_printf(int fd, const char *format, ...)
+/* Adds 'us' to 'histogram', which has LINENOISE_STATS_BUCKETS buckets of powers of two */
+static void stats_histogram(unsigned long *histogram, long long us)
 {
-    va_list args;
-    char buf[64];
-    int n;
+    int i = 0;
 
-    va_start(args, format);
-    n = vsnprintf(buf, sizeof(buf), format, args);
-    va_end(args);
-    IGNORE_RC(write(fd, buf, n));
+    while (i < LINENOISE_STATS_BUCKETS - 1 && us >= 1LL << i) {
+        i++;
+    }
+    histogram[i]++;
 }
 
-static void clearScreen(struct current *current)
+/**
+ * Appends 'len' bytes to the pending output for the terminal.
+ *
+ * Nothing reaches the terminal until outputFlush() is called, so a
+ * complete redraw goes out as a single write.
+ */
+static void outputAppend(struct current *current, const char *buf, int len)
 {
-    fd_printf(current->fd, "\x1b[H\x1b[2J");
+    if (current->outlen + len > current->outmax) {
+        int outmax = current->outmax ? current->outmax : 256;
+        char *outbuf;
+
+        while (current->outlen + len > outmax) {
+            outmax *= 2;
+        }
+        outbuf = (char *)reallocFn(current->outbuf, outmax);
+        if (outbuf == NULL) {
+            /* Out of memory, so send it a buffer full at a time */
+            while (len > 0 && current->outmax) {
+                int n = current->outmax - current->outlen;
+                if (n > len) {
+                    n = len;
+                }
+                memcpy(current->outbuf + current->outlen, buf, n);
+                current->outlen += n;
+                buf += n;
+                len -= n;
+                if (len) {
+                    outputFlush(current);
+                }
+            }
+            return;
+        }
+        current->outbuf = outbuf;
+        current->outmax = outmax;
+    }
+    memcpy(current->outbuf + current->outlen, buf, len);
+    current->outlen += len;
 }
 
-static void cursorToLeft(struct current *current)
+/* Gives back the hint from the hints callback */
+static void hint_free(struct current *current)
 {
-    fd_printf(current->fd, "\x1b[1G");
+    if (current->hint && current->ctx->freeHintsCallback) {
+        current->ctx->freeHintsCallback(current->hint);
+    }
+    current->hint = NULL;
 }
 
-static int outputChars(struct current *current, const char *buf, int len)
+/* Hands the buffers used to show the line over to the context for the next line */
+static void outputFree(struct current *current)
 {
-    return write(current->fd, buf, len);
+    struct spare *spare = &current->ctx->spare;
+
+    freeFn(spare->outbuf);
+    spare->outbuf = current->outbuf;
+    spare->outmax = current->outmax;
+    current->outbuf = NULL;
+    current->outlen = current->outmax = 0;
+    freeFn(spare->cells);
+    freeFn(spare->shown);
+    freeFn(spare->texts);
+    spare->cells = current->cells;
+    spare->shown = current->shown;
+    spare->texts = current->texts;
+    spare->cells_max = current->cells_max;
+    current->cells = current->shown = NULL;
+    current->texts = NULL;
+    current->cells_max = 0;
+    current->shown_len = -1;
+    freeFn(spare->attrs);
+    spare->attrs = current->attrs;
+    spare->attrs_max = current->attrs_max;
+    hint_free(current);
+    current->attrs = NULL;
+    current->attrs_max = 0;
+    current->attrs_version = current->hint_version = 0;
 }
 
-static void outputControlChar(struct current *current, char ch)
+static void spare_free(struct spare *spare)
 {
-    fd_printf(current->fd, "\033[7m^%c\033[0m", ch);
+    freeFn(spare->buf);
+    freeFn(spare->layout);
+    freeFn(spare->outbuf);
+    freeFn(spare->cells);
+    freeFn(spare->shown);
+    freeFn(spare->texts);
+    freeFn(spare->attrs);
+    memset(spare, 0, sizeof(*spare));
 }
 
-static void eraseEol(struct current *current)
+/**
+ * Returns the slot holding history entry 'i', where 0 is the oldest
+ * entry and history_len - 1 the most recent.
+ */
+static char **history_slot(struct history *h, int i)
 {
-    fd_printf(current->fd, "\x1b[0K");
+    return &h->lines[(h->head + i) % h->max_len];
 }
 
-static void setCursorPos(struct current *current, int x)
+/* The slot of a line which has been erased, since it is a duplicate of a newer one */
+static char history_erased[] = "";
+
+#ifndef NO_HISTORY_ARENA
+/**
+ * Copies all history lines into a single fresh chunk and releases
+ * the old chunks, if they are mostly wasted space.
+ */
+static void history_compact(struct history *h)
 {
-    fd_printf(current->fd, "\x1b[1G\x1b[%dC", x);
+    struct history_chunk *old = h->chunks;
+    size_t size = h->arena_size;
+    size_t live = h->arena_live;
+    int j;
+
+    if (size <= HISTORY_CHUNK_MAX || live * 2 > size) {
+        return;
+    }
+
+    h->chunks = NULL;
+    h->arena_size = 0;
+    if (history_chunk_new(h, live) == NULL) {
+        h->chunks = old;
+        h->arena_size = size;
+        return;
+    }
+    /* The new chunk is exactly big enough for every line */
+    h->arena_live = 0;
+    for (j = 0; j < h->len; j++) {
+        char **slot = history_slot(h, j);
+        if (*slot && *slot != history_erased) {
+            *slot = history_strdup(h, *slot);
+        }
+    }
+    history_arena_free(old);
 }
+#endif
 
-/**
- * Reads a char from 'fd', waiting at most 'timeout' milliseconds.
+/* The binary history file format, see linenoiseCtxSetHistoryFormat().
  *
- * A timeout of -1 means to wait forever.
+ *   magic    HISTORY_MAGIC
+ *   records  for each line: its length (4 bytes), checksum (4 bytes,
+ *            if LINENOISE_HISTORY_CHECKSUM), time (8 bytes, if
+ *            LINENOISE_HISTORY_TIMESTAMP), the line itself and a null
+ *   index    the offset of each record (4 bytes)
+ *   footer   the offset of the index, the number of lines and the
+ *            flags (4 bytes each), then HISTORY_FOOTER_MAGIC
  *
- * Returns -1 if no char is received within the time or an error occurs.
+ * Numbers are little endian. The footer leads straight to the index, and
+ * the index to the last lines, so loading needn't read the rest of the file.
+ * The lines are only read once something looks at them, see history_get().
  */
-static int fd_read_char(int fd, int timeout)
+#define HISTORY_MAGIC "\x89LNH\r\n\x1a\n"
+#define HISTORY_MAGIC_LEN 8
+#define HISTORY_FOOTER_MAGIC "LNHI"
+#define HISTORY_FOOTER_LEN 16
+#define HISTORY_FLAGS (LINENOISE_HISTORY_CHECKSUM | LINENOISE_HISTORY_TIMESTAMP)
+
+struct history_file {
+    const unsigned char *data;  /* The whole file */
+    size_t size;
+    size_t end;         /* Offset of the index, where the records end */
+    const unsigned char *index; /* The offset of the record of line 'first' */
+    unsigned first;     /* Sequence number of the first line in 'index' */
+    int flags;          /* LINENOISE_HISTORY_CHECKSUM etc. */
+    int mapped;         /* Whether 'data' is mapped rather than allocated */
+};
+
+static unsigned get_u32(const unsigned char *p)
 {
-    int rcode;
-    struct pollfd p;
-    unsigned char c;
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned)p[3] << 24;
+}
 
-    p.fd = fd;
-    p.events = POLLIN;
+static void put_u32(unsigned char *p, unsigned v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
 
-    rcode = poll(&p, 1, timeout);
-    if (rcode <= 0) return -1;	/* timeout or interrupt */
+/* FNV-1a, used both as the checksum of a line and to find duplicates */
+static unsigned history_hash(const char *str, size_t len)
+{
+    unsigned hash = 2166136261u;
 
-    if (read(fd, &c, 1) != 1) {
-        return -1;
+    while (len--) {
+        hash = (hash ^ (unsigned char)*str++) * 16777619u;
     }
-    return c;
+    return hash;
+}
+
+static size_t history_record_header(int flags)
+{
+    return 4 + (flags & LINENOISE_HISTORY_CHECKSUM ? 4 : 0) + (flags & LINENOISE_HISTORY_TIMESTAMP ? 8 : 0);
 }
 
 /**
- * Reads a complete utf-8 character
- * and returns the unicode value, or -1 on error.
+ * Returns the line with sequence number 'seq' from the binary history file,
+ * and stores its time in '*when'. A line which is damaged is returned as "".
  */
-static int fd_read(struct current *current)
+static const char *history_file_line(const struct history_file *file, unsigned seq, time_t *when)
 {
-#ifdef USE_UTF8
-    char buf[4];
-    int n;
-    int i;
-    int c;
+    size_t hdr = history_record_header(file->flags);
+    size_t off = get_u32(file->index + 4 * (seq - file->first));
+    const unsigned char *rec = file->data + off;
+    size_t len;
 
-    if (read(current->fd, &buf[0], 1) != 1) {
-        return -1;
+    if (off < HISTORY_MAGIC_LEN || off > file->end || file->end - off <= hdr) {
+        return "";
     }
-    n = utf8_charlen(buf[0]);
-    if (n < 1 || n > 3) {
-        return -1;
+    len = get_u32(rec);
+    if (len >= file->end - off - hdr || rec[hdr + len] != 0) {
+        return "";
     }
-    for (i = 1; i < n; i++) {
-        if (read(current->fd, &buf[i], 1) != 1) {
-            return -1;
-        }
+    if ((file->flags & LINENOISE_HISTORY_CHECKSUM) && get_u32(rec + 4) != history_hash((const char *)rec + hdr, len)) {
+        return "";
     }
-    buf[n] = 0;
-    /* decode and return the character */
-    utf8_tounicode(buf, &c);
-    return c;
-#else
-    return fd_read_char(current->fd, -1);
-#endif
+    if (file->flags & LINENOISE_HISTORY_TIMESTAMP) {
+        *when = (time_t)(get_u32(rec + hdr - 8) | (unsigned long long)get_u32(rec + hdr - 4) << 32);
+    }
+    return (const char *)rec + hdr;
 }
 
-static int getWindowSize(struct current *current)
+static void history_file_unmap(const struct history_file *file)
 {
-    struct winsize ws;
-
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col != 0) {
-        current->cols = ws.ws_col;
-        return 0;
+#ifdef USE_TERMIOS
+    if (file->mapped) {
+        munmap((void *)file->data, file->size);
+        return;
     }
+#endif
+    freeFn((void *)file->data);
+}
 
-    /* Failed to query the window size. Perhaps we are on a serial terminal.
-     * Try to query the width by sending the cursor as far to the right
-     * and reading back the cursor position.
-     * Note that this is only done once per call to linenoise rather than
-     * every time the line is refreshed for efficiency reasons.
-     */
-    if (current->cols == 0) {
-        current->cols = 80;
-
-        /* Move cursor far right and report cursor position */
-        fd_printf(current->fd, "\x1b[999G" "\x1b[6n");
-
-        /* Parse the response: ESC [ rows ; cols R */
-        if (fd_read_char(current->fd, 100) == 0x1b && fd_read_char(current->fd, 100) == '[') {
-            int n = 0;
-            while (1) {
-                int ch = fd_read_char(current->fd, 100);
-                if (ch == ';') {
-                    /* Ignore rows */
-                    n = 0;
-                }
-                else if (ch == 'R') {
-                    /* Got cols */
-                    if (n != 0 && n < 1000) {
-                        current->cols = n;
-                    }
-                    break;
-                }
-                else if (ch >= 0 && ch <= '9') {
-                    n = n * 10 + ch - '0';
-                }
-                else {
-                    break;
-                }
-            }
-        }
+static void history_file_close(struct history *h)
+{
+    if (h->file) {
+        history_file_unmap(h->file);
+        freeFn(h->file);
+        h->file = NULL;
     }
-    return 0;
 }
 
 /**
- * If escape (27) was received, reads subsequent
- * chars to determine if this is a known special key.
- *
- * Returns SPECIAL_NONE if unrecognised, or -1 if EOF.
- *
- * If no additional char is received within a short time,
- * 27 is returned.
+ * Returns history entry 'i', first reading it from the history file if need be,
+ * or NULL if it has been erased.
  */
-static int check_special(int fd)
+static const char *history_get(struct history *h, int i)
 {
-    int c = fd_read_char(fd, 50);
-    int c2;
-
-    if (c < 0) {
-        return 27;
-    }
+    char **slot = history_slot(h, i);
 
-    c2 = fd_read_char(fd, 50);
-    if (c2 < 0) {
-        return c2;
+    if (*slot == history_erased) {
+        return NULL;
     }
-    if (c == '[' || c == 'O') {
-        /* Potential arrow key */
-        switch (c2) {
-            case 'A':
-                return SPECIAL_UP;
-            case 'B':
-                return SPECIAL_DOWN;
-            case 'C':
-                return SPECIAL_RIGHT;
-            case 'D':
-                return SPECIAL_LEFT;
-            case 'F':
-                return SPECIAL_END;
-            case 'H':
-                return SPECIAL_HOME;
-        }
-    }
-    if (c == '[' && c2 >= '1' && c2 <= '8') {
-        /* extended escape */
-        c = fd_read_char(fd, 50);
-        if (c == '~') {
-            switch (c2) {
-                case '3':
-                    return SPECIAL_DELETE;
-                case '7':
-                    return SPECIAL_HOME;
-                case '8':
-                    return SPECIAL_END;
-            }
-        }
-        while (c != -1 && c != '~') {
-            /* .e.g \e[12~ or '\e[11;2~   discard the complete sequence */
-            c = fd_read_char(fd, 50);
+    if (*slot == NULL) {
+        *slot = history_strdup(h, history_file_line(h->file, h->seq - h->len + i, &h->times[slot - h->lines]));
+        if (*slot == NULL) {
+            return "";
         }
     }
-
-    return SPECIAL_NONE;
+    return *slot;
 }
-#elif defined(USE_WINCONSOLE)
 
-static DWORD orig_consolemode = 0;
+/**
+ * Returns the history line with sequence number 'seq',
+ * or NULL if it is no longer in the history.
+ */
+static const char *history_line_seq(struct history *h, unsigned seq)
+{
+    unsigned i = seq - (h->seq - h->len);
 
-static int enableRawMode(struct current *current) {
-    DWORD n;
-    INPUT_RECORD irec;
+    return i < (unsigned)h->len ? history_get(h, i) : NULL;
+}
 
-    current->outh = GetStdHandle(STD_OUTPUT_HANDLE);
-    current->inh = GetStdHandle(STD_INPUT_HANDLE);
+#ifndef NO_HISTORY_INDEX
+/* Trigram index of the history, used by reverse-i-search.
+ * Maps every 3 byte sequence to the ascending sequence numbers of the
+ * history lines containing it. It is built once a search starts, a few
+ * lines at a time between keys, and is then kept up to date as lines are
+ * added. Lines which have since been discarded from the history are
+ * skipped when a list is read.
+ */
+struct trigram {
+    unsigned key;   /* 0 if the bucket is unused */
+    unsigned *seqs;
+    int start;      /* Entries before this are known to be discarded */
+    int len;
+    int max;
+};
 
-    if (!PeekConsoleInput(current->inh, &irec, 1, &n)) {
-        return -1;
-    }
-    if (getWindowSize(current) != 0) {
-        return -1;
-    }
-    if (GetConsoleMode(current->inh, &orig_consolemode)) {
-        SetConsoleMode(current->inh, ENABLE_PROCESSED_INPUT);
-    }
-    return 0;
-}
+#define TRIGRAM_KEY(P) (0x1000000 | ((unsigned char)(P)[0] << 16) | ((unsigned char)(P)[1] << 8) | (unsigned char)(P)[2])
+#define TRIGRAM_HASH(K) (((K) * 2654435761u) >> 8)
+#define TRIGRAM_STEP 1024 /* Lines indexed by each history_index_step() */
 
-static void disableRawMode(struct current *current)
+static struct trigram *trigram_find(struct history *h, unsigned key)
 {
-    SetConsoleMode(current->inh, orig_consolemode);
+    int i = TRIGRAM_HASH(key) & (h->index_size - 1);
+
+    while (h->index[i].key && h->index[i].key != key) {
+        i = (i + 1) & (h->index_size - 1);
+    }
+    return &h->index[i];
 }
 
-static void clearScreen(struct current *current)
+/* Returns the list for 'key', creating it if necessary, or NULL if out of memory */
+static struct trigram *trigram_add(struct history *h, unsigned key)
 {
-    COORD topleft = { 0, 0 };
-    DWORD n;
+    struct trigram *t;
 
-    FillConsoleOutputCharacter(current->outh, ' ',
-        current->cols * current->rows, topleft, &n);
-    FillConsoleOutputAttribute(current->outh,
-        FOREGROUND_RED | FOREGROUND_BLUE | FOREGROUND_GREEN,
-        current->cols * current->rows, topleft, &n);
-    SetConsoleCursorPosition(current->outh, topleft);
-}
+    if (h->index_used * 2 >= h->index_size) {
+        /* Keep the table at most half full */
+        struct trigram *old = h->index;
+        int oldsize = h->index_size;
+        int i;
 
-static void cursorToLeft(struct current *current)
-{
-    COORD pos = { 0, current->y };
-    DWORD n;
+        h->index = (struct trigram *)mallocFn(sizeof(*h->index) * oldsize * 2);
+        if (h->index == NULL) {
+            h->index = old;
+            return NULL;
+        }
+        memset(h->index, 0, sizeof(*h->index) * oldsize * 2);
+        h->index_size = oldsize * 2;
+        for (i = 0; i < oldsize; i++) {
+            if (old[i].key) {
+                *trigram_find(h, old[i].key) = old[i];
+            }
+        }
+        freeFn(old);
+    }
 
-    FillConsoleOutputAttribute(current->outh,
-        FOREGROUND_RED | FOREGROUND_BLUE | FOREGROUND_GREEN, current->cols, pos, &n);
-    current->x = 0;
+    t = trigram_find(h, key);
+    if (!t->key) {
+        t->key = key;
+        h->index_used++;
+    }
+    return t;
 }
 
-static int outputChars(struct current *current, const char *buf, int len)
+static void history_index_line(struct history *h, const char *line, unsigned seq)
 {
-    COORD pos = { current->x, current->y };
-    DWORD n;
-	
-    WriteConsoleOutputCharacterA(current->outh, buf, len, pos, &n);
-    current->x += len;
-    return 0;
-}
+    int len = strlen(line);
+    int i;
 
-static void outputControlChar(struct current *current, char ch)
-{
-    COORD pos = { current->x, current->y };
-    DWORD n;
+    for (i = 0; i + 3 <= len; i++) {
+        struct trigram *t = trigram_add(h, TRIGRAM_KEY(line + i));
+        if (t == NULL) {
+            return;
+        }
+        if (t->len && t->seqs[t->len - 1] == seq) {
+            /* Already seen in this line */
+            continue;
+        }
+        if (t->len == t->max) {
+            unsigned *seqs;
 
-    FillConsoleOutputAttribute(current->outh, BACKGROUND_INTENSITY, 2, pos, &n);
-    outputChars(current, "^", 1);
-    outputChars(current, &ch, 1);
+            /* Drop discarded lines before growing the list */
+            while (t->start < t->len && history_line_seq(h, t->seqs[t->start]) == NULL) {
+                t->start++;
+            }
+            if (t->start > t->len / 2) {
+                t->len -= t->start;
+                memmove(t->seqs, t->seqs + t->start, sizeof(*t->seqs) * t->len);
+                t->start = 0;
+            }
+            else {
+                int max = t->max ? t->max * 2 : 4;
+                seqs = (unsigned *)reallocFn(t->seqs, sizeof(*seqs) * max);
+                if (seqs == NULL) {
+                    return;
+                }
+                t->seqs = seqs;
+                t->max = max;
+            }
+        }
+        t->seqs[t->len++] = seq;
+    }
 }
 
-static void eraseEol(struct current *current)
+static void history_index_free(struct history *h)
 {
-    COORD pos = { current->x, current->y };
-    DWORD n;
+    int i;
 
-    FillConsoleOutputCharacter(current->outh, ' ', current->cols - current->x, pos, &n);
+    for (i = 0; i < h->index_size; i++) {
+        freeFn(h->index[i].seqs);
+    }
+    freeFn(h->index);
+    h->index = NULL;
+    h->index_size = 0;
+    h->index_used = 0;
 }
 
-static void setCursorPos(struct current *current, int x)
+/* Returns 1 if the index covers every line of the history */
+static int history_index_ready(struct history *h)
 {
-    COORD pos = { x, current->y };
-
-    SetConsoleCursorPosition(current->outh, pos);
-    current->x = x;
+    return h->index && h->index_next == h->seq;
 }
 
-static int fd_read(struct current *current)
+/**
+ * Adds the next TRIGRAM_STEP lines to the index, creating it if need be,
+ * so that building it never holds up a key for long.
+ *
+ * Returns 1 once the index is complete.
+ */
+static int history_index_step(struct history *h)
 {
-    while (1) {
-        INPUT_RECORD irec;
-        DWORD n;
-        if (WaitForSingleObject(current->inh, INFINITE) != WAIT_OBJECT_0) {
-            break;
-        }
-        if (!ReadConsoleInput (current->inh, &irec, 1, &n)) {
-            break;
+    int n;
+
+    if (h->index == NULL) {
+        h->index_size = 1024;
+        h->index = (struct trigram *)mallocFn(sizeof(*h->index) * h->index_size);
+        if (h->index == NULL) {
+            h->index_size = 0;
+            return 0;
         }
-        if (irec.EventType == KEY_EVENT && irec.Event.KeyEvent.bKeyDown) {
-            KEY_EVENT_RECORD *k = &irec.Event.KeyEvent;
-            if (k->dwControlKeyState & ENHANCED_KEY) {
-                switch (k->wVirtualKeyCode) {
-                 case VK_LEFT:
-                    return SPECIAL_LEFT;
-                 case VK_RIGHT:
-                    return SPECIAL_RIGHT;
-                 case VK_UP:
-                    return SPECIAL_UP;
-                 case VK_DOWN:
-                    return SPECIAL_DOWN;
-                 case VK_DELETE:
-                    return SPECIAL_DELETE;
-                 case VK_HOME:
-                    return SPECIAL_HOME;
-                 case VK_END:
-                    return SPECIAL_END;
-                }
-            }
-            /* Note that control characters are already translated in AsciiChar */
-            else {
-#ifdef USE_UTF8
-                return k->uChar.UnicodeChar;
-#else
-                return k->uChar.AsciiChar;
-#endif
-            }
+        memset(h->index, 0, sizeof(*h->index) * h->index_size);
+        h->index_next = h->seq - h->len;
+    }
+    if (h->seq - h->index_next > (unsigned)h->len) {
+        /* Lines not reached yet have been discarded */
+        h->index_next = h->seq - h->len;
+    }
+    for (n = 0; n < TRIGRAM_STEP && h->index_next != h->seq; n++) {
+        const char *line = history_line_seq(h, h->index_next);
+        if (line) {
+            history_index_line(h, line, h->index_next);
         }
+        h->index_next++;
     }
-    return -1;
+    return h->index_next == h->seq;
 }
+#endif
 
-static int getWindowSize(struct current *current)
+/* Frees the line in 'slot', which may have been erased or not read yet */
+static void history_slot_free(struct history *h, char **slot)
 {
-    CONSOLE_SCREEN_BUFFER_INFO info;
-    if (!GetConsoleScreenBufferInfo(current->outh, &info)) {
-        return -1;
+    if (*slot == history_erased) {
+        h->erased--;
     }
-    current->cols = info.dwSize.X;
-    current->rows = info.dwSize.Y;
-    if (current->cols <= 0 || current->rows <= 0) {
-        current->cols = 80;
-        return -1;
+    else {
+        history_strfree(h, *slot);
     }
-    current->y = info.dwCursorPosition.Y;
-    current->x = info.dwCursorPosition.X;
-    return 0;
+    *slot = NULL;
 }
+
+static void history_free(struct history *h) {
+#ifndef NO_HISTORY_INDEX
+    history_index_free(h);
 #endif
+    if (h->lines) {
+#ifdef NO_HISTORY_ARENA
+        int j;
 
-static int utf8_getchars(char *buf, int c)
-{
-#ifdef USE_UTF8
-    return utf8_fromunicode(buf, c);
+        for (j = 0; j < h->len; j++)
+            history_slot_free(h, history_slot(h, j));
 #else
-    *buf = c;
-    return 1;
+        history_arena_free(h->chunks);
+        h->chunks = NULL;
+        h->arena_size = 0;
+        h->arena_live = 0;
 #endif
+        freeFn(h->lines);
+        freeFn(h->times);
+        h->lines = NULL;
+        h->times = NULL;
+    }
+    history_file_close(h);
+    freeFn(h->dups);
+    h->dups = NULL;
+    h->dups_size = 0;
+    h->erased = 0;
+    h->len = 0;
+    h->head = 0;
+    h->seq = 0;
+    h->written = 0;
 }
 
+/* An entry of the table of distinct lines, for erasing older duplicates.
+ * The table uses linear probing and is at most half full.
+ */
+#define HISTORY_NO_DUP 0xffffffffu
+
+struct history_dup {
+    unsigned hash;      /* history_hash() of the line */
+    unsigned seq;       /* Sequence number of the line, or HISTORY_NO_DUP */
+};
+
 /**
- * Returns the unicode character at the given offset,
- * or -1 if none.
+ * Returns the entry of 'dups' for 'line', or if there is none
+ * the empty entry where it would go.
  */
-static int get_char(struct current *current, int pos)
+static struct history_dup *history_dup_find(struct history *h, const char *line, unsigned hash)
 {
-    if (pos >= 0 && pos < current->chars) {
-        int c;
-        int i = utf8_index(current->buf, pos);
-        (void)utf8_tounicode(current->buf + i, &c);
-        return c;
+    unsigned mask = h->dups_size - 1;
+    unsigned i = hash & mask;
+
+    while (h->dups[i].seq != HISTORY_NO_DUP) {
+        if (h->dups[i].hash == hash) {
+            const char *dup = history_line_seq(h, h->dups[i].seq);
+            if (dup && strcmp(dup, line) == 0) {
+                break;
+            }
+        }
+        i = (i + 1) & mask;
     }
-    return -1;
+    return &h->dups[i];
 }
 
-static void refreshLine(const char *prompt, struct current *current)
+/* Removes 'dup' from the table, moving back any entries after it which would no longer be found */
+static void history_dup_remove(struct history *h, struct history_dup *dup)
 {
-    int plen;
-    int pchars;
-    int backup = 0;
-    int i;
-    const char *buf = current->buf;
-    int chars = current->chars;
-    int pos = current->pos;
-    int b;
-    int ch;
-    int n;
-
-    /* Should intercept SIGWINCH. For now, just get the size every time */
-    getWindowSize(current);
-
-    plen = strlen(prompt);
-    pchars = utf8_strlen(prompt, plen);
+    unsigned mask = h->dups_size - 1;
+    unsigned i = dup - h->dups;
+    unsigned j = i;
 
-    /* Account for a line which is too long to fit in the window.
-     * Note that control chars require an extra column
-     */
+    for (;;) {
+        unsigned home;
 
-    /* How many cols are required to the left of 'pos'?
-     * The prompt, plus one extra for each control char
-     */
-    n = pchars + utf8_strlen(buf, current->len);
-    b = 0;
-    for (i = 0; i < pos; i++) {
-        b += utf8_tounicode(buf + b, &ch);
-        if (ch < ' ') {
-            n++;
+        j = (j + 1) & mask;
+        if (h->dups[j].seq == HISTORY_NO_DUP) {
+            break;
+        }
+        home = h->dups[j].hash & mask;
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+            /* Still found from its home */
+            continue;
         }
+        h->dups[i] = h->dups[j];
+        i = j;
     }
+    h->dups[i].seq = HISTORY_NO_DUP;
+}
 
-    /* If too many are need, strip chars off the front of 'buf'
-     * until it fits. Note that if the current char is a control character,
-     * we need one extra col.
-     */
-    if (current->pos < current->chars && get_char(current, current->pos) < ' ') {
-        n++;
+/* Erases the line with sequence number 'seq', leaving its slot empty */
+static void history_erase(struct history *h, unsigned seq)
+{
+    char **slot = history_slot(h, seq - (h->seq - h->len));
+
+    history_strfree(h, *slot);
+    *slot = history_erased;
+    h->erased++;
+}
+
+/* Builds the table of distinct lines, erasing any older duplicates */
+static int history_dups_build(struct history *h)
+{
+    int size = 16;
+    int j;
+
+    while (size < h->max_len * 2) {
+        size *= 2;
+    }
+    h->dups = (struct history_dup *)mallocFn(sizeof(*h->dups) * size);
+    if (h->dups == NULL) {
+        return 0;
     }
+    h->dups_size = size;
+    memset(h->dups, 0xff, sizeof(*h->dups) * size);
+    for (j = 0; j < h->len; j++) {
+        const char *line = history_get(h, j);
+
+        if (line) {
+            unsigned hash = history_hash(line, strlen(line));
+            struct history_dup *dup = history_dup_find(h, line, hash);
 
-    while (n >= current->cols) {
-        b = utf8_tounicode(buf, &ch);
-        if (ch < ' ') {
-            n--;
+            if (dup->seq != HISTORY_NO_DUP) {
+                history_erase(h, dup->seq);
+            }
+            dup->hash = hash;
+            dup->seq = h->seq - h->len + j;
         }
-        n--;
-        buf += b;
-        pos--;
-        chars--;
     }
+    return 1;
+}
 
-    /* Cursor to left edge, then the prompt */
-    cursorToLeft(current);
-    outputChars(current, prompt, plen);
+/**
+ * Moves the remaining lines down over the erased slots. This renumbers them,
+ * so the trigram index and the table of distinct lines are rebuilt when next needed.
+ */
+static void history_squeeze(struct history *h)
+{
+    /* The lines not yet written to the file are the last ones */
+    unsigned unwritten = h->seq - h->written;
+    int from = unwritten < (unsigned)h->len ? h->len - (int)unwritten : 0;
+    int kept = 0;
+    int n = 0;
+    int j;
 
-    /* Now the current buffer content */
+    for (j = 0; j < h->len; j++) {
+        char **slot = history_slot(h, j);
 
-    /* Need special handling for control characters.
-     * If we hit 'cols', stop.
-     */
-    b = 0; /* unwritted bytes */
-    n = 0; /* How many control chars were written */
-    for (i = 0; i < chars; i++) {
-        int ch;
-        int w = utf8_tounicode(buf + b, &ch);
-        if (ch < ' ') {
-            n++;
+        if (*slot != history_erased) {
+            char **dest = history_slot(h, n++);
+
+            *dest = *slot;
+            h->times[dest - h->lines] = h->times[slot - h->lines];
+            if (j >= from) {
+                kept++;
+            }
         }
-        if (pchars + i + n >= current->cols) {
-            break;
+    }
+    h->len = n;
+    /* So that linenoiseCtxHistoryAppend() still finds just those */
+    h->written = h->seq - kept;
+    h->erased = 0;
+#ifndef NO_HISTORY_INDEX
+    history_index_free(h);
+#endif
+    freeFn(h->dups);
+    h->dups = NULL;
+    h->dups_size = 0;
+}
+
+/* Allocates the slots for the lines, if need be */
+static int history_alloc(struct history *h)
+{
+    if (h->lines == NULL) {
+        h->lines = (char **)mallocFn(sizeof(char*)*h->max_len);
+        h->times = (time_t *)mallocFn(sizeof(time_t)*h->max_len);
+        if (h->lines == NULL || h->times == NULL) {
+            freeFn(h->lines);
+            freeFn(h->times);
+            h->lines = NULL;
+            h->times = NULL;
+            return 0;
         }
-        if (ch < ' ') {
-            /* A control character, so write the buffer so far */
-            outputChars(current, buf, b);
-            buf += b + w;
-            b = 0;
-            outputControlChar(current, ch + '@');
-            if (i < pos) {
-                backup++;
+        memset(h->lines,0,(sizeof(char*)*h->max_len));
+        memset(h->times,0,(sizeof(time_t)*h->max_len));
+    }
+    return 1;
+}
+
+/* Adds 'line', added at time 'when', as the newest entry, dropping the oldest one if full */
+static int history_add(struct history *h, const char *line, time_t when)
+{
+    struct history_dup *dup = NULL;
+    unsigned hash = 0;
+    char *linecopy;
+
+    if (h->max_len == 0) return 0;
+    if (!history_alloc(h)) return 0;
+
+    if (h->erase_dups) {
+        hash = history_hash(line, strlen(line));
+        if (h->dups || history_dups_build(h)) {
+            dup = history_dup_find(h, line, hash);
+            if (dup->seq != HISTORY_NO_DUP) {
+                if (dup->seq == h->seq - 1) {
+                    /* Already the newest line */
+                    return 0;
+                }
+                history_erase(h, dup->seq);
+                history_dup_remove(h, dup);
             }
         }
-        else {
-            b += w;
+    }
+
+    if (h->len == h->max_len && h->erased > h->len / 8) {
+        /* Full, but there is room enough in the erased slots */
+        history_squeeze(h);
+        if (h->erase_dups && h->dups_size == 0) {
+            history_dups_build(h);
         }
     }
-    outputChars(current, buf, b);
+    if (h->len == h->max_len) {
+        /* Full, so the oldest entry makes way for the new one */
+        char **slot = history_slot(h, 0);
 
-    /* Erase to right, move cursor to original position */
-    eraseEol(current);
-    setCursorPos(current, pos + pchars + backup);
+        if (h->dups && *slot != history_erased) {
+            history_dup_remove(h, history_dup_find(h, *slot, history_hash(*slot, strlen(*slot))));
+        }
+        history_slot_free(h, slot);
+        h->head = (h->head + 1) % h->max_len;
+        h->len--;
+    }
+    linecopy = history_strdup(h, line);
+    if (!linecopy) return 0;
+    *history_slot(h, h->len) = linecopy;
+    h->times[history_slot(h, h->len) - h->lines] = when;
+    h->len++;
+#ifndef NO_HISTORY_INDEX
+    if (history_index_ready(h)) {
+        history_index_line(h, linecopy, h->seq);
+        h->index_next++;
+    }
+#endif
+    h->seq++;
+    if (h->dups) {
+        /* Where it goes may have moved if the oldest line was removed */
+        dup = history_dup_find(h, linecopy, hash);
+        dup->hash = hash;
+        dup->seq = h->seq - 1;
+    }
+    if (h->erased > h->len / 2) {
+        history_squeeze(h);
+    }
+    return 1;
 }
 
-static void set_current(struct current *current, const char *str)
+#ifndef NO_SHARED_HISTORY
+/* A history shared by several contexts, see linenoiseCtxSetSharedHistory().
+ *
+ * Lines are appended to a list of segments and never change once added, so
+ * readers need no lock. They only look at the lines below 'end', which is
+ * stored after the line itself. Only reading is lock-free: adding a line
+ * spins on a lock, which only ever contends with other writers.
+ *
+ * Each context copies the new lines into its own history (history_sync())
+ * so that the editor itself never looks at the shared lines.
+ *
+ * Segments which only hold lines older than the last 'max_len' are unlinked,
+ * then freed once no reader can still be looking at them.
+ */
+#define SHARED_SEGMENT 256
+
+struct shared_segment {
+    unsigned base;      /* Sequence number of lines[0] */
+    char *lines[SHARED_SEGMENT];
+    unsigned owners[SHARED_SEGMENT]; /* The id of the context which added each line */
+    struct shared_segment *next;    /* The next newer segment */
+    struct shared_segment *retired; /* The next unlinked segment */
+};
+
+struct linenoiseSharedHistory {
+    int max_len;
+    unsigned end;       /* Sequence number of the next line */
+    struct shared_segment *oldest;
+    struct shared_segment *newest;  /* Only used by writers */
+    struct shared_segment *retired; /* Unlinked, waiting for the readers to go */
+    int readers;        /* Number of readers between shared_enter() and shared_leave() */
+    char lock;          /* Held while adding a line */
+};
+
+#define shared_load(P) __atomic_load_n((P), __ATOMIC_SEQ_CST)
+#define shared_store(P, V) __atomic_store_n((P), (V), __ATOMIC_SEQ_CST)
+
+static void shared_enter(linenoiseSharedHistory *sh)
 {
-    strncpy(current->buf, str, current->bufmax);
-    current->buf[current->bufmax - 1] = 0;
-    current->len = strlen(current->buf);
-    current->pos = current->chars = utf8_strlen(current->buf, current->len);
+    __atomic_add_fetch(&sh->readers, 1, __ATOMIC_SEQ_CST);
 }
 
-static int has_room(struct current *current, int bytes)
+static void shared_leave(linenoiseSharedHistory *sh)
 {
-    return current->len + bytes < current->bufmax - 1;
+    __atomic_sub_fetch(&sh->readers, 1, __ATOMIC_SEQ_CST);
 }
 
-/**
- * Removes the char at 'pos'.
+static void shared_segment_free(struct shared_segment *seg, unsigned end)
+{
+    unsigned j;
+
+    for (j = 0; j < SHARED_SEGMENT && seg->base + j < end; j++) {
+        freeFn(seg->lines[j]);
+    }
+    freeFn(seg);
+}
+
+/* Frees the unlinked segments if nobody can be reading them. Called with the lock held.
  *
- * Returns 1 if the line needs to be refreshed, 2 if not
- * and 0 if nothing was removed
+ * A reader which entered before a segment was unlinked is still counted, and
+ * one which entered after can't find the segment any more.
  */
-static int remove_char(struct current *current, int pos)
+static void shared_reclaim(linenoiseSharedHistory *sh)
 {
-    if (pos >= 0 && pos < current->chars) {
-        int p1, p2;
-        int ret = 1;
-        p1 = utf8_index(current->buf, pos);
-        p2 = p1 + utf8_index(current->buf + p1, 1);
+    struct shared_segment *seg = sh->retired;
 
-#ifdef USE_TERMIOS
-        /* optimise remove char in the case of removing the last char */
-        if (current->pos == pos + 1 && current->pos == current->chars) {
-            if (current->buf[pos] >= ' ' && utf8_strlen(current->prompt, -1) + utf8_strlen(current->buf, current->len) < current->cols - 1) {
-                ret = 2;
-                fd_printf(current->fd, "\b \b");
-            }
-        }
-#endif
+    if (seg == NULL || shared_load(&sh->readers)) {
+        return;
+    }
+    sh->retired = NULL;
+    while (seg) {
+        struct shared_segment *next = seg->retired;
+        shared_segment_free(seg, seg->base + SHARED_SEGMENT);
+        seg = next;
+    }
+}
 
-        /* Move the null char too */
-        memmove(current->buf + p1, current->buf + p2, current->len - p2 + 1);
-        current->len -= (p2 - p1);
-        current->chars--;
+static int shared_add(linenoiseSharedHistory *sh, const char *line, unsigned owner)
+{
+    struct shared_segment *seg;
+    unsigned end;
+    char *linecopy = NULL;
 
-        if (current->pos > pos) {
-            current->pos--;
+    while (__atomic_test_and_set(&sh->lock, __ATOMIC_ACQUIRE)) {
+    }
+    end = sh->end;
+    seg = sh->newest;
+
+    /* do not insert duplicate lines into history */
+    if (end && strcmp(line, seg->lines[end - 1 - seg->base]) == 0) {
+        goto out;
+    }
+    linecopy = ln_strdup(line);
+    if (linecopy == NULL) {
+        goto out;
+    }
+    if (seg == NULL || end - seg->base == SHARED_SEGMENT) {
+        struct shared_segment *newseg = (struct shared_segment *)mallocFn(sizeof(*newseg));
+
+        if (newseg == NULL) {
+            freeFn(linecopy);
+            linecopy = NULL;
+            goto out;
         }
-        return ret;
+        newseg->base = end;
+        newseg->next = NULL;
+        newseg->retired = NULL;
+        if (seg) {
+            shared_store(&seg->next, newseg);
+        }
+        else {
+            shared_store(&sh->oldest, newseg);
+        }
+        sh->newest = seg = newseg;
     }
-    return 0;
+    seg->lines[end - seg->base] = linecopy;
+    seg->owners[end - seg->base] = owner;
+    shared_store(&sh->end, end + 1);
+
+    while (sh->oldest->next && sh->oldest->base + SHARED_SEGMENT + sh->max_len <= end + 1) {
+        seg = sh->oldest;
+        shared_store(&sh->oldest, seg->next);
+        seg->retired = sh->retired;
+        sh->retired = seg;
+    }
+    shared_reclaim(sh);
+out:
+    __atomic_clear(&sh->lock, __ATOMIC_RELEASE);
+    return linecopy != NULL;
 }
 
-/**
- * Insert 'ch' at position 'pos'
- *
- * Returns 1 if the line needs to be refreshed, 2 if not
- * and 0 if nothing was inserted (no room)
+/* Copies any lines added to the shared history since last time into the
+ * context's own history. Returns the number of lines copied.
  */
-static int insert_char(struct current *current, int pos, int ch)
+static int history_sync(linenoiseContext *ctx)
 {
-    char buf[3];
-    int n = utf8_getchars(buf, ch);
-
-    if (has_room(current, n) && pos >= 0 && pos <= current->chars) {
-        int p1, p2;
-        int ret = 1;
-        p1 = utf8_index(current->buf, pos);
-        p2 = p1 + n;
+    linenoiseSharedHistory *sh = ctx->shared;
+    struct shared_segment *seg;
+    unsigned end, seq;
+    int count = 0;
 
-#ifdef USE_TERMIOS
-        /* optimise the case where adding a single char to the end and no scrolling is needed */
-        if (current->pos == pos && current->chars == pos) {
-            if (ch >= ' ' && utf8_strlen(current->prompt, -1) + utf8_strlen(current->buf, current->len) < current->cols - 1) {
-                IGNORE_RC(write(current->fd, buf, n));
-                ret = 2;
-            }
+    if (sh == NULL || shared_load(&sh->end) == ctx->synced) {
+        return 0;
+    }
+    shared_enter(sh);
+    seg = shared_load(&sh->oldest);
+    end = shared_load(&sh->end);
+
+    /* Lines which wouldn't fit anyway needn't be copied */
+    seq = ctx->synced;
+    if (end - seq > (unsigned)ctx->history.max_len) {
+        seq = end - ctx->history.max_len;
+    }
+    if (seq < seg->base) {
+        seq = seg->base;
+    }
+    for (; seq < end; seq++) {
+        while (seq - seg->base >= SHARED_SEGMENT) {
+            seg = shared_load(&seg->next);
         }
+        count += history_add(&ctx->history, seg->lines[seq - seg->base], time(NULL));
+    }
+    shared_leave(sh);
+    ctx->synced = end;
+    return count;
+}
+#else
+static int shared_add(linenoiseSharedHistory *sh, const char *line, unsigned owner)
+{
+    (void)sh;
+    (void)line;
+    (void)owner;
+    return 0;
+}
+
+static int history_sync(linenoiseContext *ctx)
+{
+    (void)ctx;
+    return 0;
+}
 #endif
 
-        memmove(current->buf + p2, current->buf + p1, current->len - p1);
-        memcpy(current->buf + p1, buf, n);
-        current->len += n;
+#if defined(USE_TERMIOS)
+static void linenoiseAtExit(void);
+static int atexit_registered = 0; /* register atexit just 1 time */
 
-        current->chars++;
-        if (current->pos >= pos) {
-            current->pos++;
+static const char *unsupported_term[] = {"dumb","cons25",NULL};
+
+static int isUnsupportedTerm(void) {
+    char *term = getenv("TERM");
+
+    if (term) {
+        int j;
+        for (j = 0; unsupported_term[j]; j++) {
+            if (strcasecmp(term, unsupported_term[j]) == 0) {
+                return 1;
+            }
         }
-        return ret;
     }
     return 0;
 }
 
-/**
- * Returns 0 if no chars were removed or non-zero otherwise.
+/* gcc/glibc insists that we care about the return code of write! */
+#define IGNORE_RC(EXPR) if (EXPR) {}
+
+/* The window size is only asked for again once SIGWINCH says that it has changed.
+ * The handler is installed while any context is in raw mode, and also wakes
+ * the context most recently put in raw mode so that it redraws the line.
  */
-static int remove_chars(struct current *current, int pos, int n)
+static volatile sig_atomic_t winch_count;       /* Number of SIGWINCH received */
+static volatile sig_atomic_t winch_wakefd = -1; /* Written to on SIGWINCH */
+static int winch_users;                 /* Number of contexts in raw mode */
+static struct sigaction winch_old;      /* The handler to restore, and to pass SIGWINCH on to */
+
+static void winch_handler(int sig)
 {
-    int removed = 0;
-    while (n-- && remove_char(current, pos)) {
-        removed++;
+    int saved_errno = errno;
+
+    winch_count++;
+    if (winch_wakefd != -1) {
+        IGNORE_RC(write(winch_wakefd, "", 1));
+    }
+    errno = saved_errno;
+    if (!(winch_old.sa_flags & SA_SIGINFO) && winch_old.sa_handler != SIG_DFL && winch_old.sa_handler != SIG_IGN) {
+        winch_old.sa_handler(sig);
     }
-    return removed;
 }
 
-#ifndef NO_COMPLETION
-static linenoiseCompletionCallback *completionCallback = NULL;
-
-static void beep() {
-#ifdef USE_TERMIOS
-    fprintf(stderr, "\x7");
-    fflush(stderr);
-#endif
+static void winch_enable(linenoiseContext *ctx)
+{
+    if (ctx->winch) {
+        return;
+    }
+    ctx->winch = 1;
+    if (winch_users++ == 0) {
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = winch_handler;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGWINCH, &sa, &winch_old);
+    }
+    winch_wakefd = ctx->wakefd[1];
 }
 
-static void freeCompletions(linenoiseCompletions *lc) {
-    size_t i;
-    for (i = 0; i < lc->len; i++)
-        free(lc->cvec[i]);
-    free(lc->cvec);
+static void winch_disable(linenoiseContext *ctx)
+{
+    if (!ctx->winch) {
+        return;
+    }
+    ctx->winch = 0;
+    if (winch_wakefd == ctx->wakefd[1]) {
+        winch_wakefd = -1;
+    }
+    if (--winch_users == 0) {
+        sigaction(SIGWINCH, &winch_old, NULL);
+    }
 }
 
-static int completeLine(struct current *current) {
-    linenoiseCompletions lc = { 0, NULL };
-    int c = 0;
+static int ctx_wake_open(linenoiseContext *ctx);
 
-    completionCallback(current->buf,&lc);
-    if (lc.len == 0) {
-        beep();
-    } else {
-        size_t stop = 0, i = 0;
-
-        while(!stop) {
-            /* Show completion or original buffer */
-            if (i < lc.len) {
-                struct current tmp = *current;
-                tmp.buf = lc.cvec[i];
-                tmp.pos = tmp.len = strlen(tmp.buf);
-                tmp.chars = utf8_strlen(tmp.buf, tmp.len);
-                refreshLine(current->prompt, &tmp);
-            } else {
-                refreshLine(current->prompt, current);
-            }
+static int enableRawMode(struct current *current) {
+    linenoiseContext *ctx = current->ctx;
+    struct termios raw;
 
-            c = fd_read(current);
-            if (c == -1) {
-                break;
-            }
+    current->fd = ctx->infd;
+    current->outfd = ctx->outfd;
 
-            switch(c) {
-                case '\t': /* tab */
-		   if (lc.len == 1) {
-			   set_current(current,lc.cvec[0]);
-			   c = 0;
-			   stop = 1;
-			   break;
-		    }
-
-                    i = (i+1) % (lc.len+1);
-                    if (i == lc.len) beep();
-                    break;
-                case 27: /* escape */
-                    /* Re-show original buffer */
-                    if (i < lc.len) {
-                        refreshLine(current->prompt, current);
-                    }
-                    stop = 1;
-                    break;
-                default:
-                    /* Update buffer and return */
-                    if (i < lc.len) {
-			    set_current(current,lc.cvec[i]);
-                    }
-                    stop = 1;
-                    break;
-            }
-        }
+    if (!isatty(current->fd) || isUnsupportedTerm() ||
+        tcgetattr(current->fd, &ctx->orig_termios) == -1) {
+fatal:
+        errno = ENOTTY;
+        return -1;
     }
 
-    freeCompletions(&lc);
-    return c; /* Return last read character */
-}
-
-/* Register a callback function to be called for tab-completion. */
-void linenoiseSetCompletionCallback(linenoiseCompletionCallback *fn) {
-    completionCallback = fn;
-}
+    if (ctx == &default_context && !atexit_registered) {
+        atexit(linenoiseAtExit);
+        atexit_registered = 1;
+    }
 
-void linenoiseAddCompletion(linenoiseCompletions *lc, const char *str) {
-    lc->cvec = (char **)realloc(lc->cvec,sizeof(char*)*(lc->len+1));
-    lc->cvec[lc->len++] = strdup(str);
-}
+    raw = ctx->orig_termios;  /* modify the original mode */
+    /* input modes: no break, no CR to NL, no parity check, no strip char,
+     * no start/stop output control. */
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    /* output modes - disable post processing */
+    raw.c_oflag &= ~(OPOST);
+    /* control modes - set 8 bit chars */
+    raw.c_cflag |= (CS8);
+    /* local modes - choing off, canonical off, no extended functions,
+     * no signal chars (^Z,^C) */
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN) | ISIG;
+    /* control chars - set return condition: min number of bytes and timer.
+     * We want read to return every single byte, without timeout. */
+    raw.c_cc[VMIN] = 1; raw.c_cc[VTIME] = 0; /* 1 byte, no timer */
 
-#endif
+    /* put terminal in raw mode after flushing */
+    if (tcsetattr(current->fd,TCSADRAIN,&raw) < 0) {
+        goto fatal;
+    }
+    ctx->rawmode = 1;
+    ctx_wake_open(ctx);
+    winch_enable(ctx);
 
-static int linenoisePrompt(struct current *current) {
-    int history_index = 0;
+    if (ctx->bracketed_paste) {
+        IGNORE_RC(write(current->outfd, "\x1b[?2004h", 8));
+    }
 
-    /* The latest history entry is always our current buffer, that
-     * initially is just an empty string. */
-    linenoiseHistoryAdd("");
+    current->cols = 0;
+    return 0;
+}
 
-    set_current(current, "");
-    refreshLine(current->prompt, current);
+static void ctx_restore(linenoiseContext *ctx) {
+    if (ctx->rawmode && ctx->bracketed_paste) {
+        IGNORE_RC(write(ctx->outfd, "\x1b[?2004l", 8));
+    }
+    winch_disable(ctx);
+    /* Don't even check the return value as it's too late. */
+    if (ctx->rawmode && tcsetattr(ctx->infd,TCSADRAIN,&ctx->orig_termios) != -1)
+        ctx->rawmode = 0;
+}
 
-    while(1) {
-        int dir = -1;
-        int c = fd_read(current);
+static void disableRawMode(struct current *current) {
+    ctx_restore(current->ctx);
+}
 
+/* At exit we'll try to fix the terminal to the initial conditions. */
+static void linenoiseAtExit(void) {
+    ctx_restore(&default_context);
+    history_free(&default_context.history);
 #ifndef NO_COMPLETION
-        /* Only autocomplete when the callback is set. It returns < 0 when
-         * there was an error reading from fd. Otherwise it will return the
-         * character that should be handled next. */
-        if (c == 9 && completionCallback != NULL) {
-            c = completeLine(current);
-            /* Return on errors */
-            if (c < 0) return current->len;
-        }
+    completion_free(&default_context);
 #endif
-		/* Read next character when 0 */
-		if (c == 0) continue;
+}
 
-process_char:
-        if (c == -1) {
-	    set_current(current, "");
-            return 0;
-	}
+/**
+ * Makes the pipe which wakes the editor while it waits for input, if need be.
+ * Both ends are non-blocking, so a write never waits for the editor.
+ *
+ * Returns -1 on error.
+ */
+static int ctx_wake_open(linenoiseContext *ctx)
+{
+    int j;
 
-#ifdef USE_TERMIOS
-        if (c == 27) {   /* escape sequence */
-            c = check_special(current->fd);
-        }
-#endif
-        switch(c) {
-        case '\r':    /* enter */
-            history_len--;
-            free(history[history_len]);
-            return current->len;
-        case ctrl('C'):     /* ctrl-c */
-            errno = EAGAIN;
-            return -1;
-        case 127:   /* backspace */
-        case ctrl('H'):
-            if (remove_char(current, current->pos - 1) == 1) {
-                refreshLine(current->prompt, current);
-            }
-            break;
-        case ctrl('D'):     /* ctrl-d */
-            if (current->len == 0) {
-                /* Empty line, so EOF */
-                history_len--;
-                free(history[history_len]);
-                return -1;
-            }
-            /* Otherwise fall through to delete char to right of cursor */
-        case SPECIAL_DELETE:
-            if (remove_char(current, current->pos) == 1) {
-                refreshLine(current->prompt, current);
-            }
-            break;
-        case ctrl('W'):    /* ctrl-w */
-            /* eat any spaces on the left */
-            {
-                int pos = current->pos;
-                while (pos > 0 && get_char(current, pos - 1) == ' ') {
-                    pos--;
-                }
+    if (ctx->wakefd[0] != -1) {
+        return 0;
+    }
+    if (pipe(ctx->wakefd) == -1) {
+        ctx->wakefd[0] = ctx->wakefd[1] = -1;
+        return -1;
+    }
+    for (j = 0; j < 2; j++) {
+        fcntl(ctx->wakefd[j], F_SETFL, fcntl(ctx->wakefd[j], F_GETFL) | O_NONBLOCK);
+        fcntl(ctx->wakefd[j], F_SETFD, FD_CLOEXEC);
+    }
+    return 0;
+}
 
-                /* now eat any non-spaces on the left */
-                while (pos > 0 && get_char(current, pos - 1) != ' ') {
-                    pos--;
-                }
+static void ctx_wake_close(linenoiseContext *ctx)
+{
+    if (ctx->wakefd[0] != -1) {
+        close(ctx->wakefd[0]);
+        close(ctx->wakefd[1]);
+        ctx->wakefd[0] = ctx->wakefd[1] = -1;
+    }
+}
 
-                if (remove_chars(current, pos, current->pos - pos)) {
-                    refreshLine(current->prompt, current);
-                }
+/* This is fdprintf() on some systems, but use a different
+ * name to avoid conflicts
+ */
+static void fd_printf(int fd, const char *format, ...)
+{
+    va_list args;
+    char buf[64];
+    int n;
+
+    va_start(args, format);
+    n = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    IGNORE_RC(write(fd, buf, n));
+}
+
+/* Like fd_printf(), but appends to the pending output buffer */
+static void outputFormat(struct current *current, const char *format, ...)
+{
+    va_list args;
+    char buf[64];
+    int n;
+
+    va_start(args, format);
+    n = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    outputAppend(current, buf, n);
+}
+
+static void outputFlush(struct current *current)
+{
+    int n = 0;
+
+    while (n < current->outlen) {
+        int w = write(current->outfd, current->outbuf + n, current->outlen - n);
+        current->ctx->refresh_writes++;
+        if (current->ctx->stats_enabled) {
+            current->ctx->stats.writes++;
+        }
+        if (w <= 0) {
+            if (w < 0 && errno == EINTR) {
+                continue;
             }
             break;
-        case ctrl('R'):    /* ctrl-r */
-            {
-                /* Display the reverse-i-search prompt and process chars */
-                char rbuf[50];
-                char rprompt[80];
-                int rchars = 0;
-                int rlen = 0;
-                int searchpos = history_len - 1;
-
-                rbuf[0] = 0;
-                while (1) {
-                    int n = 0;
-                    const char *p = NULL;
-                    int skipsame = 0;
-                    int searchdir = -1;
-
-                    snprintf(rprompt, sizeof(rprompt), "(reverse-i-search)'%s': ", rbuf);
-                    refreshLine(rprompt, current);
-                    c = fd_read(current);
-                    if (c == ctrl('H') || c == 127) {
-                        if (rchars) {
-                            int p = utf8_index(rbuf, --rchars);
-                            rbuf[p] = 0;
-                            rlen = strlen(rbuf);
-                        }
-                        continue;
-                    }
-#ifdef USE_TERMIOS
-                    if (c == 27) {
-                        c = check_special(current->fd);
+        }
+        n += w;
+    }
+    if (current->ctx->stats_enabled) {
+        current->ctx->stats.bytes_written += n;
+    }
+    current->outlen = 0;
+}
+
+static void clearScreen(struct current *current)
+{
+    outputFormat(current, "\x1b[H\x1b[2J");
+}
+
+static void cursorToLeft(struct current *current)
+{
+    outputFormat(current, "\x1b[1G");
+}
+
+static int outputChars(struct current *current, const char *buf, int len)
+{
+    outputAppend(current, buf, len);
+    return len;
+}
+
+static void outputControlChar(struct current *current, char ch)
+{
+    outputFormat(current, "\033[7m^%c\033[0m", ch);
+}
+
+/* Shows the next 'n' columns in colour 'color' (an SGR code, or 0 for the usual one), and bold if 'bold' is set */
+static void outputAttr(struct current *current, int color, int bold, int n)
+{
+    (void)n;
+    if (color) {
+        outputFormat(current, bold ? "\x1b[0;1;%dm" : "\x1b[0;%dm", color);
+    }
+    else {
+        outputFormat(current, bold ? "\x1b[0;1m" : "\x1b[0m");
+    }
+}
+
+static void eraseEol(struct current *current)
+{
+    outputFormat(current, "\x1b[0K");
+}
+
+static void setCursorPos(struct current *current, int x)
+{
+    if (x) {
+        outputFormat(current, "\x1b[1G\x1b[%dC", x);
+    }
+    else {
+        /* A count of 0 would still move one */
+        cursorToLeft(current);
+    }
+}
+
+/* Moves the cursor along the line from column 'from' to column 'x' */
+static void cursorMove(struct current *current, int from, int x)
+{
+    if (from >= current->cols) {
+        /* The cursor may be waiting to wrap, so don't go by where it is */
+        setCursorPos(current, x);
+    }
+    else if (x == from - 1) {
+        outputChars(current, "\b", 1);
+    }
+    else if (x < from) {
+        outputFormat(current, "\x1b[%dD", from - x);
+    }
+    else if (x > from) {
+        outputFormat(current, "\x1b[%dC", x - from);
+    }
+}
+
+/* Moves the rest of the line 'n' columns right from the cursor */
+static void insertColumns(struct current *current, int n)
+{
+    outputFormat(current, "\x1b[%d@", n);
+}
+
+/* Moves the rest of the line 'n' columns left to the cursor */
+static void deleteColumns(struct current *current, int n)
+{
+    outputFormat(current, "\x1b[%dP", n);
+}
+
+/* Moves to the start of the next line, scrolling if need be */
+static void outputNewline(struct current *current)
+{
+    outputAppend(current, "\r\n", 2);
+}
+
+/* Moves the cursor up 'n' lines */
+static void cursorUp(struct current *current, int n)
+{
+    outputFormat(current, "\x1b[%dA", n);
+}
+
+/**
+ * Reads a char from the terminal, waiting at most 'timeout' milliseconds.
+ *
+ * A timeout of -1 means to wait forever.
+ *
+ * Returns -1 if no char is received within the time or an error occurs.
+ */
+static int fd_read_char(struct current *current, int timeout)
+{
+    linenoiseContext *ctx = current->ctx;
+    int rcode;
+    struct pollfd p;
+
+    if (ctx->inputpos == ctx->inputlen) {
+        p.fd = current->fd;
+        p.events = POLLIN;
+
+        /* SIGWINCH interrupts, but is no reason to stop waiting */
+        while ((rcode = poll(&p, 1, timeout)) == -1 && errno == EINTR) {
+        }
+        if (rcode <= 0) return -1;	/* timeout or error */
+
+        /* Take everything there is, so the following chars cost no more syscalls */
+        rcode = read(current->fd, ctx->inputbuf, sizeof(ctx->inputbuf));
+        if (rcode <= 0) {
+            return -1;
+        }
+        ctx->inputlen = rcode;
+        ctx->inputpos = 0;
+    }
+    return (unsigned char)ctx->inputbuf[ctx->inputpos++];
+}
+
+/**
+ * Reads text pasted into the terminal, up to the end of paste marker,
+ * a large block at a time. Anything after the marker is kept in 'inputbuf'.
+ * Line endings are converted to newlines and nulls are dropped.
+ *
+ * Returns the text in an allocated buffer of '*len' bytes, or NULL if out of memory.
+ */
+static char *read_paste(struct current *current, int *len)
+{
+    linenoiseContext *ctx = current->ctx;
+    static const char end[] = "\x1b[201~";
+    const int endlen = sizeof(end) - 1;
+    char *buf = NULL;
+    int bufmax = 0;
+    int n = 0;
+    int i, j;
+
+    while (1) {
+        int start = n > endlen ? n - endlen : 0;
+        int r;
+        char *p;
+
+        if (bufmax - n < LINENOISE_READ_CHUNK) {
+            char *newbuf = (char *)reallocFn(buf, bufmax + bufmax / 2 + LINENOISE_READ_CHUNK);
+            if (newbuf == NULL) {
+                freeFn(buf);
+                return NULL;
+            }
+            buf = newbuf;
+            bufmax += bufmax / 2 + LINENOISE_READ_CHUNK;
+        }
+
+        if (ctx->inputpos < ctx->inputlen) {
+            r = ctx->inputlen - ctx->inputpos;
+            memcpy(buf + n, ctx->inputbuf + ctx->inputpos, r);
+            ctx->inputlen = ctx->inputpos = 0;
+        }
+        else {
+            struct pollfd pfd;
+
+            pfd.fd = current->fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, LINENOISE_PASTE_TIMEOUT) <= 0) {
+                /* The terminal never ended the paste */
+                break;
+            }
+            r = read(current->fd, buf + n, LINENOISE_READ_CHUNK);
+            if (r <= 0) {
+                break;
+            }
+        }
+        n += r;
+
+        /* Look for the end marker, which could have been split across reads */
+        for (p = buf + start; (p = (char *)memchr(p, end[0], n - (p - buf))) != NULL; p++) {
+            if (n - (p - buf) >= endlen && memcmp(p, end, endlen) == 0) {
+                int after = p - buf + endlen;
+                memcpy(ctx->inputbuf, buf + after, n - after);
+                ctx->inputlen = n - after;
+                ctx->inputpos = 0;
+                n = p - buf;
+                goto done;
+            }
+        }
+    }
+done:
+    /* Convert \r\n and \r to \n */
+    for (i = j = 0; i < n; i++) {
+        if (buf[i] == '\r') {
+            if (i + 1 < n && buf[i + 1] == '\n') {
+                continue;
+            }
+            buf[j++] = '\n';
+        }
+        else if (buf[i]) {
+            buf[j++] = buf[i];
+        }
+    }
+    *len = j;
+    return buf;
+}
+
+/**
+ * Waits for input from the terminal, or for something to be written to the wake pipe.
+ *
+ * Returns 1 if woken, once the pipe has been emptied.
+ */
+static int fd_wait(struct current *current)
+{
+    linenoiseContext *ctx = current->ctx;
+    struct pollfd p[2];
+    char buf[64];
+    int rc;
+
+    if (ctx->wakefd[0] == -1 || ctx->inputpos < ctx->inputlen) {
+        return 0;
+    }
+    p[0].fd = current->fd;
+    p[0].events = POLLIN;
+    p[1].fd = ctx->wakefd[0];
+    p[1].events = POLLIN;
+    while ((rc = poll(p, 2, -1)) == -1 && errno == EINTR) {
+    }
+    if (rc <= 0 || !(p[1].revents & POLLIN)) {
+        return 0;
+    }
+    while (read(ctx->wakefd[0], buf, sizeof(buf)) > 0) {
+    }
+    return 1;
+}
+
+/* Builds the history index during a search until a key comes or the wake pipe is written to */
+static void fd_idle(struct current *current)
+{
+#ifndef NO_HISTORY_INDEX
+    linenoiseContext *ctx = current->ctx;
+    struct pollfd p[2];
+
+    if (current->mode != EDIT_SEARCH || ctx->inputpos < ctx->inputlen) {
+        return;
+    }
+    p[0].fd = current->fd;
+    p[0].events = POLLIN;
+    p[1].fd = ctx->wakefd[0];
+    p[1].events = POLLIN;
+    while (!history_index_ready(&ctx->history) && poll(p, 2, 0) == 0) {
+        if (!history_index_step(&ctx->history) && ctx->history.index == NULL) {
+            /* Out of memory */
+            break;
+        }
+    }
+#else
+    (void)current;
+#endif
+}
+
+/**
+ * Reads a complete utf-8 character
+ * and returns the unicode value, -1 on error or SPECIAL_WAKE if woken.
+ */
+static int fd_read(struct current *current)
+{
+    int c;
+#ifdef USE_UTF8
+    char buf[5];
+    int n;
+    int i;
+
+    outputFlush(current);
+    fd_idle(current);
+    if (fd_wait(current)) {
+        return SPECIAL_WAKE;
+    }
+    if ((c = fd_read_char(current, -1)) == -1) {
+        return -1;
+    }
+    if (current->ctx->stats_enabled) {
+        /* Typed ahead keys wait in 'inputbuf', and only count from being taken */
+        current->ctx->input_time = stats_now();
+    }
+    buf[0] = c;
+    n = utf8_charlen(buf[0]);
+    if (n < 1) {
+        return -1;
+    }
+    for (i = 1; i < n; i++) {
+        if ((c = fd_read_char(current, -1)) == -1) {
+            return -1;
+        }
+        buf[i] = c;
+    }
+    buf[n] = 0;
+    /* decode and return the character */
+    utf8_tounicode(buf, &c);
+    return c;
+#else
+    outputFlush(current);
+    fd_idle(current);
+    if (fd_wait(current)) {
+        return SPECIAL_WAKE;
+    }
+    c = fd_read_char(current, -1);
+    if (c != -1 && current->ctx->stats_enabled) {
+        /* Typed ahead keys wait in 'inputbuf', and only count from being taken */
+        current->ctx->input_time = stats_now();
+    }
+    return c;
+#endif
+}
+
+static int getWindowSize(struct current *current)
+{
+    struct winsize ws;
+
+    if (ioctl(current->outfd, TIOCGWINSZ, &ws) == 0 && ws.ws_col != 0) {
+        current->cols = ws.ws_col;
+        current->rows = ws.ws_row;
+        return 0;
+    }
+
+    /* Failed to query the window size. Perhaps we are on a serial terminal.
+     * Try to query the width by sending the cursor as far to the right
+     * and reading back the cursor position.
+     * Note that this is only done once per call to linenoise rather than
+     * every time the line is refreshed for efficiency reasons.
+     */
+    if (current->cols == 0) {
+        current->cols = 80;
+
+        /* Move cursor far right and report cursor position */
+        outputFlush(current);
+        fd_printf(current->outfd, "\x1b[999G" "\x1b[6n");
+
+        /* Parse the response: ESC [ rows ; cols R */
+        if (fd_read_char(current, 100) == 0x1b && fd_read_char(current, 100) == '[') {
+            int n = 0;
+            while (1) {
+                int ch = fd_read_char(current, 100);
+                if (ch == ';') {
+                    /* Ignore rows */
+                    n = 0;
+                }
+                else if (ch == 'R') {
+                    /* Got cols */
+                    if (n != 0 && n < 1000) {
+                        current->cols = n;
                     }
+                    break;
+                }
+                else if (ch >= 0 && ch <= '9') {
+                    n = n * 10 + ch - '0';
+                }
+                else {
+                    break;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Reads the next char of an escape sequence. It is usually buffered already,
+ * otherwise it is waited for no longer than the escape timeout.
+ */
+static int escape_read_char(struct current *current)
+{
+    linenoiseContext *ctx = current->ctx;
+    long long start;
+    int c;
+
+    if (!ctx->stats_enabled || ctx->inputpos < ctx->inputlen) {
+        return fd_read_char(current, ctx->escape_timeout);
+    }
+    start = stats_now();
+    c = fd_read_char(current, ctx->escape_timeout);
+    stats_time(ctx, &ctx->stats.escape_waits, &ctx->stats.escape_wait_us, start);
+    if (c < 0) {
+        ctx->stats.escape_timeouts++;
+    }
+    return c;
+}
+
+/* Keys sent as ESC [ or ESC O, then perhaps a number, then the final char */
+static const struct escape_key {
+    char final;
+    short n;            /* The number, or 0 if the final char is enough */
+    short key;
+} escape_keys[] = {
+    { 'A', 0, SPECIAL_UP },
+    { 'B', 0, SPECIAL_DOWN },
+    { 'C', 0, SPECIAL_RIGHT },
+    { 'D', 0, SPECIAL_LEFT },
+    { 'F', 0, SPECIAL_END },
+    { 'H', 0, SPECIAL_HOME },
+    { 'P', 0, SPECIAL_F1 },
+    { 'Q', 0, SPECIAL_F1 - 1 },
+    { 'R', 0, SPECIAL_F1 - 2 },
+    { 'S', 0, SPECIAL_F1 - 3 },
+    { 'Z', 0, SPECIAL_BACKTAB },
+    { '~', 1, SPECIAL_HOME },
+    { '~', 2, SPECIAL_INSERT },
+    { '~', 3, SPECIAL_DELETE },
+    { '~', 4, SPECIAL_END },
+    { '~', 5, SPECIAL_PAGE_UP },
+    { '~', 6, SPECIAL_PAGE_DOWN },
+    { '~', 7, SPECIAL_HOME },
+    { '~', 8, SPECIAL_END },
+    { '~', 11, SPECIAL_F1 },
+    { '~', 12, SPECIAL_F1 - 1 },
+    { '~', 13, SPECIAL_F1 - 2 },
+    { '~', 14, SPECIAL_F1 - 3 },
+    { '~', 15, SPECIAL_F1 - 4 },
+    { '~', 17, SPECIAL_F1 - 5 },
+    { '~', 18, SPECIAL_F1 - 6 },
+    { '~', 19, SPECIAL_F1 - 7 },
+    { '~', 20, SPECIAL_F1 - 8 },
+    { '~', 21, SPECIAL_F1 - 9 },
+    { '~', 23, SPECIAL_F1 - 10 },
+    { '~', 24, SPECIAL_F1 - 11 },
+    { '~', 200, SPECIAL_PASTE },
+};
+
+/**
+ * Returns the key of a sequence ending in 'final' with the number 'n',
+ * or SPECIAL_NONE if it is unknown.
+ *
+ * 'mods' are the modifiers held: 1 for shift, 2 for alt, 4 for ctrl and 8 for meta.
+ * Only the arrows and delete have keys of their own with them, others are as if unmodified.
+ */
+static int escape_key(int final, int n, int mods)
+{
+    int key = SPECIAL_NONE;
+    int i;
+
+    if (final == '^' || final == '@') {
+        /* rxvt sends ctrl with these in place of '~' */
+        final = '~';
+        mods |= 4;
+    }
+    if (final != '~') {
+        /* e.g. ESC [ 1 ; 5 C for ctrl-right */
+        n = 0;
+    }
+    for (i = 0; i < (int)(sizeof(escape_keys) / sizeof(*escape_keys)); i++) {
+        if (escape_keys[i].final == final && escape_keys[i].n == n) {
+            key = escape_keys[i].key;
+            break;
+        }
+    }
+    if (mods & (2 | 4 | 8)) {
+        switch (key) {
+            case SPECIAL_LEFT:
+                return SPECIAL_CTRL_LEFT;
+            case SPECIAL_RIGHT:
+                return SPECIAL_CTRL_RIGHT;
+            case SPECIAL_DELETE:
+                return SPECIAL_CTRL_DELETE;
+        }
+    }
+    return key;
+}
+
+/**
+ * Reads the rest of a sequence which started with ESC 'intro', where 'intro'
+ * is '[' or 'O', and returns its key. An ESC before the sequence, as some
+ * terminals send for alt, is 'alt'.
+ *
+ * Reads as far as the final char, 0x40 to 0x7e, in one pass.
+ * Any number of parameter chars (0x30 to 0x3f) and then
+ * intermediate chars (0x20 to 0x2f) may come first, so unknown
+ * sequences are consumed whole and ignored.
+ *
+ * Returns SPECIAL_META - 'intro' if nothing followed within the escape timeout.
+ */
+static int escape_sequence(struct current *current, int intro, int alt)
+{
+    int num[2] = { 0, 0 };
+    int i = 0;
+    int c = escape_read_char(current);
+
+    if (c < 0) {
+        return SPECIAL_META - intro;
+    }
+    if (intro == '[' && c == '[') {
+        /* The linux console sends ESC [ [ A to ESC [ [ E for F1 to F5 */
+        c = escape_read_char(current);
+        return c >= 'A' && c <= 'E' ? SPECIAL_F1 - (c - 'A') : SPECIAL_NONE;
+    }
+    while (c >= 0x30 && c <= 0x3f) {
+        if (c >= '0' && c <= '9') {
+            if (num[i] < 1000) {
+                num[i] = num[i] * 10 + c - '0';
+            }
+        }
+        else if (c == ';' && i == 0) {
+            i++;
+        }
+        c = escape_read_char(current);
+    }
+    while (c >= 0x20 && c <= 0x2f) {
+        c = escape_read_char(current);
+    }
+    if (c < 0x40 || c > 0x7e) {
+        if (c >= 0) {
+            /* Cut short by something else. Leave that to be read as usual */
+            current->ctx->inputpos--;
+        }
+        return SPECIAL_NONE;
+    }
+    /* The modifiers are sent plus one, e.g. 5 for ctrl */
+    return escape_key(c, num[0], (num[1] > 1 ? num[1] - 1 : 0) | (alt ? 2 : 0));
+}
+
+/**
+ * If escape (27) was received, reads subsequent
+ * chars to determine if this is a known special key.
+ *
+ * What is already buffered decides at once. Only if the input runs out
+ * part way is the rest waited for, up to the escape timeout.
+ *
+ * Returns the key, SPECIAL_META - c for alt with c (sent as ESC c),
+ * SPECIAL_NONE if unrecognised, or 27 if nothing more is received
+ * within the escape timeout.
+ */
+static int check_special(struct current *current)
+{
+    int c = escape_read_char(current);
+
+    if (c < 0) {
+        return 27;
+    }
+    if (c == '[' || c == 'O') {
+        return escape_sequence(current, c, 0);
+    }
+    if (c == 27) {
+        c = escape_read_char(current);
+        if (c == '[' || c == 'O') {
+            return escape_sequence(current, c, 1);
+        }
+        if (c >= 0) {
+            current->ctx->inputpos--;
+        }
+        return SPECIAL_META - 27;
+    }
+    if (c >= 128) {
+        /* Not a char alt can be held with. Leave it to be read as usual */
+        current->ctx->inputpos--;
+        return 27;
+    }
+    return SPECIAL_META - c;
+}
+#elif defined(USE_WINCONSOLE)
+
+
+static int enableRawMode(struct current *current) {
+    DWORD n;
+    INPUT_RECORD irec;
+
+    current->outh = GetStdHandle(STD_OUTPUT_HANDLE);
+    current->inh = GetStdHandle(STD_INPUT_HANDLE);
+
+    if (!PeekConsoleInput(current->inh, &irec, 1, &n)) {
+        return -1;
+    }
+    if (getWindowSize(current) != 0) {
+        return -1;
+    }
+    if (GetConsoleMode(current->inh, &current->ctx->orig_consolemode)) {
+        SetConsoleMode(current->inh, ENABLE_PROCESSED_INPUT);
+    }
+    return 0;
+}
+
+static void disableRawMode(struct current *current)
+{
+    SetConsoleMode(current->inh, current->ctx->orig_consolemode);
+}
+
+static void clearScreen(struct current *current)
+{
+    COORD topleft = { 0, 0 };
+    DWORD n;
+
+    outputFlush(current);
+    FillConsoleOutputCharacter(current->outh, ' ',
+        current->cols * current->rows, topleft, &n);
+    FillConsoleOutputAttribute(current->outh,
+        FOREGROUND_RED | FOREGROUND_BLUE | FOREGROUND_GREEN,
+        current->cols * current->rows, topleft, &n);
+    SetConsoleCursorPosition(current->outh, topleft);
+}
+
+static void outputFlush(struct current *current)
+{
+    if (current->outlen) {
+        COORD pos = { current->outx, current->y };
+        DWORD n;
+
+        WriteConsoleOutputCharacterA(current->outh, current->outbuf, current->outlen, pos, &n);
+        current->ctx->refresh_writes++;
+        if (current->ctx->stats_enabled) {
+            current->ctx->stats.writes++;
+            current->ctx->stats.bytes_written += current->outlen;
+        }
+        current->outlen = 0;
+    }
+    current->outx = current->x;
+}
+
+static void cursorToLeft(struct current *current)
+{
+    COORD pos = { 0, current->y };
+    DWORD n;
+
+    outputFlush(current);
+    FillConsoleOutputAttribute(current->outh,
+        FOREGROUND_RED | FOREGROUND_BLUE | FOREGROUND_GREEN, current->cols, pos, &n);
+    current->x = current->outx = 0;
+}
+
+static int outputChars(struct current *current, const char *buf, int len)
+{
+    outputAppend(current, buf, len);
+    current->x += len;
+    return 0;
+}
+
+static void outputControlChar(struct current *current, char ch)
+{
+    COORD pos = { current->x, current->y };
+    DWORD n;
+
+    FillConsoleOutputAttribute(current->outh, BACKGROUND_INTENSITY, 2, pos, &n);
+    outputChars(current, "^", 1);
+    outputChars(current, &ch, 1);
+}
+
+/* Shows the next 'n' columns in colour 'color' (an SGR code, or 0 for the usual one), and bold if 'bold' is set */
+static void outputAttr(struct current *current, int color, int bold, int n)
+{
+    static const WORD colours[8] = {
+        0, FOREGROUND_RED, FOREGROUND_GREEN, FOREGROUND_RED | FOREGROUND_GREEN,
+        FOREGROUND_BLUE, FOREGROUND_RED | FOREGROUND_BLUE, FOREGROUND_GREEN | FOREGROUND_BLUE,
+        FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE
+    };
+    COORD pos = { current->x, current->y };
+    WORD attr = FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
+    DWORD written;
+
+    if (color >= 30 && color <= 37) {
+        attr = colours[color - 30];
+    }
+    else if (color >= 90 && color <= 97) {
+        attr = colours[color - 90] | FOREGROUND_INTENSITY;
+    }
+    if (bold) {
+        attr |= FOREGROUND_INTENSITY;
+    }
+    FillConsoleOutputAttribute(current->outh, attr, n, pos, &written);
+}
+
+static void eraseEol(struct current *current)
+{
+    /* Pad with spaces so that the erase goes out with the rest of the line */
+    while (current->x < current->cols) {
+        outputChars(current, " ", 1);
+    }
+}
+
+static void setCursorPos(struct current *current, int x)
+{
+    COORD pos = { x, current->y };
+
+    outputFlush(current);
+    SetConsoleCursorPosition(current->outh, pos);
+    current->x = current->outx = x;
+}
+
+/* Moves the cursor along the line from column 'from' to column 'x' */
+static void cursorMove(struct current *current, int from, int x)
+{
+    (void)from;
+    setCursorPos(current, x);
+}
+
+/* Gives the 'n' columns from 'x' on the normal colours, as cursorToLeft() does for the whole line */
+static void clearAttributes(struct current *current, int x, int n)
+{
+    COORD pos = { x, current->y };
+    DWORD written;
+
+    outputFlush(current);
+    FillConsoleOutputAttribute(current->outh,
+        FOREGROUND_RED | FOREGROUND_BLUE | FOREGROUND_GREEN, n, pos, &written);
+}
+
+/* Moves to the start of the next line, scrolling if need be */
+static void outputNewline(struct current *current)
+{
+    COORD pos = { 0, current->y };
+    DWORD n;
+
+    outputFlush(current);
+    SetConsoleCursorPosition(current->outh, pos);
+    /* Let the console scroll */
+    WriteConsoleA(current->outh, "\n", 1, &n, NULL);
+    getWindowSize(current);
+    current->outx = current->x = 0;
+}
+
+/* Moves the cursor up 'n' lines */
+static void cursorUp(struct current *current, int n)
+{
+    outputFlush(current);
+    current->y -= n;
+    setCursorPos(current, current->x);
+}
+
+static int fd_read(struct current *current)
+{
+#ifdef USE_UTF8
+    int high = 0;
+#endif
+
+    outputFlush(current);
+    while (1) {
+        INPUT_RECORD irec;
+        DWORD n;
+        if (WaitForSingleObject(current->inh, INFINITE) != WAIT_OBJECT_0) {
+            break;
+        }
+        if (!ReadConsoleInput (current->inh, &irec, 1, &n)) {
+            break;
+        }
+        if (irec.EventType == KEY_EVENT && irec.Event.KeyEvent.bKeyDown) {
+            KEY_EVENT_RECORD *k = &irec.Event.KeyEvent;
+            if (current->ctx->stats_enabled) {
+                current->ctx->input_time = stats_now();
+            }
+            if (k->dwControlKeyState & ENHANCED_KEY) {
+                switch (k->wVirtualKeyCode) {
+                 case VK_LEFT:
+                    return k->dwControlKeyState & (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED) ? SPECIAL_CTRL_LEFT : SPECIAL_LEFT;
+                 case VK_RIGHT:
+                    return k->dwControlKeyState & (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED) ? SPECIAL_CTRL_RIGHT : SPECIAL_RIGHT;
+                 case VK_UP:
+                    return SPECIAL_UP;
+                 case VK_DOWN:
+                    return SPECIAL_DOWN;
+                 case VK_DELETE:
+                    return SPECIAL_DELETE;
+                 case VK_HOME:
+                    return SPECIAL_HOME;
+                 case VK_END:
+                    return SPECIAL_END;
+                 case VK_INSERT:
+                    return SPECIAL_INSERT;
+                 case VK_PRIOR:
+                    return SPECIAL_PAGE_UP;
+                 case VK_NEXT:
+                    return SPECIAL_PAGE_DOWN;
+                }
+            }
+            /* Note that control characters are already translated in AsciiChar */
+            else {
+#ifdef USE_UTF8
+                int c = k->uChar.UnicodeChar;
+
+                /* Chars beyond 0xffff come as two halves of a surrogate pair */
+                if (c >= 0xd800 && c < 0xdc00) {
+                    high = c;
+                    continue;
+                }
+                if (c >= 0xdc00 && c < 0xe000 && high) {
+                    c = 0x10000 + ((high - 0xd800) << 10) + (c - 0xdc00);
+                }
+                return c;
+#else
+                return k->uChar.AsciiChar;
+#endif
+            }
+        }
+    }
+    return -1;
+}
+
+static int getWindowSize(struct current *current)
+{
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    if (!GetConsoleScreenBufferInfo(current->outh, &info)) {
+        return -1;
+    }
+    current->cols = info.dwSize.X;
+    current->rows = info.dwSize.Y;
+    if (current->cols <= 0 || current->rows <= 0) {
+        current->cols = 80;
+        return -1;
+    }
+    current->y = info.dwCursorPosition.Y;
+    current->x = info.dwCursorPosition.X;
+    return 0;
+}
+#endif
+
+/**
+ * Finds the size of the window, unless it's known not to have changed
+ * since last time. (The Windows console is still asked every time, since
+ * that is also how the cursor position is found.)
+ */
+static void updateWindowSize(struct current *current)
+{
+    linenoiseContext *ctx = current->ctx;
+    long long start;
+    int cols;
+#ifdef USE_WINCONSOLE
+    int y;
+#endif
+
+#ifdef USE_TERMIOS
+    if (ctx->cols && ctx->winch_seen == (unsigned)winch_count) {
+        current->cols = ctx->cols;
+        current->rows = ctx->rows;
+        return;
+    }
+    /* Before asking, so that a resize meanwhile is seen next time */
+    ctx->winch_seen = winch_count;
+#endif
+    cols = current->cols;
+#ifdef USE_WINCONSOLE
+    y = current->y;
+#endif
+    start = stats_start(ctx);
+    getWindowSize(current);
+    stats_time(ctx, &ctx->stats.window_queries, &ctx->stats.window_us, start);
+    if (current->cols != cols
+#ifdef USE_WINCONSOLE
+            || current->y != y
+#endif
+            ) {
+        /* The line may not be where it was */
+        current->shown_len = -1;
+    }
+    ctx->cols = current->cols;
+    ctx->rows = current->rows;
+}
+
+static int utf8_getchars(char *buf, int c)
+{
+#ifdef USE_UTF8
+    return utf8_fromunicode(buf, c);
+#else
+    *buf = c;
+    return 1;
+#endif
+}
+
+/* Returns the number of columns needed to display 'ch' */
+static int char_cols(int ch)
+{
+    /* Control characters are displayed as ^X */
+    return ch < ' ' ? 2 : utf8_width(ch);
+}
+
+/* Returns the number of columns the prompt takes, counting any control chars as one */
+static int prompt_cols(const char *prompt, int plen)
+{
+    int cols = 0;
+    int b;
+
+    for (b = 0; b < plen; ) {
+        int ch;
+        b += utf8_tounicode(prompt + b, &ch);
+        cols += utf8_width(ch);
+    }
+    return cols;
+}
+
+#ifndef NO_COMPLETION
+/* Returns the number of columns needed to display 'str' */
+static int str_cols(const char *str)
+{
+    int cols = 0;
+
+    while (*str) {
+        int ch;
+        str += utf8_tounicode(str, &ch);
+        cols += char_cols(ch);
+    }
+    return cols;
+}
+#endif
+
+/**
+ * Returns the unicode character at the given offset,
+ * or -1 if none.
+ */
+static int get_char(struct current *current, int pos)
+{
+    if (pos >= 0 && pos < current->chars) {
+        int c;
+        (void)utf8_tounicode(current->buf + current->layout[pos].offset, &c);
+        return c;
+    }
+    return -1;
+}
+
+/* Returns the index of the char which starts at byte 'offset' */
+static int char_at_offset(struct current *current, int offset)
+{
+    int lo = 0;
+    int hi = current->chars;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (current->layout[mid].offset < offset) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Returns the index of the first char which starts beyond column 'col' */
+static int char_after_col(struct current *current, int col)
+{
+    int lo = 0;
+    int hi = current->chars;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (current->layout[mid].col > col) {
+            hi = mid;
+        }
+        else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+/* The line on the screen is kept as the char shown in each column,
+ * so that refreshLine() need only write the columns which change.
+ */
+#define CELL_CTRL 0x80000000u   /* Part of a control char shown as ^X */
+#define CELL_CONT 0x40000000u   /* Not the first column of the char */
+#define CELL_TEXT 0x20000000u   /* A char with zero width chars after it, see 'texts'. CELL_CHAR is a hash of them */
+#define CELL_ATTR 0x1fe00000u   /* How the char is shown, from the highlight or hints callback */
+#define CELL_CHAR 0x001fffffu   /* The char itself */
+#define CELL_ATTR_SHIFT 21
+
+/* An attribute is a colour (an SGR code, or 0 for the usual one) plus ATTR_BOLD */
+#define ATTR_BOLD 0x80
+
+struct linenoiseHighlights {
+    unsigned char *attrs;   /* The attribute of each byte of the line */
+    int len;
+};
+
+/* The attribute for 'color' and 'bold' from the highlight or hints callback */
+static unsigned make_attr(int color, int bold)
+{
+    return (color > 0 && color < ATTR_BOLD ? color : 0) | (bold ? ATTR_BOLD : 0);
+}
+
+/**
+ * Calls the highlight and hints callbacks for the line, unless
+ * that has been done since it last changed.
+ */
+static void render_update(struct current *current)
+{
+    linenoiseContext *ctx = current->ctx;
+
+    if (ctx->highlightCallback == NULL) {
+        current->attrs_version = 0;
+    }
+    else if (current->attrs_version != current->version) {
+        if (current->len > current->attrs_max) {
+            int max = current->attrs_max ? current->attrs_max : 64;
+            unsigned char *attrs;
+
+            while (max < current->len) {
+                max *= 2;
+            }
+            attrs = (unsigned char *)reallocFn(current->attrs, max);
+            if (attrs) {
+                current->attrs = attrs;
+                current->attrs_max = max;
+            }
+        }
+        if (current->len <= current->attrs_max) {
+            linenoiseHighlights hl;
+
+            if (current->len) {
+                memset(current->attrs, 0, current->len);
+            }
+            hl.attrs = current->attrs;
+            hl.len = current->len;
+            ctx->highlightCallback(current->buf, &hl);
+            current->attrs_version = current->version;
+        }
+    }
+
+    if (ctx->hintsCallback == NULL) {
+        hint_free(current);
+        current->hint_version = 0;
+    }
+    else if (current->hint_version != current->version) {
+        int color = -1;
+        int bold = 0;
+
+        hint_free(current);
+        current->hint = ctx->hintsCallback(current->buf, &color, &bold);
+        current->hint_attr = make_attr(color, bold);
+        current->hint_version = current->version;
+    }
+}
+
+/* Makes room for 'n' columns in 'cells' and 'shown'. Returns 0 if out of memory. */
+static int screen_reserve(struct current *current, int n)
+{
+    if (n > current->cells_max) {
+        int max = current->cells_max ? current->cells_max : 128;
+        unsigned *cells;
+        unsigned *shown;
+
+        while (max < n) {
+            max *= 2;
+        }
+        cells = (unsigned *)reallocFn(current->cells, sizeof(*cells) * max);
+        if (cells) {
+            current->cells = cells;
+        }
+        shown = (unsigned *)reallocFn(current->shown, sizeof(*shown) * max);
+        if (shown) {
+            current->shown = shown;
+        }
+        if (cells == NULL || shown == NULL) {
+            return 0;
+        }
+        if (current->texts) {
+            struct cell_text *texts = (struct cell_text *)reallocFn(current->texts, sizeof(*texts) * max);
+            if (texts == NULL) {
+                return 0;
+            }
+            current->texts = texts;
+        }
+        current->cells_max = max;
+    }
+    return 1;
+}
+
+/* The char before the next one screen_put() adds, which a zero width char goes with */
+struct cell_base {
+    int col;            /* Its column, or -1 if there is none to go with */
+    const char *text;   /* It and any zero width chars after it */
+    int len;
+};
+
+/* A hash of the 'len' bytes at 'str', to tell one CELL_TEXT from another */
+static unsigned text_hash(const char *str, int len)
+{
+    unsigned h = 2166136261u;
+
+    while (len--) {
+        h = (h ^ (unsigned char)*str++) * 16777619u;
+    }
+    return h & CELL_CHAR;
+}
+
+/* Pads to the next row of 'wrap' columns from 'col' if a char 'w' wide would be split across them */
+static int screen_pad(struct current *current, int col, int wrap, int w)
+{
+    if (wrap && w <= wrap && col % wrap + w > wrap) {
+        while (col % wrap) {
+            current->cells[col++] = ' ';
+        }
+    }
+    return col;
+}
+
+/**
+ * Adds the char 'ch', which is the 'len' bytes at 'text' and 'w' columns wide,
+ * to 'cells' at 'col', and returns the column after it.
+ *
+ * The terminal shows a zero width char in the column of the char before it,
+ * so it is added to that column, or left out if that isn't the char before it
+ * in the same string, e.g. after the prompt.
+ */
+static int screen_put(struct current *current, int col, struct cell_base *base, const char *text, int len, int ch, int w)
+{
+    unsigned *cells = current->cells;
+
+    if (ch < ' ') {
+        cells[col++] = CELL_CTRL | (ch + '@');
+        cells[col++] = CELL_CTRL | CELL_CONT | (ch + '@');
+        base->col = -1;
+    }
+    else if (w == 0) {
+        if (base->col < 0 || base->text + base->len != text) {
+            return col;
+        }
+        if (current->texts == NULL) {
+            current->texts = (struct cell_text *)mallocFn(sizeof(*current->texts) * current->cells_max);
+            if (current->texts == NULL) {
+                return col;
+            }
+        }
+        base->len += len;
+        current->texts[base->col].text = base->text;
+        current->texts[base->col].len = base->len;
+        cells[base->col] = (cells[base->col] & CELL_ATTR) | CELL_TEXT | text_hash(base->text, base->len);
+    }
+    else {
+        base->col = col;
+        base->text = text;
+        base->len = len;
+        cells[col++] = ch;
+        while (--w > 0) {
+            cells[col++] = CELL_CONT | ch;
+        }
+    }
+    return col;
+}
+
+/* Gives columns 'from' up to 'to' of 'cells' attribute 'attr', except any control chars */
+static void screen_attr(struct current *current, int from, int to, unsigned attr)
+{
+    unsigned *cells = current->cells;
+
+    attr <<= CELL_ATTR_SHIFT;
+    while (from < to) {
+        if (!(cells[from] & CELL_CTRL)) {
+            cells[from] |= attr;
+        }
+        from++;
+    }
+}
+
+/**
+ * Sets 'cells' from column 'col' on to chars 'first' up to 'last' of the line,
+ * in the colours from the highlight callback, followed by the hint if 'last'
+ * is the end of the line and there is room for it on the row. Sets '*x' to the
+ * column of the cursor. See screen_build() for 'wrap' and the return value.
+ */
+static int screen_build_line(struct current *current, int col, int first, int last, int wrap, int *x)
+{
+    const struct charpos *layout = current->layout;
+    const unsigned char *attrs = current->attrs_version == current->version ? current->attrs : NULL;
+    const char *hint = current->hint_version == current->version && last == current->chars ? current->hint : NULL;
+    int n = col + layout[last].col - layout[first].col;
+    struct cell_base base;
+    int i;
+
+    if (wrap) {
+        n += n / wrap + 1;
+    }
+    else if (n > current->cols) {
+        return -1;
+    }
+    if (!screen_reserve(current, hint ? n + current->cols : n)) {
+        return -1;
+    }
+    base.col = -1;
+    base.text = NULL;
+    base.len = 0;
+    *x = col;
+    for (i = first; i < last; i++) {
+        const char *text = current->buf + layout[i].offset;
+        int w = layout[i + 1].col - layout[i].col;
+        int start;
+        int ch;
+
+        (void)utf8_tounicode(text, &ch);
+        col = screen_pad(current, col, wrap, w);
+        if (i == current->pos) {
+            *x = col;
+        }
+        start = col;
+        col = screen_put(current, col, &base, text, layout[i + 1].offset - layout[i].offset, ch, w);
+        if (attrs && attrs[layout[i].offset]) {
+            screen_attr(current, start, col, attrs[layout[i].offset]);
+        }
+    }
+    if (current->pos >= last) {
+        *x = col;
+    }
+    if (hint) {
+        /* Up to the end of the row, short of the last column so as not to wrap */
+        int room = (wrap ? wrap - col % wrap : current->cols - col) - 1;
+        int start = col;
+
+        while (*hint && (unsigned char)*hint >= ' ') {
+            int ch;
+            int len = utf8_tounicode(hint, &ch);
+            int w = utf8_width(ch);
+
+            if (w > room) {
+                break;
+            }
+            col = screen_put(current, col, &base, hint, len, ch, w);
+            room -= w;
+            hint += len;
+        }
+        screen_attr(current, start, col, current->hint_attr);
+    }
+    return col;
+}
+
+/**
+ * Sets 'cells' to the prompt followed by chars 'first' up to 'last' of the line,
+ * and '*x' to the column of the cursor.
+ *
+ * If 'wrap' is set, the columns are rows of that many, and a char which
+ * would be split across two rows starts the next one instead.
+ * Otherwise they must fit in the window.
+ *
+ * Returns the number of columns, or -1 if out of memory, if the prompt
+ * contains control chars, which only the terminal knows what to make of,
+ * or if it doesn't fit.
+ */
+static int screen_build(struct current *current, const char *prompt, int plen, int first, int last, int wrap, int *x)
+{
+    int n = prompt_cols(prompt, plen);
+    struct cell_base base;
+    int col = 0;
+    int b;
+
+    if (wrap) {
+        /* Room to pad the end of every row */
+        n += n / wrap + 1;
+    }
+    if (!screen_reserve(current, n)) {
+        return -1;
+    }
+    base.col = -1;
+    base.text = NULL;
+    base.len = 0;
+    for (b = 0; b < plen; ) {
+        int ch;
+        int len;
+
+        if ((unsigned char)prompt[b] < ' ') {
+            return -1;
+        }
+        len = utf8_tounicode(prompt + b, &ch);
+        col = screen_pad(current, col, wrap, utf8_width(ch));
+        col = screen_put(current, col, &base, prompt + b, len, ch, utf8_width(ch));
+        b += len;
+    }
+    return screen_build_line(current, col, first, last, wrap, x);
+}
+
+/* Roughly the number of bytes needed to write columns 'from' up to 'to' of 'cells' */
+static int screen_cost(const struct current *current, int from, int to)
+{
+    unsigned attr = 0;
+    int cost = 0;
+    int i;
+
+    for (i = from; i < to; i++) {
+        unsigned cell = current->cells[i];
+        unsigned ch = cell & CELL_CHAR;
+
+        if (cell & CELL_CONT) {
+            continue;
+        }
+        if (cell & CELL_CTRL) {
+            cost += 9;
+            attr = 0;
+            continue;
+        }
+        if ((cell & CELL_ATTR) != attr) {
+            attr = cell & CELL_ATTR;
+            cost += 8;
+        }
+        if (cell & CELL_TEXT) {
+            cost += current->texts[i].len;
+        }
+        else {
+            cost += ch < 0x80 ? 1 : ch < 0x800 ? 2 : ch < 0x10000 ? 3 : 4;
+        }
+    }
+    return attr ? cost + 4 : cost;
+}
+
+/**
+ * Writes columns 'from' up to 'to' of 'cells', where 'from' is the first column of a char.
+ * The attributes go out along with the chars, and are back to normal at the end.
+ */
+static void screen_write(struct current *current, int from, int to)
+{
+    const unsigned *cells = current->cells;
+    unsigned attr = 0;
+    char buf[64];
+    int b = 0;
+    int i;
+
+    for (i = from; i < to; i++) {
+        unsigned cell = cells[i];
+
+        if (cell & CELL_CONT) {
+            continue;
+        }
+        if (cell & CELL_CTRL) {
+            outputChars(current, buf, b);
+            outputControlChar(current, cell & CELL_CHAR);
+            /* Which leaves the usual attributes */
+            attr = 0;
+            b = 0;
+            continue;
+        }
+        if ((cell & CELL_ATTR) != attr) {
+            int j = i;
+
+            outputChars(current, buf, b);
+            b = 0;
+            attr = cell & CELL_ATTR;
+            while (j < to && (cells[j] & (CELL_CTRL | CELL_ATTR)) == attr) {
+                j++;
+            }
+            outputAttr(current, (attr >> CELL_ATTR_SHIFT) & ~ATTR_BOLD, attr & (ATTR_BOLD << CELL_ATTR_SHIFT), j - i);
+        }
+        if (cell & CELL_TEXT) {
+            outputChars(current, buf, b);
+            outputChars(current, current->texts[i].text, current->texts[i].len);
+            b = 0;
+            continue;
+        }
+        if (b > (int)sizeof(buf) - 4) {
+            outputChars(current, buf, b);
+            b = 0;
+        }
+        b += utf8_getchars(buf + b, cell & CELL_CHAR);
+    }
+    if (b) {
+        outputChars(current, buf, b);
+    }
+    if (attr) {
+        outputAttr(current, 0, 0, 0);
+    }
+}
+
+/**
+ * Changes the line on the screen from 'shown' to the 'n' columns of 'cells'
+ * by writing just the columns which differ. Either everything from the first
+ * change on is written again, or where the end of the line is unchanged but
+ * has moved, it is moved along or back instead. Leaves the cursor at column 'x'.
+ *
+ * Returns 0 if it's no cheaper than redrawing the whole line.
+ */
+static int screen_update(struct current *current, int n, int x)
+{
+    const unsigned *cells = current->cells;
+    const unsigned *shown = current->shown;
+    int o = current->shown_len;
+    int p = 0;
+    int s = 0;
+    int to = n;
+    int shift = 0;
+    int cost;
+
+    /* The columns which stay the same at the start... */
+    while (p < n && p < o && cells[p] == shown[p]) {
+        p++;
+    }
+    /* ...back to where a char starts */
+    while (p > 0 && ((p < n && (cells[p] & CELL_CONT)) || (p < o && (shown[p] & CELL_CONT)))) {
+        p--;
+    }
+    /* And likewise at the end */
+    while (s < n - p && s < o - p && cells[n - 1 - s] == shown[o - 1 - s]) {
+        s++;
+    }
+    while (s > 0 && (cells[n - s] & CELL_CONT)) {
+        s--;
+    }
+
+    cost = screen_cost(current, p, n) + (o > n ? 4 : 0);
+#ifdef USE_TERMIOS
+    if (s && n != o && screen_cost(current, p, n - s) + 5 < cost) {
+        to = n - s;
+        shift = n - o;
+        cost = screen_cost(current, p, to) + 5;
+    }
+#endif
+    if (p == 0 && cost + 4 >= screen_cost(current, 0, n) + 4) {
+        return 0;
+    }
+
+    if (p < to || shift || o > n) {
+        cursorMove(current, current->shown_x, p);
+#ifdef USE_TERMIOS
+        if (shift > 0) {
+            insertColumns(current, shift);
+        }
+        else if (shift < 0) {
+            deleteColumns(current, -shift);
+        }
+#endif
+#ifdef USE_WINCONSOLE
+        /* Control chars are highlighted, which writing over them doesn't undo */
+        clearAttributes(current, p, (o > n ? o : n) - p);
+#endif
+        screen_write(current, p, to);
+        if (!shift && o > n) {
+            eraseEol(current);
+        }
+        cursorMove(current, to, x);
+    }
+    else {
+        cursorMove(current, current->shown_x, x);
+    }
+    return 1;
+}
+
+/* Makes 'cells', now on the screen with the cursor at 'x', the new 'shown' */
+static void screen_shown(struct current *current, int n, int x)
+{
+    unsigned *shown = current->shown;
+
+    current->shown = current->cells;
+    current->cells = shown;
+    current->shown_len = n;
+    current->shown_x = x;
+}
+
+/* Says that the line is no longer on the screen, and the cursor is at the start of an empty row */
+static void screen_lost(struct current *current)
+{
+    current->shown_len = -1;
+    current->shown_x = 0;
+    current->shown_row = 0;
+    current->shown_rows = 0;
+}
+
+/* Moves the cursor from column 'col' of row 'row' of the line to column 'c' of row 'r' */
+static void screen_move(struct current *current, int row, int col, int r, int c)
+{
+    if (r < row) {
+        cursorUp(current, row - r);
+    }
+    while (row < r) {
+        /* The rows below may not be there yet */
+        outputNewline(current);
+        row++;
+        col = 0;
+    }
+    if (c != col) {
+        cursorMove(current, col, c);
+    }
+}
+
+/**
+ * Shows the 'n' columns of 'cells' as rows of the window width, with the
+ * cursor at column 'x'. Starting from the first column which changed, rows
+ * which differ from 'shown' are written again. If 'shown' isn't known,
+ * every row is.
+ */
+static void screen_update_rows(struct current *current, int n, int x)
+{
+    const unsigned *cells = current->cells;
+    const unsigned *shown = current->shown;
+    int cols = current->cols;
+    int o = current->shown_len;
+    int rows = (n > x ? n - 1 : x) / cols + 1;
+    int row = current->shown_row;
+    int col = o >= 0 ? current->shown_x - row * cols : cols;
+    int p = 0;
+    int r;
+
+    if (o >= 0) {
+        while (p < n && p < o && cells[p] == shown[p]) {
+            p++;
+        }
+        while (p > 0 && ((p < n && (cells[p] & CELL_CONT)) || (p < o && (shown[p] & CELL_CONT)))) {
+            p--;
+        }
+    }
+    if (o < 0 || p < n || p < o) {
+        for (r = p / cols; r < rows; r++) {
+            int start = r * cols;
+            int end = start + cols < n ? start + cols : n;
+            int from = r == p / cols ? p : start;
+
+            if (r > p / cols && end == (start + cols < o ? start + cols : o)
+                    && memcmp(cells + start, shown + start, sizeof(*cells) * (end - start)) == 0) {
+                /* Unchanged, as when a char is replaced */
+                continue;
+            }
+            screen_move(current, row, col, r, from - start);
+#ifdef USE_WINCONSOLE
+            clearAttributes(current, from - start, cols - (from - start));
+#endif
+            screen_write(current, from, end);
+            row = r;
+            col = end - start;
+            if (col < cols && (o < 0 || o > end)) {
+                eraseEol(current);
+            }
+        }
+        /* Clear the rows the line no longer needs */
+        for (; r < current->shown_rows && (o < 0 || r * cols < o); r++) {
+            screen_move(current, row, col, r, 0);
+            cursorToLeft(current);
+            eraseEol(current);
+            row = r;
+            col = cols;
+        }
+    }
+    screen_move(current, row, col, x / cols, x % cols);
+    screen_shown(current, n, x);
+    current->shown_row = x / cols;
+    current->shown_rows = rows;
+}
+
+/* Moves the cursor to the start of the last row of the line, so that what follows goes below it */
+static void screen_below(struct current *current)
+{
+    if (current->shown_row + 1 < current->shown_rows) {
+        screen_move(current, current->shown_row, 0, current->shown_rows - 1, 0);
+        current->shown_row = current->shown_rows - 1;
+        current->shown_x = current->shown_row * current->cols;
+    }
+}
+
+/* Erases the line from the screen, leaving the cursor where it started */
+static void screen_clear(struct current *current)
+{
+    int i;
+
+    if (current->shown_row) {
+        cursorUp(current, current->shown_row);
+    }
+    cursorToLeft(current);
+    eraseEol(current);
+    for (i = 1; i < current->shown_rows; i++) {
+        outputNewline(current);
+        eraseEol(current);
+    }
+    if (current->shown_rows > 1) {
+        cursorUp(current, current->shown_rows - 1);
+    }
+#ifdef USE_WINCONSOLE
+    setCursorPos(current, 0);
+#endif
+    screen_lost(current);
+}
+
+static void refreshScreen(const char *prompt, struct current *current)
+{
+    int plen;
+    int pchars;
+    int i;
+    int b;
+    int n;
+    int x;
+    int first = 0;
+    int last;
+    const struct charpos *layout = current->layout;
+    const char *buf;
+
+    current->ctx->refresh_writes = 0;
+
+    updateWindowSize(current);
+    render_update(current);
+
+    plen = strlen(prompt);
+    pchars = prompt_cols(prompt, plen);
+
+    if (current->ctx->multiline) {
+        n = screen_build(current, prompt, plen, 0, current->chars, current->cols, &x);
+        if (n >= 0) {
+            screen_update_rows(current, n, x);
+            outputFlush(current);
+            return;
+        }
+    }
+
+    /* Account for a line which is too long to fit in the window.
+     * Room is needed for the prompt, everything up to and including
+     * the char at the cursor, and at least one column for each char after that.
+     */
+    i = current->pos < current->chars ? current->pos + 1 : current->chars;
+    n = pchars + layout[i].col + current->chars - i;
+
+    /* If too many are needed, strip chars off the front of 'buf'
+     * until it fits, i.e. start at the first char beyond the excess.
+     */
+    if (n >= current->cols) {
+        first = char_after_col(current, n - current->cols);
+        if (first > current->pos) {
+            /* That would scroll the cursor off the left edge, so only make room up to the cursor */
+            first = char_after_col(current, n - (current->chars - i) - current->cols);
+            if (first > current->pos) {
+                first = current->pos;
+            }
+        }
+    }
+
+    /* Then as many chars as fit. If we hit 'cols', stop. */
+    for (last = first; last < current->chars; last++) {
+        if (pchars + layout[last + 1].col - layout[first].col > current->cols) {
+            break;
+        }
+    }
+    x = pchars + layout[current->pos].col - layout[first].col;
+
+    /* Write just what changed, if the screen is known */
+    n = screen_build(current, prompt, plen, first, last, 0, &x);
+    if (n >= 0 && current->shown_len >= 0 && current->shown_rows == 1 && screen_update(current, n, x)) {
+        screen_shown(current, n, x);
+        outputFlush(current);
+        return;
+    }
+
+    /* Cursor to left edge, then everything */
+    if (current->shown_row) {
+        /* Left on a later row in multi-line mode */
+        cursorUp(current, current->shown_row);
+    }
+    cursorToLeft(current);
+    if (n >= 0) {
+        screen_write(current, 0, n);
+    }
+    else {
+        /* The prompt as it is, then the line */
+        outputChars(current, prompt, plen);
+        i = screen_build_line(current, pchars, first, last, 0, &x);
+        if (i >= 0) {
+            screen_write(current, pchars, i);
+        }
+        else {
+            /* Out of memory, so just the chars. Control chars need special handling */
+            buf = current->buf + layout[first].offset;
+            b = 0; /* unwritted bytes */
+            for (i = first; i < last; i++) {
+                if ((unsigned char)buf[b] < ' ') {
+                    /* A control character, so write the buffer so far */
+                    outputChars(current, buf, b);
+                    outputControlChar(current, buf[b] + '@');
+                    buf += b + 1;
+                    b = 0;
+                }
+                else {
+                    b += layout[i + 1].offset - layout[i].offset;
+                }
+            }
+            outputChars(current, buf, b);
+        }
+    }
+
+    /* Erase to right, move cursor to original position */
+    eraseEol(current);
+    setCursorPos(current, x);
+    outputFlush(current);
+
+    if (n >= 0) {
+        screen_shown(current, n, x);
+    }
+    else {
+        current->shown_len = -1;
+    }
+    current->shown_row = 0;
+    current->shown_rows = 1;
+}
+
+static void refreshLine(const char *prompt, struct current *current)
+{
+    linenoiseContext *ctx = current->ctx;
+    linenoiseStats *stats = &ctx->stats;
+    unsigned long long bytes = stats->bytes_written;
+    long long start = stats_start(ctx);
+
+    refreshScreen(prompt, current);
+
+    if (ctx->stats_enabled) {
+        long long us = stats_now() - start;
+
+        stats->refreshes++;
+        stats->refresh_us += us;
+        if (us > (long long)stats->refresh_max_us) {
+            stats->refresh_max_us = us;
+        }
+        stats->refresh_bytes += stats->bytes_written - bytes;
+        if (stats->bytes_written - bytes > stats->refresh_max_bytes) {
+            stats->refresh_max_bytes = stats->bytes_written - bytes;
+        }
+        if ((unsigned long)ctx->refresh_writes > stats->refresh_max_writes) {
+            stats->refresh_max_writes = ctx->refresh_writes;
+        }
+    }
+}
+
+/* Recalculates the position of every char in the line from char 'pos' on */
+static void layout_build_from(struct current *current, int pos)
+{
+    int i = pos;
+    int b = current->layout[pos].offset;
+    int col = current->layout[pos].col;
+
+    while (b < current->len) {
+        int ch;
+        current->layout[i].offset = b;
+        current->layout[i].col = col;
+        b += utf8_tounicode(current->buf + b, &ch);
+        col += char_cols(ch);
+        i++;
+    }
+    current->layout[i].offset = current->len;
+    current->layout[i].col = col;
+    current->chars = i;
+}
+
+static void layout_build(struct current *current)
+{
+    current->layout[0].offset = 0;
+    current->layout[0].col = 0;
+    layout_build_from(current, 0);
+}
+
+/**
+ * Grows the buffer (and layout) to at least 'size' bytes.
+ * The size is doubled each time to keep inserting cheap.
+ *
+ * Returns 0 if out of memory.
+ */
+static int grow_buffer(struct current *current, int size)
+{
+    int bufmax = current->bufmax;
+    char *buf;
+    struct charpos *layout;
+
+    if (size <= bufmax) {
+        return 1;
+    }
+    while (bufmax < size) {
+        bufmax *= 2;
+    }
+
+    if (current->buf == current->inbuf) {
+        buf = (char *)mallocFn(bufmax);
+        layout = (struct charpos *)mallocFn(sizeof(*layout) * bufmax);
+        if (buf == NULL || layout == NULL) {
+            freeFn(buf);
+            freeFn(layout);
+            return 0;
+        }
+        memcpy(buf, current->buf, current->len + 1);
+        memcpy(layout, current->layout, sizeof(*layout) * (current->chars + 1));
+    }
+    else {
+        buf = (char *)reallocFn(current->buf, bufmax);
+        if (buf == NULL) {
+            return 0;
+        }
+        current->buf = buf;
+        layout = (struct charpos *)reallocFn(current->layout, sizeof(*layout) * bufmax);
+        if (layout == NULL) {
+            return 0;
+        }
+    }
+    current->buf = buf;
+    current->layout = layout;
+    current->bufmax = bufmax;
+    return 1;
+}
+
+/* Says that 'buf' has changed, so that what was worked out from it is worked out again */
+static void buffer_changed(struct current *current)
+{
+    if (++current->version == 0) {
+        /* 0 is for none */
+        current->version = 1;
+    }
+}
+
+static void set_current(struct current *current, const char *str)
+{
+    grow_buffer(current, strlen(str) + 1);
+    strncpy(current->buf, str, current->bufmax);
+    current->buf[current->bufmax - 1] = 0;
+    current->len = strlen(current->buf);
+    layout_build(current);
+    current->pos = current->chars;
+    buffer_changed(current);
+}
+
+static int has_room(struct current *current, int bytes)
+{
+    return grow_buffer(current, current->len + bytes + 2);
+}
+
+/**
+ * Removes the char at 'pos'.
+ *
+ * Returns 1 if removed, 0 if not
+ */
+static int remove_char(struct current *current, int pos)
+{
+    if (pos >= 0 && pos < current->chars) {
+        struct charpos *layout = current->layout;
+        int p1, p2;
+        int w;
+        int i;
+        p1 = layout[pos].offset;
+        p2 = layout[pos + 1].offset;
+        w = layout[pos + 1].col - layout[pos].col;
+
+        /* Move the null char too */
+        memmove(current->buf + p1, current->buf + p2, current->len - p2 + 1);
+        current->len -= (p2 - p1);
+        current->chars--;
+
+        /* Everything after the char moves back */
+        memmove(layout + pos, layout + pos + 1, sizeof(*layout) * (current->chars - pos + 1));
+        for (i = pos; i <= current->chars; i++) {
+            layout[i].offset -= p2 - p1;
+            layout[i].col -= w;
+        }
+
+        if (current->pos > pos) {
+            current->pos--;
+        }
+        buffer_changed(current);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Insert 'ch' at position 'pos'
+ *
+ * Returns 1 if inserted, 0 if not (no room)
+ */
+static int insert_char(struct current *current, int pos, int ch)
+{
+    char buf[4];
+    int n = utf8_getchars(buf, ch);
+
+    if (has_room(current, n) && pos >= 0 && pos <= current->chars) {
+        struct charpos *layout = current->layout;
+        int p1;
+        int w = char_cols(ch);
+        int i;
+        p1 = layout[pos].offset;
+
+        memmove(current->buf + p1 + n, current->buf + p1, current->len - p1 + 1);
+        memcpy(current->buf + p1, buf, n);
+        current->len += n;
+
+        /* Everything after the new char moves along */
+        memmove(layout + pos + 1, layout + pos, sizeof(*layout) * (current->chars - pos + 1));
+        current->chars++;
+        for (i = pos + 1; i <= current->chars; i++) {
+            layout[i].offset += n;
+            layout[i].col += w;
+        }
+
+        if (current->pos >= pos) {
+            current->pos++;
+        }
+        buffer_changed(current);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Inserts the 'len' bytes at 'str' at position 'pos' with a single move
+ * of the rest of the line.
+ *
+ * Returns the number of chars inserted (0 if there was no room)
+ */
+static int insert_chars(struct current *current, int pos, const char *str, int len)
+{
+    int p1;
+    int chars = current->chars;
+
+    if (len == 0 || pos < 0 || pos > current->chars || !has_room(current, len)) {
+        return 0;
+    }
+    p1 = current->layout[pos].offset;
+    memmove(current->buf + p1 + len, current->buf + p1, current->len - p1 + 1);
+    memcpy(current->buf + p1, str, len);
+    current->len += len;
+
+    /* The text could join up with what follows, so decode everything after 'pos' again */
+    layout_build_from(current, pos);
+    chars = current->chars - chars;
+
+    if (current->pos >= pos) {
+        current->pos += chars;
+    }
+    buffer_changed(current);
+    return chars;
+}
+
+/**
+ * Returns 0 if no chars were removed or non-zero otherwise.
+ */
+static int remove_chars(struct current *current, int pos, int n)
+{
+    int removed = 0;
+    while (n-- && remove_char(current, pos)) {
+        removed++;
+    }
+    return removed;
+}
+
+#ifndef NO_COMPLETION
+static void beep() {
+#ifdef USE_TERMIOS
+    fprintf(stderr, "\x7");
+    fflush(stderr);
+#endif
+}
+
+/* Completions are bump-allocated from a list of chunks, each twice the size
+ * of the one before, so that adding thousands of them costs a handful of
+ * allocations. The list is emptied rather than freed after each completion,
+ * keeping just the biggest chunk, so that after a while completing
+ * allocates nothing at all.
+ */
+#define COMPLETION_CHUNK_MIN 4096
+
+struct linenoiseCompletionChunk {
+    struct linenoiseCompletionChunk *next;  /* The next older chunk */
+    size_t size;    /* Bytes available in 'data' */
+    size_t used;    /* Bytes handed out from 'data' */
+    char data[1];
+};
+
+static void completion_chunks_free(struct linenoiseCompletionChunk *chunk)
+{
+    while (chunk) {
+        struct linenoiseCompletionChunk *next = chunk->next;
+        freeFn(chunk);
+        chunk = next;
+    }
+}
+
+static void freeCompletions(linenoiseCompletions *lc) {
+    completion_chunks_free(lc->chunks);
+    freeFn(lc->cvec);
+    memset(lc, 0, sizeof(*lc));
+}
+
+/* Empties 'lc', keeping its memory for the next completions */
+static void completions_reset(linenoiseCompletions *lc)
+{
+    struct linenoiseCompletionChunk **link, **biggest = &lc->chunks;
+
+    if (lc->chunks) {
+        /* Keep the biggest chunk, which completeWake() may have moved in behind the newest */
+        struct linenoiseCompletionChunk *chunk;
+
+        for (link = &lc->chunks; *link; link = &(*link)->next) {
+            if ((*link)->size > (*biggest)->size) {
+                biggest = link;
+            }
+        }
+        chunk = *biggest;
+        *biggest = chunk->next;
+        completion_chunks_free(lc->chunks);
+        chunk->next = NULL;
+        chunk->used = 0;
+        lc->chunks = chunk;
+    }
+    lc->len = 0;
+}
+
+/* Makes room for 'n' more completions in 'cvec'. Returns 0 if out of memory. */
+static int completions_grow(linenoiseCompletions *lc, size_t n)
+{
+    size_t max = lc->max ? lc->max : 16;
+    char **cvec;
+
+    if (lc->len + n <= lc->max) {
+        return 1;
+    }
+    while (max < lc->len + n) {
+        max *= 2;
+    }
+    cvec = (char **)reallocFn(lc->cvec, sizeof(char *) * max);
+    if (cvec == NULL) {
+        return 0;
+    }
+    lc->cvec = cvec;
+    lc->max = max;
+    return 1;
+}
+
+/* Leaves just the completions which begin with the 'len' bytes of 'line' */
+static void completions_filter(linenoiseCompletions *lc, const char *line, int len)
+{
+    size_t i;
+    size_t n = 0;
+
+    for (i = 0; i < lc->len; i++) {
+        if (strncmp(lc->cvec[i], line, len) == 0) {
+            lc->cvec[n++] = lc->cvec[i];
+        }
+    }
+    lc->len = n;
+}
+
+/**
+ * Keeps a copy of the line being completed, reusing the buffer of last time
+ * if it is big enough. The completions shown replace the line, so this
+ * is what Escape goes back to.
+ *
+ * Returns 0 if out of memory.
+ */
+static int completion_keep_line(linenoiseContext *ctx, const char *line, int len)
+{
+    if ((size_t)len + 1 > ctx->completion_max) {
+        char *buf = (char *)reallocFn(ctx->completion_line, len + 1);
+
+        if (buf == NULL) {
+            return 0;
+        }
+        ctx->completion_line = buf;
+        ctx->completion_max = len + 1;
+    }
+    memcpy(ctx->completion_line, line, len + 1);
+    return 1;
+}
+
+static void completion_free(linenoiseContext *ctx)
+{
+    freeCompletions(&ctx->completions);
+    freeFn(ctx->completion_line);
+    ctx->completion_line = NULL;
+    ctx->completion_max = 0;
+    ctx->completion_cached = 0;
+}
+
+/* Returns the number of bytes which all the completions begin with */
+static size_t completions_common(const linenoiseCompletions *lc)
+{
+    const char *first = lc->cvec[0];
+    size_t n = strlen(first);
+    size_t i;
+
+    for (i = 1; i < lc->len && n; i++) {
+        size_t j = 0;
+
+        while (j < n && lc->cvec[i][j] == first[j]) {
+            j++;
+        }
+        n = j;
+    }
+#ifdef USE_UTF8
+    /* Not a part of a char */
+    while (n && (first[n] & 0xc0) == 0x80) {
+        n--;
+    }
+#endif
+    return n;
+}
+
+/**
+ * Completes the line as far as all of the completions agree, or if that's no
+ * further, waits for a second tab to list them. (LINENOISE_COMPLETE_LIST)
+ *
+ * Returns 1 if waiting.
+ */
+static int completeCommon(struct current *current)
+{
+    linenoiseCompletions *lc = &current->ctx->completions;
+    size_t n;
+
+    if (lc->len == 0) {
+        beep();
+        return 0;
+    }
+    n = completions_common(lc);
+    if (n > (size_t)current->len && strncmp(lc->cvec[0], current->buf, current->len) == 0) {
+        insert_chars(current, current->chars, lc->cvec[0] + current->len, n - current->len);
+        current->pos = current->chars;
+        refreshLine(current->prompt, current);
+        return 0;
+    }
+    if (lc->len == 1) {
+        /* Already complete */
+        return 0;
+    }
+    beep();
+    current->listed = 0;
+    current->mode = EDIT_COMPLETE;
+    return 1;
+}
+
+/* Outputs 'str', showing control characters as ^X */
+static void outputCompletion(struct current *current, const char *str)
+{
+    int b = 0;
+
+    while (str[b]) {
+        if ((unsigned char)str[b] < ' ') {
+            outputChars(current, str, b);
+            outputControlChar(current, str[b] + '@');
+            str += b + 1;
+            b = 0;
+        }
+        else {
+            b++;
+        }
+    }
+    outputChars(current, str, b);
+}
+
+/**
+ * Lists the next screen full of completions below the line, down each of
+ * as many columns as fit across the window, then shows the line again below.
+ * It all goes to the terminal in one write.
+ *
+ * Returns 0 once the last of them has been listed.
+ */
+static int completeList(struct current *current)
+{
+    static const char spaces[] = "                ";
+    linenoiseCompletions *lc = &current->ctx->completions;
+    int width = 0;
+    int columns;
+    int rows;
+    int page;
+    int row;
+    size_t i;
+
+    updateWindowSize(current);
+    for (i = 0; i < lc->len; i++) {
+        int w = str_cols(lc->cvec[i]);
+        if (w > width) {
+            width = w;
+        }
+    }
+    width += 2;
+    columns = (current->cols + 1) / width;
+    if (columns < 1) {
+        columns = 1;
+    }
+    rows = (lc->len + columns - 1) / columns;
+    /* Leave room for the line */
+    page = (current->rows > 1 ? current->rows : 24) - (current->shown_rows > 1 ? current->shown_rows : 1);
+    if (page < 1) {
+        page = 1;
+    }
+
+    /* The list goes below all of the line */
+    screen_below(current);
+    for (row = current->listed; row < rows && row < current->listed + page; row++) {
+        int col;
+
+        outputNewline(current);
+        for (col = 0; col < columns && (i = col * rows + row) < lc->len; col++) {
+            if (col) {
+                /* Pad out the one before */
+                int pad = width - str_cols(lc->cvec[i - rows]);
+
+                while (pad > 0) {
+                    int n = pad < (int)sizeof(spaces) - 1 ? pad : (int)sizeof(spaces) - 1;
+                    outputChars(current, spaces, n);
+                    pad -= n;
+                }
+            }
+            outputCompletion(current, lc->cvec[i]);
+        }
+        eraseEol(current);
+    }
+    current->listed = row;
+    outputNewline(current);
+    screen_lost(current);
+    refreshLine(current->prompt, current);
+    return row < rows;
+}
+
+#ifdef USE_ASYNC_COMPLETION
+/**
+ * Completions being found by a linenoiseAsyncCompletionCallback.
+ *
+ * Both the editor and the callback hold a reference. The callback pushes
+ * completions into 'lc', from which the editor takes them once woken.
+ * The editor cancels the request once it isn't wanted any more, after which
+ * nothing more is pushed, so the wake pipe is never written after that.
+ */
+struct linenoiseCompletionRequest {
+    linenoiseCompletions lc; /* Pushed, but not yet taken by the editor */
+    int wakefd;         /* Written to when there is something for the editor */
+    int woken;          /* Already written to since the editor last looked */
+    int done;           /* linenoiseCompletionDone() was called */
+    int cancelled;      /* The editor no longer wants the completions */
+    int refs;
+    char lock;          /* Held while changing any of the above */
+};
+
+static void request_lock(linenoiseCompletionRequest *req)
+{
+    while (__atomic_test_and_set(&req->lock, __ATOMIC_ACQUIRE)) {
+    }
+}
+
+static void request_unlock(linenoiseCompletionRequest *req)
+{
+    __atomic_clear(&req->lock, __ATOMIC_RELEASE);
+}
+
+static void request_release(linenoiseCompletionRequest *req)
+{
+    if (__atomic_sub_fetch(&req->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        freeCompletions(&req->lc);
+        freeFn(req);
+    }
+}
+
+/* Wakes the editor unless it has yet to look since last time. Called with the lock held. */
+static void request_wake(linenoiseCompletionRequest *req)
+{
+    if (!req->woken) {
+        req->woken = 1;
+        IGNORE_RC(write(req->wakefd, "", 1));
+    }
+}
+
+/**
+ * Adds a completion to those found by a linenoiseAsyncCompletionCallback.
+ * May be called from any thread, until linenoiseCompletionDone().
+ *
+ * Returns 0 if the editor no longer wants the completions, so there is no
+ * point in looking for any more.
+ */
+int linenoiseCompletionPush(linenoiseCompletionRequest *req, const char *str)
+{
+    int wanted;
+
+    request_lock(req);
+    wanted = !req->cancelled;
+    if (wanted) {
+        linenoiseAddCompletion(&req->lc, str);
+        request_wake(req);
+    }
+    request_unlock(req);
+    return wanted;
+}
+
+/* Says that all the completions have been pushed. 'req' must not be used afterwards. */
+void linenoiseCompletionDone(linenoiseCompletionRequest *req)
+{
+    request_lock(req);
+    req->done = 1;
+    if (!req->cancelled) {
+        request_wake(req);
+    }
+    request_unlock(req);
+    request_release(req);
+}
+
+/* Stops waiting for the completions of the asynchronous callback */
+static void completeCancel(struct current *current)
+{
+    linenoiseCompletionRequest *req = current->request;
+
+    if (req) {
+        request_lock(req);
+        req->cancelled = 1;
+        request_unlock(req);
+        request_release(req);
+        current->request = NULL;
+    }
+}
+
+static void completeEnd(struct current *current);
+
+/**
+ * Takes the completions pushed since last time, showing the first
+ * if there were none before. Finishes completion if it turns out that
+ * there are none at all.
+ */
+static void completeWake(struct current *current)
+{
+    linenoiseCompletionRequest *req = current->request;
+    linenoiseCompletions *lc = &current->ctx->completions;
+    size_t len = lc->len;
+    int done;
+
+    if (req == NULL) {
+        return;
+    }
+    request_lock(req);
+    if (req->lc.len && completions_grow(lc, req->lc.len)) {
+        /* Take the strings too, by moving their chunks behind the newest one of 'lc' */
+        struct linenoiseCompletionChunk *last = req->lc.chunks;
+
+        memcpy(lc->cvec + lc->len, req->lc.cvec, sizeof(char *) * req->lc.len);
+        lc->len += req->lc.len;
+        req->lc.len = 0;
+        while (last->next) {
+            last = last->next;
+        }
+        if (lc->chunks) {
+            last->next = lc->chunks->next;
+            lc->chunks->next = req->lc.chunks;
+        }
+        else {
+            lc->chunks = req->lc.chunks;
+        }
+        req->lc.chunks = NULL;
+    }
+    req->woken = 0;
+    done = req->done;
+    request_unlock(req);
+
+    if (done) {
+        /* That is all of them, so they can be filtered next time */
+        current->ctx->completion_cached = 1;
+        completeCancel(current);
+    }
+    if (current->ctx->completion_mode == LINENOISE_COMPLETE_LIST) {
+        /* Nothing to show until they are all there */
+        if (done) {
+            current->mode = EDIT_NORMAL;
+            completeCommon(current);
+        }
+    }
+    else if (lc->len == 0) {
+        if (done) {
+            beep();
+            completeEnd(current);
+        }
+    }
+    else if (current->completion == len) {
+        if (len == 0) {
+            /* The first completion, so show it in place of the original line */
+            current->completion = 0;
+            set_current(current, lc->cvec[0]);
+            refreshLine(current->prompt, current);
+        }
+        else {
+            /* Still showing the original line */
+            current->completion = lc->len;
+        }
+    }
+}
+
+/**
+ * Starts the asynchronous callback finding the completions of the line.
+ * Editing continues meanwhile, and completeWake() shows them once they come.
+ *
+ * Returns 0 if out of memory.
+ */
+static int completeStart(struct current *current) {
+    linenoiseContext *ctx = current->ctx;
+    linenoiseCompletionRequest *req;
+    long long start;
+
+    req = (linenoiseCompletionRequest *)mallocFn(sizeof(*req));
+    if (req == NULL) {
+        return 0;
+    }
+    memset(req, 0, sizeof(*req));
+    req->wakefd = ctx->wakefd[1];
+    req->refs = 2;
+    current->request = req;
+    current->origpos = current->pos;
+    current->completion = 0;
+    current->mode = EDIT_COMPLETE;
+
+    start = stats_start(ctx);
+    ctx->asyncCompletionCallback(current->buf, req, ctx->asyncCompletionData);
+    stats_time(ctx, &ctx->stats.completion_calls, &ctx->stats.completion_us, start);
+    /* Take anything the callback found straight away */
+    completeWake(current);
+    return 1;
+}
+#endif
+
+/**
+ * Starts cycling through the completions of the line, showing the first.
+ *
+ * Returns 0 if there are none.
+ */
+static int completeLine(struct current *current) {
+    linenoiseContext *ctx = current->ctx;
+    linenoiseCompletions *lc = &ctx->completions;
+    long long start;
+    /* Whether the line only grew since the completions of last time */
+    int cached = ctx->completion_cache && ctx->completion_cached &&
+        strncmp(current->buf, ctx->completion_line, strlen(ctx->completion_line)) == 0;
+
+    if (!completion_keep_line(ctx, current->buf, current->len)) {
+        ctx->completion_cached = 0;
+        return 0;
+    }
+    if (cached) {
+        /* So the completions are among those of last time */
+        completions_filter(lc, current->buf, current->len);
+    }
+    else {
+        ctx->completion_cached = 0;
+        completions_reset(lc);
+#ifdef USE_ASYNC_COMPLETION
+        if (ctx->asyncCompletionCallback) {
+            return completeStart(current);
+        }
+#endif
+        start = stats_start(ctx);
+        ctx->completionCallback(current->buf, lc);
+        stats_time(ctx, &ctx->stats.completion_calls, &ctx->stats.completion_us, start);
+        ctx->completion_cached = 1;
+    }
+    if (ctx->completion_mode == LINENOISE_COMPLETE_LIST) {
+        return completeCommon(current);
+    }
+    if (lc->len == 0) {
+        beep();
+        return 0;
+    }
+
+    current->origpos = current->pos;
+    current->completion = 0;
+    current->mode = EDIT_COMPLETE;
+
+    set_current(current, lc->cvec[0]);
+    refreshLine(current->prompt, current);
+    return 1;
+}
+
+static void completeEnd(struct current *current) {
+#ifdef USE_ASYNC_COMPLETION
+    completeCancel(current);
+#endif
+    current->mode = EDIT_NORMAL;
+}
+
+/**
+ * Handles a char typed while cycling through completions.
+ *
+ * Returns the char to be handled as usual once completion has finished,
+ * or 0 if there is nothing more to do.
+ */
+static int completeChar(struct current *current, int c) {
+    linenoiseCompletions *lc = &current->ctx->completions;
+
+    if (current->ctx->completion_mode == LINENOISE_COMPLETE_LIST) {
+        if (key_action(current->ctx, c) != LINENOISE_ACTION_COMPLETE) {
+            completeEnd(current);
+            return c;
+        }
+#ifdef USE_ASYNC_COMPLETION
+        if (current->request) {
+            /* Still waiting for them all */
+            return 0;
+        }
+#endif
+        /* Each tab lists another screen full */
+        if (!completeList(current)) {
+            completeEnd(current);
+        }
+        return 0;
+    }
+
+    if (key_action(current->ctx, c) == LINENOISE_ACTION_COMPLETE) {
+        if (lc->len == 0) {
+            /* Still waiting for the first completion */
+            return 0;
+        }
+        if (lc->len == 1) {
+            set_current(current, lc->cvec[0]);
+            completeEnd(current);
+            return 0;
+        }
+
+        /* Show the next completion or the original buffer */
+        current->completion = (current->completion + 1) % (lc->len + 1);
+        if (current->completion < lc->len) {
+            set_current(current, lc->cvec[current->completion]);
+        }
+        else {
+            beep();
+            set_current(current, current->ctx->completion_line);
+            current->pos = current->origpos;
+        }
+        refreshLine(current->prompt, current);
+        return 0;
+    }
+
+    if (c == 27 && current->completion < lc->len) {
+        /* Re-show original buffer */
+        set_current(current, current->ctx->completion_line);
+        current->pos = current->origpos;
+        refreshLine(current->prompt, current);
+    }
+    /* Otherwise the buffer already holds the chosen completion */
+    completeEnd(current);
+    return c;
+}
+
+/* Register a callback function to be called for tab-completion. */
+void linenoiseCtxSetCompletionCallback(linenoiseContext *ctx, linenoiseCompletionCallback *fn) {
+    ctx->completionCallback = fn;
+    ctx->completion_cached = 0;
+}
+
+void linenoiseSetCompletionCallback(linenoiseCompletionCallback *fn) {
+    linenoiseCtxSetCompletionCallback(default_ctx(), fn);
+}
+
+/**
+ * Registers a callback to be called for tab-completion which returns
+ * straight away and pushes the completions later, perhaps from another thread.
+ *
+ * Returns -1 if asynchronous completion isn't supported here, or the wake pipe can't be made.
+ */
+int linenoiseCtxSetAsyncCompletionCallback(linenoiseContext *ctx, linenoiseAsyncCompletionCallback *fn, void *userdata) {
+#ifdef USE_ASYNC_COMPLETION
+    if (fn && ctx_wake_open(ctx) == -1) {
+        return -1;
+    }
+    ctx->asyncCompletionCallback = fn;
+    ctx->asyncCompletionData = userdata;
+    ctx->completion_cached = 0;
+    return 0;
+#else
+    (void)ctx;
+    (void)fn;
+    (void)userdata;
+    return -1;
+#endif
+}
+
+int linenoiseSetAsyncCompletionCallback(linenoiseAsyncCompletionCallback *fn, void *userdata) {
+    return linenoiseCtxSetAsyncCompletionCallback(default_ctx(), fn, userdata);
+}
+
+#ifndef USE_ASYNC_COMPLETION
+/* No request is ever made, so these are never called */
+int linenoiseCompletionPush(linenoiseCompletionRequest *req, const char *str)
+{
+    (void)req;
+    (void)str;
+    return 0;
+}
+
+void linenoiseCompletionDone(linenoiseCompletionRequest *req)
+{
+    (void)req;
+}
+#endif
+
+/**
+ * Completing with the same callback again for a longer line normally calls it
+ * again. If enabled, the completions of last time which begin with the line are
+ * shown instead, which is only right if all the completions begin with the line
+ * and the callback would never find any more for a longer line.
+ * Enabling it again forgets the completions of last time.
+ */
+void linenoiseCtxSetCompletionCache(linenoiseContext *ctx, int enable) {
+    ctx->completion_cache = enable;
+    ctx->completion_cached = 0;
+}
+
+void linenoiseSetCompletionCache(int enable) {
+    linenoiseCtxSetCompletionCache(default_ctx(), enable);
+}
+
+/* Whether tab shows each completion in turn, or completes as far as it can and lists them */
+void linenoiseCtxSetCompletionMode(linenoiseContext *ctx, int mode) {
+    ctx->completion_mode = mode;
+}
+
+void linenoiseSetCompletionMode(int mode) {
+    linenoiseCtxSetCompletionMode(default_ctx(), mode);
+}
+
+void linenoiseAddCompletion(linenoiseCompletions *lc, const char *str) {
+    struct linenoiseCompletionChunk *chunk = lc->chunks;
+    size_t len = strlen(str) + 1;
+
+    if (!completions_grow(lc, 1)) {
+        return;
+    }
+    if (chunk == NULL || chunk->size - chunk->used < len) {
+        size_t size = chunk ? chunk->size * 2 : COMPLETION_CHUNK_MIN;
+
+        while (size < len) {
+            size *= 2;
+        }
+        chunk = (struct linenoiseCompletionChunk *)mallocFn(sizeof(*chunk) + size);
+        if (chunk == NULL) {
+            return;
+        }
+        chunk->size = size;
+        chunk->used = 0;
+        chunk->next = lc->chunks;
+        lc->chunks = chunk;
+    }
+    lc->cvec[lc->len] = chunk->data + chunk->used;
+    memcpy(lc->cvec[lc->len++], str, len);
+    chunk->used += len;
+}
+
+#endif
+
+static void search_level_free(struct search_level *level)
+{
+    freeFn(level->seqs);
+    level->seqs = NULL;
+    level->len = 0;
+}
+
+/* Adds 'seq' to 'level' if that line contains 'query' */
+static void search_level_check(struct history *h, struct search_level *level, unsigned seq, const char *query)
+{
+    const char *line = history_line_seq(h, seq);
+
+    if (line && strstr(line, query)) {
+        level->seqs[level->len++] = seq;
+    }
+}
+
+/**
+ * Finds the lines which match 'query', the previous query plus one more char,
+ * whose matches are in 'prev'.
+ *
+ * Returns 0 if there are no matches, otherwise 1.
+ */
+static int search_narrow(struct history *h, struct search_level *level, const struct search_level *prev, const char *query)
+{
+    int qlen = strlen(query);
+    int i;
+
+    level->seqs = NULL;
+    level->len = 0;
+
+    if (prev->seqs) {
+        if (prev->len == 0) {
+            return 0;
+        }
+        level->seqs = (unsigned *)mallocFn(sizeof(*level->seqs) * prev->len);
+        if (level->seqs) {
+            for (i = 0; i < prev->len; i++) {
+                search_level_check(h, level, prev->seqs[i], query);
+            }
+            return level->len != 0;
+        }
+    }
+    else if (qlen >= 3 && h->len) {
+#ifndef NO_HISTORY_INDEX
+        /* Start from the rarest trigram in the query, once the index is complete */
+        if (history_index_ready(h)) {
+            struct trigram *best = NULL;
+
+            for (i = 0; i + 3 <= qlen; i++) {
+                struct trigram *t = trigram_find(h, TRIGRAM_KEY(query + i));
+                if (!t->key) {
+                    return 0;
+                }
+                if (best == NULL || t->len - t->start < best->len - best->start) {
+                    best = t;
+                }
+            }
+            level->seqs = (unsigned *)mallocFn(sizeof(*level->seqs) * (best->len - best->start + 1));
+            if (level->seqs) {
+                for (i = best->start; i < best->len; i++) {
+                    search_level_check(h, level, best->seqs[i], query);
+                }
+                return level->len != 0;
+            }
+        }
+#endif
+        level->seqs = (unsigned *)mallocFn(sizeof(*level->seqs) * h->len);
+        if (level->seqs) {
+            for (i = 0; i < h->len; i++) {
+                search_level_check(h, level, h->seq - h->len + i, query);
+            }
+            return level->len != 0;
+        }
+    }
+    /* A short query (or out of memory), so search_find() scans the history */
+    return 1;
+}
+
+/**
+ * Searches the history for a line matching 'query', starting at index 'searchpos'
+ * and moving in direction 'dir'. If 'skip' is not NULL, lines identical to it are ignored.
+ *
+ * Returns the index of the matching line, otherwise where the search stopped
+ * (-1 or history_len).
+ */
+static int search_find(struct history *h, const struct search_level *level, const char *query, int searchpos, int dir, const char *skip)
+{
+    if (level->seqs) {
+        unsigned first = h->seq - h->len;
+        int lo = 0;
+        int hi = level->len;
+
+        if (searchpos < 0 || searchpos >= h->len) {
+            return searchpos;
+        }
+
+        /* Find the first match after 'searchpos', or from it on going forwards */
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            unsigned pos = level->seqs[mid] - first;
+            if (dir < 0 ? pos <= (unsigned)searchpos : pos < (unsigned)searchpos) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        /* Step back onto 'searchpos' or the match before it */
+        if (dir < 0) {
+            lo--;
+        }
+        for (; lo >= 0 && lo < level->len; lo += dir) {
+            const char *line = history_line_seq(h, level->seqs[lo]);
+            if (line && !(skip && strcmp(line, skip) == 0)) {
+                return level->seqs[lo] - first;
+            }
+        }
+        return dir < 0 ? -1 : h->len;
+    }
+
+    for (; searchpos >= 0 && searchpos < h->len; searchpos += dir) {
+        const char *line = history_get(h, searchpos);
+        if (line && strstr(line, query) && !(skip && strcmp(line, skip) == 0)) {
+            break;
+        }
+    }
+    return searchpos;
+}
+
+/* Shows the reverse-i-search prompt with the query so far */
+static void searchRefresh(struct current *current)
+{
+    struct search *s = &current->search;
+
+    snprintf(s->rprompt, sizeof(s->rprompt), "(reverse-i-search)'%s': ", s->rbuf);
+    refreshLine(s->rprompt, current);
+}
+
+static void searchStart(struct current *current)
+{
+    struct history *h = &current->ctx->history;
+    struct search *s = &current->search;
+
+    history_sync(current->ctx);
+    s->rbuf[0] = 0;
+    s->rchars = 0;
+    s->rlen = 0;
+    s->searchpos = h->len - 1;
+    s->levels[0].seqs = NULL;
+    s->levels[0].len = 0;
+    current->mode = EDIT_SEARCH;
+    searchRefresh(current);
+}
+
+static void searchEnd(struct current *current)
+{
+    struct search *s = &current->search;
+
+    while (s->rchars) {
+        search_level_free(&s->levels[s->rchars--]);
+    }
+    current->mode = EDIT_NORMAL;
+}
+
+/**
+ * Handles a key typed during reverse-i-search.
+ *
+ * Returns the key to be handled as usual once the search has finished,
+ * or 0 if there is nothing more to do.
+ */
+static int searchChar(struct current *current, int c)
+{
+    struct history *h = &current->ctx->history;
+    struct search *s = &current->search;
+    int n = 0;
+    int skipsame = 0;
+    int searchdir = -1;
+    int found;
+    long long start;
+
+    if (c == ctrl('H') || c == 127) {
+        if (s->rchars) {
+            int p;
+            search_level_free(&s->levels[s->rchars]);
+            p = utf8_index(s->rbuf, --s->rchars);
+            s->rbuf[p] = 0;
+            s->rlen = strlen(s->rbuf);
+        }
+        searchRefresh(current);
+        return 0;
+    }
+    if (c == ctrl('P') || c == SPECIAL_UP) {
+        /* Search for the previous (earlier) match */
+        if (s->searchpos > 0) {
+            s->searchpos--;
+        }
+        skipsame = 1;
+    }
+    else if (c == ctrl('N') || c == SPECIAL_DOWN) {
+        /* Search for the next (later) match */
+        if (s->searchpos < h->len) {
+            s->searchpos++;
+        }
+        searchdir = 1;
+        skipsame = 1;
+    }
+    else if (c >= ' ') {
+        if (s->rlen + 4 > (int)sizeof(s->rbuf)) {
+            return 0;
+        }
+
+        n = utf8_getchars(s->rbuf + s->rlen, c);
+        s->rlen += n;
+        s->rchars++;
+        s->rbuf[s->rlen] = 0;
+    }
+    else {
+        /* Exit from incremental search mode */
+        searchEnd(current);
+        if (c == ctrl('G') || c == ctrl('C')) {
+            /* ctrl-g terminates the search with no effect */
+            set_current(current, "");
+            c = 0;
+        }
+        else if (c == ctrl('J')) {
+            /* ctrl-j terminates the search leaving the buffer in place */
+            c = 0;
+        }
+        /* Go process the char normally */
+        refreshLine(current->prompt, current);
+        return c;
+    }
+
+    /* Now search through the history for a match */
+    start = stats_start(current->ctx);
+#ifndef NO_HISTORY_INDEX
+    /* Keeps building the index even if keys never stop coming */
+    history_index_step(h);
+#endif
+    if (n) {
+        /* Adding a new char resets the search location */
+        found = -1;
+        if (search_narrow(h, &s->levels[s->rchars], &s->levels[s->rchars - 1], s->rbuf)) {
+            found = search_find(h, &s->levels[s->rchars], s->rbuf, h->len - 1, -1, NULL);
+        }
+    }
+    else {
+        found = s->searchpos = search_find(h, &s->levels[s->rchars], s->rbuf, s->searchpos, searchdir, skipsame ? current->buf : NULL);
+    }
+    stats_time(current->ctx, &current->ctx->stats.searches, &current->ctx->stats.search_us, start);
+    if (found >= 0 && found < h->len) {
+        s->searchpos = found;
+    }
+    else {
+        found = -1;
+    }
+    if (found >= 0) {
+        /* Copy the matching line and set the cursor position */
+        const char *line = history_get(h, s->searchpos);
+        const char *p = strstr(line, s->rbuf);
+
+        set_current(current, line);
+        current->pos = char_at_offset(current, p - line);
+    }
+    else if (n) {
+        /* No match, so don't add it */
+        search_level_free(&s->levels[s->rchars]);
+        s->rchars--;
+        s->rlen -= n;
+        s->rbuf[s->rlen] = 0;
+    }
+    searchRefresh(current);
+    return 0;
+}
+
+/* Redraws the line, or the search in progress */
+static void refreshEdit(struct current *current)
+{
+    if (current->mode == EDIT_SEARCH) {
+        searchRefresh(current);
+    }
+    else {
+        refreshLine(current->prompt, current);
+    }
+}
+
+/* Prepares 'current' for editing a new line, once the terminal is in raw mode */
+static void initCurrent(struct current *current, const char *prompt)
+{
+    struct spare *spare = &current->ctx->spare;
+
+    if (spare->buf) {
+        current->buf = spare->buf;
+        current->bufmax = spare->bufmax;
+        current->layout = spare->layout;
+        current->buf[0] = 0;
+        spare->buf = NULL;
+        spare->layout = NULL;
+    }
+    else {
+        current->buf = current->inbuf;
+        current->bufmax = sizeof(current->inbuf);
+        current->layout = current->inlayout;
+    }
+    current->len = 0;
+    current->chars = 0;
+    current->pos = 0;
+    current->prompt = prompt;
+    /* The buffers left from the last line, if any */
+    current->outbuf = spare->outbuf;
+    current->outlen = 0;
+    current->outmax = spare->outmax;
+    current->cells = spare->cells;
+    current->shown = spare->shown;
+    current->cells_max = spare->cells_max;
+    current->texts = spare->texts;
+    current->version = 1;
+    current->attrs = spare->attrs;
+    current->attrs_max = spare->attrs_max;
+    current->attrs_version = 0;
+    spare->outbuf = NULL;
+    spare->cells = spare->shown = NULL;
+    spare->texts = NULL;
+    spare->attrs = NULL;
+    current->hint = NULL;
+    current->hint_version = 0;
+    screen_lost(current);
+    current->mode = EDIT_NORMAL;
+    current->history_index = 0;
+    current->saved = NULL;
+#ifdef USE_ASYNC_COMPLETION
+    current->request = NULL;
+#endif
+}
+
+/* Shows the empty line, ready for editChar() */
+static void editStart(struct current *current)
+{
+    current->mode = EDIT_NORMAL;
+    current->history_index = 0;
+    history_sync(current->ctx);
+    set_current(current, "");
+    screen_lost(current);
+    refreshLine(current->prompt, current);
+}
+
+/* Abandons any completion or search in progress */
+static void editEnd(struct current *current)
+{
+#ifndef NO_COMPLETION
+    if (current->mode == EDIT_COMPLETE) {
+        completeEnd(current);
+    }
+#endif
+    if (current->mode == EDIT_SEARCH) {
+        searchEnd(current);
+    }
+    current->mode = EDIT_NORMAL;
+}
+
+/* Returns the position of the start of the word on the left of the cursor, after any spaces */
+static int word_left(struct current *current)
+{
+    int pos = current->pos;
+
+    /* eat any spaces on the left */
+    while (pos > 0 && get_char(current, pos - 1) == ' ') {
+        pos--;
+    }
+
+    /* now eat any non-spaces on the left */
+    while (pos > 0 && get_char(current, pos - 1) != ' ') {
+        pos--;
+    }
+    return pos;
+}
+
+/* Returns the position of the end of the word on the right of the cursor, after any spaces */
+static int word_right(struct current *current)
+{
+    int pos = current->pos;
+
+    while (pos < current->chars && get_char(current, pos) == ' ') {
+        pos++;
+    }
+    while (pos < current->chars && get_char(current, pos) != ' ') {
+        pos++;
+    }
+    return pos;
+}
+
+/**
+ * Handles a char read from the terminal, or -1 if the read failed.
+ *
+ * Returns EDIT_MORE while the line is still being edited. Once it is finished,
+ * returns the length of the line, or -1 on ctrl-C (errno is EAGAIN) or ctrl-D.
+ */
+static int editChar(struct current *current, int c)
+{
+    linenoiseContext *ctx = current->ctx;
+    struct history *h = &ctx->history;
+    struct key_binding *binding;
+    int dir = -1;
+
+#ifdef USE_TERMIOS
+    if (c == SPECIAL_WAKE) {
+        if (!ctx->cols || ctx->winch_seen != (unsigned)winch_count) {
+            /* The window changed size */
+            refreshEdit(current);
+        }
+#ifdef USE_ASYNC_COMPLETION
+        if (current->mode == EDIT_COMPLETE) {
+            completeWake(current);
+        }
+#endif
+        return EDIT_MORE;
+    }
+#endif
+    if (current->mode == EDIT_QUOTE) {
+        /* Remove the ^V first */
+        current->mode = EDIT_NORMAL;
+        remove_char(current, current->pos - 1);
+        if (c != -1) {
+            /* Insert the actual char. Can insert anything except \0 */
+            insert_char(current, current->pos, c);
+            refreshLine(current->prompt, current);
+            return EDIT_MORE;
+        }
+    }
+
+#ifndef NO_COMPLETION
+    if (current->mode == EDIT_COMPLETE) {
+        c = completeChar(current, c);
+    }
+#endif
+
+#ifdef USE_TERMIOS
+    if (c == 27) {   /* escape sequence */
+        c = check_special(current);
+    }
+#endif
+
+    if (current->mode == EDIT_SEARCH) {
+        c = searchChar(current, c);
+    }
+
+    /* Nothing more to do when 0 */
+    if (c == 0) {
+        return EDIT_MORE;
+    }
+    if (c == -1) {
+        set_current(current, "");
+        return 0;
+    }
+#ifdef USE_TERMIOS
+    if (c == SPECIAL_PASTE) {
+        /* Insert the whole paste at once and refresh just once */
+        int len;
+        char *paste = read_paste(current, &len);
+        if (paste) {
+            insert_chars(current, current->pos, paste, len);
+            freeFn(paste);
+        }
+        refreshLine(current->prompt, current);
+        return EDIT_MORE;
+    }
+#endif
+
+    binding = key_binding(ctx, c, 0);
+    if (binding && (binding->fn || binding->charfn)) {
+        int rcode;
+
+        if (binding->fn) {
+            rcode = binding->fn(current->buf, current->len, c, binding->userdata);
+        }
+        else {
+            /* Only a return of 1 leaves the char out of the line */
+            rcode = binding->charfn(current->buf, current->len, c) == 1 ? LINENOISE_KEY_HANDLED : 0;
+        }
+        if (!(rcode & LINENOISE_KEY_UNCHANGED)) {
+            /* The callback may have written anything */
+            screen_lost(current);
+            refreshLine(current->prompt, current);
+        }
+        if (rcode & LINENOISE_KEY_HANDLED) {
+            return EDIT_MORE;
+        }
+    }
+
+    switch (key_action(ctx, c)) {
+    case LINENOISE_ACTION_ENTER:
+        if (current->hint) {
+            /* Leave the line as it was typed */
+            hint_free(current);
+            current->hint_version = current->version;
+            refreshLine(current->prompt, current);
+        }
+        return current->len;
+    case LINENOISE_ACTION_INTERRUPT:
+        errno = EAGAIN;
+        return -1;
+    case LINENOISE_ACTION_BACKSPACE:
+        if (remove_char(current, current->pos - 1) == 1) {
+            refreshLine(current->prompt, current);
+        }
+        break;
+    case LINENOISE_ACTION_EOF:
+        if (current->len == 0) {
+            /* Empty line, so EOF */
+            return -1;
+        }
+        /* Otherwise fall through to delete char to right of cursor */
+    case LINENOISE_ACTION_DELETE:
+        if (remove_char(current, current->pos) == 1) {
+            refreshLine(current->prompt, current);
+        }
+        break;
+    case LINENOISE_ACTION_DELETE_WORD_LEFT:
+        {
+            int pos = word_left(current);
+
+            if (remove_chars(current, pos, current->pos - pos)) {
+                refreshLine(current->prompt, current);
+            }
+        }
+        break;
+    case LINENOISE_ACTION_DELETE_WORD_RIGHT:
+        if (remove_chars(current, current->pos, word_right(current) - current->pos)) {
+            refreshLine(current->prompt, current);
+        }
+        break;
+    case LINENOISE_ACTION_SEARCH:
+        /* Display the reverse-i-search prompt and process chars */
+        searchStart(current);
+        break;
+    case LINENOISE_ACTION_TRANSPOSE:
+        if (current->pos > 0 && current->pos < current->chars) {
+            c = get_char(current, current->pos);
+            remove_char(current, current->pos);
+            insert_char(current, current->pos - 1, c);
+            refreshLine(current->prompt, current);
+        }
+        break;
+    case LINENOISE_ACTION_QUOTE:
+        if (has_room(current, 3)) {
+            /* Insert the ^V first, then wait for the next char */
+            if (insert_char(current, current->pos, ctrl('V'))) {
+                refreshLine(current->prompt, current);
+                current->mode = EDIT_QUOTE;
+            }
+        }
+        break;
+    case LINENOISE_ACTION_LEFT:
+        if (current->pos > 0) {
+            current->pos--;
+            refreshLine(current->prompt, current);
+        }
+        break;
+    case LINENOISE_ACTION_RIGHT:
+        if (current->pos < current->chars) {
+            current->pos++;
+            refreshLine(current->prompt, current);
+        }
+        break;
+    case LINENOISE_ACTION_WORD_LEFT:
+        current->pos = word_left(current);
+        refreshLine(current->prompt, current);
+        break;
+    case LINENOISE_ACTION_WORD_RIGHT:
+        current->pos = word_right(current);
+        refreshLine(current->prompt, current);
+        break;
+    case LINENOISE_ACTION_HISTORY_PREV:
+        dir = 1;
+    case LINENOISE_ACTION_HISTORY_NEXT:
+        if (current->history_index) {
+            /* Stay on the same entry when other sessions have added lines */
+            current->history_index += history_sync(ctx);
+        }
+        else {
+            history_sync(ctx);
+        }
+        if (h->len > 0) {
+            const char *line;
+            int index;
+
+            if (current->history_index == 0) {
+                /* Keep the line being edited to come back to */
+                freeFn(current->saved);
+                current->saved = ln_strdup(current->buf);
+            }
+
+            /* Show the new entry, skipping erased ones */
+            index = current->history_index;
+            do {
+                index += dir;
+                line = index > 0 && index <= h->len ? history_get(h, h->len - index) : "";
+            } while (line == NULL);
+            if (index < 0) {
+                current->history_index = 0;
+                break;
+            } else if (index > h->len) {
+                if (current->history_index > h->len) {
+                    current->history_index = h->len;
+                }
+                break;
+            }
+            current->history_index = index;
+
+            if (current->history_index == 0) {
+                set_current(current, current->saved ? current->saved : "");
+            }
+            else {
+                if (!ctx->historyCallback) {
+                    set_current(current, line);
+                } else {
+                    long long start = stats_start(ctx);
+
+                    line = ctx->historyCallback(line);
+                    stats_time(ctx, &ctx->stats.history_calls, &ctx->stats.history_us, start);
+                    set_current(current, line);
+                }
+            }
+            refreshLine(current->prompt, current);
+        }
+        break;
+    case LINENOISE_ACTION_HOME:
+        current->pos = 0;
+        refreshLine(current->prompt, current);
+        break;
+    case LINENOISE_ACTION_END:
+        current->pos = current->chars;
+        refreshLine(current->prompt, current);
+        break;
+    case LINENOISE_ACTION_DELETE_TO_START:
+        if (remove_chars(current, 0, current->pos)) {
+            refreshLine(current->prompt, current);
+        }
+        break;
+    case LINENOISE_ACTION_DELETE_TO_END:
+        if (remove_chars(current, current->pos, current->chars - current->pos)) {
+            refreshLine(current->prompt, current);
+        }
+        break;
+    case LINENOISE_ACTION_CLEAR_SCREEN:
+        clearScreen(current);
+        /* Force recalc of window size for serial terminals */
+        current->cols = 0;
+        ctx->cols = 0;
+        screen_lost(current);
+        refreshLine(current->prompt, current);
+        break;
+    case LINENOISE_ACTION_COMPLETE:
+#ifndef NO_COMPLETION
+        if (ctx->completionCallback != NULL
+#ifdef USE_ASYNC_COMPLETION
+                || ctx->asyncCompletionCallback != NULL
+#endif
+                ) {
+            completeLine(current);
+            break;
+        }
+#endif
+        /* Only autocomplete when the callback is set, otherwise insert it */
+        if (c > 0 && insert_char(current, current->pos, c) == 1) {
+            refreshLine(current->prompt, current);
+        }
+        break;
+    case LINENOISE_ACTION_INSERT:
+        if (c > 0 && insert_char(current, current->pos, c) == 1) {
+            refreshLine(current->prompt, current);
+        }
+        break;
+    }
+    return EDIT_MORE;
+}
+
+/* Handles 'c' with editChar(), counting for the stats how long it took to show */
+static int editKey(struct current *current, int c)
+{
+    linenoiseContext *ctx = current->ctx;
+    int count = editChar(current, c);
+
+    if (ctx->stats_enabled && c != -1 && c != SPECIAL_WAKE && ctx->input_time) {
+        linenoiseStats *stats = &ctx->stats;
+        long long us = stats_now() - ctx->input_time;
+
+        stats->keys++;
+        stats->key_us += us;
+        if (us > (long long)stats->key_max_us) {
+            stats->key_max_us = us;
+        }
+        stats_histogram(stats->key_latency, us);
+    }
+    return count;
+}
+
+static int linenoisePrompt(struct current *current) {
+    int count;
+
+    editStart(current);
+    while ((count = editKey(current, fd_read(current))) == EDIT_MORE) {
+    }
+    return count;
+}
+
+/**
+ * Returns the edited line as an allocated string, or NULL if 'count' is -1,
+ * and leaves 'current' with an empty line.
+ */
+static char *takeLine(struct current *current, int count)
+{
+    struct spare *spare = &current->ctx->spare;
+    char *line = NULL;
+
+    if (current->buf == current->inbuf) {
+        if (count != -1) {
+            line = ln_strdup(current->buf);
+        }
+    }
+    else if (count == -1 && spare->buf == NULL) {
+        /* Not wanted, so the next line can have the allocated buffer */
+        spare->buf = current->buf;
+        spare->layout = current->layout;
+        spare->bufmax = current->bufmax;
+    }
+    else {
+        /* The line outgrew the inline buffer, so hand over the allocated one */
+        freeFn(current->layout);
+        line = current->buf;
+        if (count == -1) {
+            freeFn(line);
+            line = NULL;
+        }
+    }
+    current->buf = current->inbuf;
+    current->bufmax = sizeof(current->inbuf);
+    current->layout = current->inlayout;
+    current->len = 0;
+    current->chars = 0;
+    current->pos = 0;
+    current->buf[0] = 0;
+    buffer_changed(current);
+    freeFn(current->saved);
+    current->saved = NULL;
+    return line;
+}
+
+/* Moves to a new line once editing has finished and the terminal is restored */
+static void newLine(struct current *current)
+{
+#ifdef USE_TERMIOS
+    if (current->ctx != &default_context) {
+        IGNORE_RC(write(current->outfd, "\n", 1));
+        return;
+    }
+#endif
+    printf("\n");
+}
+
+/**
+ * Returns the next line of the input, which isn't a terminal, without its
+ * newline, and sets '*len' to its length. The standard input is read with
+ * stdio, so nothing is read past the line. The line is null terminated where
+ * it is in the buffer, and stays there until the next call. However long it
+ * is, it is returned whole.
+ *
+ * Returns NULL at the end of the input, or if out of memory.
+ */
+static char *stream_line(linenoiseContext *ctx, size_t *len)
+{
+    struct stream *s = &ctx->stream;
+
+    while (1) {
+        char *line = s->buf + s->pos;
+        char *eol = NULL;
+        size_t room;
+        int n;
+
+        if (s->pos + s->scanned < s->len) {
+            eol = (char *)memchr(line + s->scanned, '\n', s->len - s->pos - s->scanned);
+        }
+        if (eol || (s->eof && s->pos < s->len)) {
+            if (eol) {
+                s->pos = eol + 1 - s->buf;
+            }
+            else {
+                /* The last line, with no newline. There is always room after it */
+                eol = s->buf + s->len;
+                s->pos = s->len;
+            }
+            *eol = 0;
+            *len = eol - line;
+            s->scanned = 0;
+            return line;
+        }
+        if (s->eof) {
+            return NULL;
+        }
+        s->scanned = s->len - s->pos;
+
+        /* Move what there is of the line to the start, and make room for more after it */
+        if (s->pos) {
+            memmove(s->buf, s->buf + s->pos, s->len - s->pos);
+            s->len -= s->pos;
+            s->pos = 0;
+        }
+        if (s->max - s->len <= LINENOISE_STREAM_CHUNK) {
+            size_t max = s->max ? s->max : LINENOISE_STREAM_CHUNK;
+            char *buf;
+
+            while (max - s->len <= LINENOISE_STREAM_CHUNK) {
+                max *= 2;
+            }
+            buf = (char *)reallocFn(s->buf, max);
+            if (buf == NULL) {
+                return NULL;
+            }
+            s->buf = buf;
+            s->max = max;
+        }
+        room = s->max - s->len - 1;
+        if (room > 1 << 30) {
+            room = 1 << 30;
+        }
+
+        /* Show the prompt before waiting */
+        fflush(stdout);
+#ifdef USE_TERMIOS
+        if (ctx->infd != STDIN_FILENO) {
+            n = read(ctx->infd, s->buf + s->len, room);
+        }
+        else
+#endif
+        /* Through stdio, a line at a time, so that the program can read
+         * stdin with stdio as well and still see the input in order */
+        if (fgets(s->buf + s->len, (int)room + 1, stdin)) {
+            n = strlen(s->buf + s->len);
+        }
+        else {
+            n = ferror(stdin) ? -1 : 0;
+            clearerr(stdin);
+        }
+        if (n > 0) {
+            s->len += n;
+        }
+        else if (n == 0 || errno != EINTR) {
+            s->eof = 1;
+        }
+    }
+}
+
+/* The prompt and the next line of input which isn't a terminal, as stream_line() returns it */
+static char *stream_read(linenoiseContext *ctx, const char *prompt, size_t *len)
+{
+    /* Flushed only when there's a wait for more input, rather than for every line */
+    fputs(prompt, stdout);
+    return stream_line(ctx, len);
+}
+
+/**
+ * Edits a line on the terminal, once in raw mode, and returns its length,
+ * or -1 as linenoisePrompt() does. The line is left in 'current' for takeLine().
+ */
+static int readLine(struct current *current, const char *prompt)
+{
+    int count;
+
+    initCurrent(current, prompt);
+    count = linenoisePrompt(current);
+    screen_below(current);
+    outputFlush(current);
+    outputFree(current);
+    disableRawMode(current);
+    newLine(current);
+    return count;
+}
+
+/* Sets 'lb' to the 'len' bytes at 'str'. Returns -1 if out of memory */
+static int buf_set(linenoiseBuf *lb, const char *str, size_t len)
+{
+    if (len >= lb->max) {
+        size_t max = lb->max ? lb->max : 64;
+        char *buf;
+
+        while (len >= max) {
+            max *= 2;
+        }
+        buf = (char *)reallocFn(lb->buf, max);
+        if (buf == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        lb->buf = buf;
+        lb->max = max;
+    }
+    memcpy(lb->buf, str, len);
+    lb->buf[len] = 0;
+    lb->len = len;
+    return 0;
+}
+
+char *linenoiseCtxRead(linenoiseContext *ctx, const char *prompt)
+{
+    struct current current;
+    char *line;
+    size_t len;
+
+    current.ctx = ctx;
+    if (enableRawMode(&current) == 0) {
+        return takeLine(&current, readLine(&current, prompt));
+    }
+    if (ctx != &default_context) {
+        /* Only the default context falls back to the standard input */
+        return NULL;
+    }
+    line = stream_read(ctx, prompt, &len);
+    if (line) {
+        char *copy = (char *)mallocFn(len + 1);
+
+        if (copy) {
+            memcpy(copy, line, len + 1);
+        }
+        return copy;
+    }
+    return NULL;
+}
+
+const char *linenoiseCtxReadView(linenoiseContext *ctx, const char *prompt, size_t *len)
+{
+    struct current current;
+
+    freeFn(ctx->view);
+    ctx->view = NULL;
+    current.ctx = ctx;
+    if (enableRawMode(&current) == 0) {
+        ctx->view = takeLine(&current, readLine(&current, prompt));
+        if (ctx->view) {
+            *len = strlen(ctx->view);
+        }
+        return ctx->view;
+    }
+    if (ctx != &default_context) {
+        return NULL;
+    }
+    return stream_read(ctx, prompt, len);
+}
+
+const char *linenoiseReadView(const char *prompt, size_t *len)
+{
+    return linenoiseCtxReadView(default_ctx(), prompt, len);
+}
+
+int linenoiseCtxReadInto(linenoiseContext *ctx, const char *prompt, linenoiseBuf *lb)
+{
+    struct current current;
+    const char *line;
+    size_t len;
+
+    current.ctx = ctx;
+    if (enableRawMode(&current) == 0) {
+        int count = readLine(&current, prompt);
+        int rc = count == -1 ? -1 : buf_set(lb, current.buf, current.len);
+        int err = errno;
+
+        /* Keeps any allocated buffer for the next line */
+        takeLine(&current, -1);
+        errno = err;
+        return rc;
+    }
+    if (ctx != &default_context) {
+        return -1;
+    }
+    line = stream_read(ctx, prompt, &len);
+    return line ? buf_set(lb, line, len) : -1;
+}
+
+int linenoiseReadInto(const char *prompt, linenoiseBuf *lb)
+{
+    return linenoiseCtxReadInto(default_ctx(), prompt, lb);
+}
+
+void linenoiseBufFree(linenoiseBuf *lb)
+{
+    freeFn(lb->buf);
+    lb->buf = NULL;
+    lb->len = lb->max = 0;
+}
+
+char *linenoise(const char *prompt)
+{
+    return linenoiseCtxRead(default_ctx(), prompt);
+}
+
+static char edit_more[] = "linenoiseEditMore";
+char *linenoiseEditMore = edit_more;
+
+int linenoiseCtxEditStart(linenoiseContext *ctx, const char *prompt)
+{
+    struct current *current = &ctx->edit;
+
+    if (ctx->edit_state != EDIT_IDLE) {
+        errno = EBUSY;
+        return -1;
+    }
+    current->ctx = ctx;
+    if (enableRawMode(current) == -1) {
+        return -1;
+    }
+    initCurrent(current, prompt);
+    editStart(current);
+    ctx->edit_state = EDIT_ACTIVE;
+#ifdef USE_TERMIOS
+    return current->fd;
+#else
+    return 0;
+#endif
+}
+
+int linenoiseCtxEditPending(linenoiseContext *ctx)
+{
+#ifdef USE_TERMIOS
+    return ctx->edit_state == EDIT_ACTIVE && ctx->inputpos < ctx->inputlen;
+#else
+    (void)ctx;
+    return 0;
+#endif
+}
+
+char *linenoiseCtxEditFeed(linenoiseContext *ctx)
+{
+    int count;
+
+    if (ctx->edit_state != EDIT_ACTIVE) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* Handle everything already read, but don't wait for any more */
+    do {
+        count = editKey(&ctx->edit, fd_read(&ctx->edit));
+    } while (count == EDIT_MORE && linenoiseCtxEditPending(ctx));
+    if (count == EDIT_MORE) {
+        return linenoiseEditMore;
+    }
+
+    ctx->edit_state = EDIT_DONE;
+    return takeLine(&ctx->edit, count);
+}
+
+void linenoiseCtxEditStop(linenoiseContext *ctx)
+{
+    struct current *current = &ctx->edit;
+
+    if (ctx->edit_state == EDIT_IDLE) {
+        return;
+    }
+    editEnd(current);
+    takeLine(current, -1);
+    screen_below(current);
+    outputFlush(current);
+    outputFree(current);
+    disableRawMode(current);
+    newLine(current);
+    ctx->edit_state = EDIT_IDLE;
+}
+
+void linenoiseCtxHide(linenoiseContext *ctx)
+{
+    struct current *current = &ctx->edit;
+
+    if (ctx->edit_state == EDIT_ACTIVE) {
+        screen_clear(current);
+        outputFlush(current);
+        disableRawMode(current);
+    }
+}
+
+void linenoiseCtxShow(linenoiseContext *ctx)
+{
+    if (ctx->edit_state == EDIT_ACTIVE && enableRawMode(&ctx->edit) == 0) {
+        refreshEdit(&ctx->edit);
+    }
+}
+
+int linenoiseEditStart(const char *prompt)
+{
+    return linenoiseCtxEditStart(default_ctx(), prompt);
+}
+
+int linenoiseEditPending(void)
+{
+    return linenoiseCtxEditPending(default_ctx());
+}
+
+char *linenoiseEditFeed(void)
+{
+    return linenoiseCtxEditFeed(default_ctx());
+}
+
+void linenoiseEditStop(void)
+{
+    linenoiseCtxEditStop(default_ctx());
+}
+
+void linenoiseHide(void)
+{
+    linenoiseCtxHide(default_ctx());
+}
+
+void linenoiseShow(void)
+{
+    linenoiseCtxShow(default_ctx());
+}
+
+linenoiseContext *linenoiseCtxDefault(void)
+{
+    return default_ctx();
+}
+
+/**
+ * Creates a context for the terminal on 'infd' and 'outfd', which may be the same.
+ * (On Windows the fds are ignored and the console is used.)
+ *
+ * Returns NULL if out of memory.
+ */
+linenoiseContext *linenoiseCtxCreate(int infd, int outfd)
+{
+    linenoiseContext *ctx = (linenoiseContext *)mallocFn(sizeof(*ctx));
+
+    if (ctx) {
+        ctx_init(ctx);
+#ifdef USE_TERMIOS
+        ctx->infd = infd;
+        ctx->outfd = outfd;
+#else
+        (void)infd;
+        (void)outfd;
+#endif
+    }
+    return ctx;
+}
+
+/* Restores the terminal if need be and frees the context and its history */
+void linenoiseCtxFree(linenoiseContext *ctx)
+{
+    if (ctx == NULL || ctx == &default_context) {
+        return;
+    }
+    linenoiseCtxEditStop(ctx);
+#ifdef USE_TERMIOS
+    ctx_restore(ctx);
+    ctx_wake_close(ctx);
+#endif
+#ifndef NO_COMPLETION
+    completion_free(ctx);
+#endif
+    history_free(&ctx->history);
+    freeFn(ctx->keys_extra);
+    freeFn(ctx->stream.buf);
+    freeFn(ctx->view);
+    spare_free(&ctx->spare);
+    freeFn(ctx);
+}
+
+void linenoiseFree(void *ptr)
+{
+    freeFn(ptr);
+}
+
+/* Must be called before anything is allocated. NULL restores the default. */
+void linenoiseSetAllocator(void *(*malloc_fn)(size_t), void *(*realloc_fn)(void *, size_t), void (*free_fn)(void *))
+{
+    mallocFn = malloc_fn ? malloc_fn : malloc;
+    reallocFn = realloc_fn ? realloc_fn : realloc;
+    freeFn = free_fn ? free_fn : free;
+}
+
+/* Register a callback function to be called when a character is pressed */
+void linenoiseCtxSetCharacterCallback(linenoiseContext *ctx, linenoiseCharacterCallback *fn, char c) {
+    struct key_binding *b;
+
+    if (c < ' ') return;
+
+    b = key_binding(ctx, c, 0);
+    b->fn = NULL;
+    b->charfn = fn;
+}
+
+void linenoiseSetCharacterCallback(linenoiseCharacterCallback *fn, char c) {
+    linenoiseCtxSetCharacterCallback(default_ctx(), fn, c);
+}
+
+/* Keys are chars up to the last unicode one, or special keys down to KEYMAP_FIRST */
+static int key_valid(int key)
+{
+    return key != 0 && key >= KEYMAP_FIRST && key <= 0x10ffff;
+}
+
+/**
+ * Binds 'key' to do one of LINENOISE_ACTION_*, where LINENOISE_ACTION_DEFAULT
+ * is whatever it did to begin with.
+ *
+ * Returns -1 if the key or action isn't valid, or on running out of memory.
+ */
+int linenoiseCtxBindKey(linenoiseContext *ctx, int key, int action)
+{
+    struct key_binding *b;
+
+    if (!key_valid(key) || action < 0 || action >= LINENOISE_ACTION_COUNT) {
+        return -1;
+    }
+    b = key_binding(ctx, key, 1);
+    if (b == NULL) {
+        return -1;
+    }
+    b->action = action == LINENOISE_ACTION_DEFAULT ? key_default(key) : action;
+    return 0;
+}
+
+int linenoiseBindKey(int key, int action)
+{
+    return linenoiseCtxBindKey(default_ctx(), key, action);
+}
+
+/**
+ * Calls 'fn' whenever 'key' is pressed, before doing its action, or stops if 'fn' is NULL.
+ * 'fn' returns LINENOISE_KEY_HANDLED if the action is not to be done, and
+ * LINENOISE_KEY_UNCHANGED if it wrote nothing, so the line needn't be drawn again.
+ *
+ * Returns -1 if the key isn't valid, or on running out of memory.
+ */
+int linenoiseCtxBindKeyCallback(linenoiseContext *ctx, int key, linenoiseKeyCallback *fn, void *userdata)
+{
+    struct key_binding *b;
+
+    if (!key_valid(key)) {
+        return -1;
+    }
+    b = key_binding(ctx, key, 1);
+    if (b == NULL) {
+        return -1;
+    }
+    b->fn = fn;
+    b->userdata = userdata;
+    b->charfn = NULL;
+    return 0;
+}
+
+int linenoiseBindKeyCallback(int key, linenoiseKeyCallback *fn, void *userdata)
+{
+    return linenoiseCtxBindKeyCallback(default_ctx(), key, fn, userdata);
+}
+
+int linenoiseCtxHistoryAdd(linenoiseContext *ctx, const char *line) {
+    struct history *h = &ctx->history;
+
+    if (ctx->shared) {
+        int ret = shared_add(ctx->shared, line, ctx->id);
+
+        history_sync(ctx);
+        return ret;
+    }
+
+    /* do not insert duplicate lines into history */
+    if (h->len > 0 && strcmp(line, history_get(h, h->len - 1)) == 0) {
+        return 0;
+    }
+    return history_add(h, line, time(NULL));
+}
+
+int linenoiseHistoryAdd(const char *line) {
+    return linenoiseCtxHistoryAdd(default_ctx(), line);
+}
+
+int linenoiseCtxHistorySetMaxLen(linenoiseContext *ctx, int len) {
+    struct history *h = &ctx->history;
+    char **newHistory;
+    time_t *newTimes;
+
+    if (len < 1) return 0;
+    if (h->lines) {
+        int tocopy = h->len;
+        int j;
+
+        newHistory = (char **)mallocFn(sizeof(char*)*len);
+        newTimes = (time_t *)mallocFn(sizeof(time_t)*len);
+        if (newHistory == NULL || newTimes == NULL) {
+            freeFn(newHistory);
+            freeFn(newTimes);
+            return 0;
+        }
+        if (len < tocopy) tocopy = len;
+
+        /* Drop the oldest entries which no longer fit */
+        for (j = 0; j < h->len - tocopy; j++) {
+            history_slot_free(h, history_slot(h, j));
+        }
+        for (j = 0; j < tocopy; j++) {
+            char **slot = history_slot(h, h->len - tocopy + j);
+
+            newHistory[j] = *slot;
+            newTimes[j] = h->times[slot - h->lines];
+        }
+        freeFn(h->lines);
+        freeFn(h->times);
+        h->lines = newHistory;
+        h->times = newTimes;
+        h->len = tocopy;
+        h->head = 0;
+#ifndef NO_HISTORY_ARENA
+        history_compact(h);
 #endif
-                    if (c == ctrl('P') || c == SPECIAL_UP) {
-                        /* Search for the previous (earlier) match */
-                        if (searchpos > 0) {
-                            searchpos--;
-                        }
-                        skipsame = 1;
-                    }
-                    else if (c == ctrl('N') || c == SPECIAL_DOWN) {
-                        /* Search for the next (later) match */
-                        if (searchpos < history_len) {
-                            searchpos++;
-                        }
-                        searchdir = 1;
-                        skipsame = 1;
-                    }
-                    else if (c >= ' ') {
-                        if (rlen >= (int)sizeof(rbuf) + 3) {
-                            continue;
-                        }
-
-                        n = utf8_getchars(rbuf + rlen, c);
-                        rlen += n;
-                        rchars++;
-                        rbuf[rlen] = 0;
-
-                        /* Adding a new char resets the search location */
-                        searchpos = history_len - 1;
-                    }
-                    else {
-                        /* Exit from incremental search mode */
-                        break;
-                    }
+    }
+    h->max_len = len;
+    /* The table of distinct lines is rebuilt with a size to match */
+    freeFn(h->dups);
+    h->dups = NULL;
+    h->dups_size = 0;
+    return 1;
+}
 
-                    /* Now search through the history for a match */
-                    for (; searchpos >= 0 && searchpos < history_len; searchpos += searchdir) {
-                        p = strstr(history[searchpos], rbuf);
-                        if (p) {
-                            /* Found a match */
-                            if (skipsame && strcmp(history[searchpos], current->buf) == 0) {
-                                /* But it is identical, so skip it */
-                                continue;
-                            }
-                            /* Copy the matching line and set the cursor position */
-                            set_current(current,history[searchpos]);
-                            current->pos = utf8_strlen(history[searchpos], p - history[searchpos]);
-                            break;
-                        }
-                    }
-                    if (!p && n) {
-                        /* No match, so don't add it */
-                        rchars--;
-                        rlen -= n;
-                        rbuf[rlen] = 0;
-                    }
-                }
-                if (c == ctrl('G') || c == ctrl('C')) {
-                    /* ctrl-g terminates the search with no effect */
-                    set_current(current, "");
-                    c = 0;
-                }
-                else if (c == ctrl('J')) {
-                    /* ctrl-j terminates the search leaving the buffer in place */
-                    c = 0;
-                }
-                /* Go process the char normally */
-                refreshLine(current->prompt, current);
-                goto process_char;
-            }
-            break;
-        case ctrl('T'):    /* ctrl-t */
-            if (current->pos > 0 && current->pos < current->chars) {
-                c = get_char(current, current->pos);
-                remove_char(current, current->pos);
-                insert_char(current, current->pos - 1, c);
-                refreshLine(current->prompt, current);
-            }
-            break;
-        case ctrl('V'):    /* ctrl-v */
-            if (has_room(current, 3)) {
-                /* Insert the ^V first */
-                if (insert_char(current, current->pos, c)) {
-                    refreshLine(current->prompt, current);
-                    /* Now wait for the next char. Can insert anything except \0 */
-                    c = fd_read(current);
-
-                    /* Remove the ^V first */
-                    remove_char(current, current->pos - 1);
-                    if (c != -1) {
-                        /* Insert the actual char */
-                        insert_char(current, current->pos, c);
-                    }
-                    refreshLine(current->prompt, current);
-                }
-            }
-            break;
-        case ctrl('B'):
-        case SPECIAL_LEFT:
-            if (current->pos > 0) {
-                current->pos--;
-                refreshLine(current->prompt, current);
-            }
-            break;
-        case ctrl('F'):
-        case SPECIAL_RIGHT:
-            if (current->pos < current->chars) {
-                current->pos++;
-                refreshLine(current->prompt, current);
-            }
-            break;
-        case ctrl('P'):
-        case SPECIAL_UP:
-            dir = 1;
-        case ctrl('N'):
-        case SPECIAL_DOWN:
-            if (history_len > 1) {
-                /* Update the current history entry before to
-                 * overwrite it with tne next one. */
-#if 0
-                free(history[history_len-1-history_index]);
-                history[history_len-1-history_index] = strdup(current->buf);
-#endif
-                /* Show the new entry */
-                history_index += dir;
-                if (history_index < 0) {
-                    history_index = 0;
-                    break;
-                } else if (history_index >= history_len) {
-                    history_index = history_len-1;
-                    break;
-                }
+int linenoiseHistorySetMaxLen(int len) {
+    return linenoiseCtxHistorySetMaxLen(default_ctx(), len);
+}
 
-		if (!historyCallback) {
-			set_current(current, history[history_len-1-history_index]);
-		} else {
-			set_current(current, historyCallback(history[history_len-1-history_index]));
-		}
-                refreshLine(current->prompt, current);
-            }
-            break;
-        case ctrl('A'): /* Ctrl+a, go to the start of the line */
-        case SPECIAL_HOME:
-            current->pos = 0;
-            refreshLine(current->prompt, current);
-            break;
-        case ctrl('E'): /* ctrl+e, go to the end of the line */
-        case SPECIAL_END:
-            current->pos = current->chars;
-            refreshLine(current->prompt, current);
-            break;
-        case ctrl('U'): /* Ctrl+u, delete to beginning of line. */
-            if (remove_chars(current, 0, current->pos)) {
-                refreshLine(current->prompt, current);
-            }
-            break;
-        case ctrl('K'): /* Ctrl+k, delete from current to end of line. */
-            if (remove_chars(current, current->pos, current->chars - current->pos)) {
-                refreshLine(current->prompt, current);
-            }
+/**
+ * Encodes 'str' as a line of the history file, escaping backslash, nl and cr,
+ * into 'p' unless it is NULL.
+ *
+ * Returns the length of the encoded line.
+ */
+static size_t history_escape(char *p, const char *str)
+{
+    size_t len = 0;
+
+    for (;;) {
+        size_t n = strcspn(str, "\\\n\r");
+
+        if (p) {
+            memcpy(p + len, str, n);
+        }
+        len += n;
+        str += n;
+        if (*str == 0) {
             break;
-        case ctrl('L'): /* Ctrl+L, clear screen */
-            clearScreen(current);
-            /* Force recalc of window size for serial terminals */
-            current->cols = 0;
-            refreshLine(current->prompt, current);
+        }
+        if (p) {
+            p[len] = '\\';
+            p[len + 1] = *str == '\n' ? 'n' : *str == '\r' ? 'r' : '\\';
+        }
+        len += 2;
+        str++;
+    }
+    if (p) {
+        p[len] = '\n';
+    }
+    return len + 1;
+}
+
+/**
+ * Encodes the history entries from 'first' on as lines of the history file.
+ *
+ * Returns the encoded lines, of '*size' bytes, or NULL if out of memory.
+ */
+static char *history_encode(struct history *h, int first, size_t *size)
+{
+    size_t len = 0;
+    char *buf;
+    int j;
+
+    for (j = first; j < h->len; j++) {
+        const char *str = history_get(h, j);
+
+        if (str) {
+            len += history_escape(NULL, str);
+        }
+    }
+    buf = (char *)mallocFn(len + 1);
+    if (buf == NULL) {
+        return NULL;
+    }
+    *size = 0;
+    for (j = first; j < h->len; j++) {
+        const char *str = history_get(h, j);
+
+        if (str) {
+            *size += history_escape(buf + *size, str);
+        }
+    }
+    return buf;
+}
+
+#ifndef NO_SHARED_HISTORY
+/**
+ * Encodes the lines which the context added to the shared history since
+ * they were last written, leaving out those added by other contexts, which
+ * write their own.
+ *
+ * Returns the encoded lines, of '*size' bytes, or NULL if out of memory.
+ */
+static char *shared_encode(linenoiseContext *ctx, size_t *size)
+{
+    linenoiseSharedHistory *sh = ctx->shared;
+    struct shared_segment *first, *seg;
+    unsigned start, end, seq;
+    size_t len = 0;
+    char *buf;
+
+    shared_enter(sh);
+    first = shared_load(&sh->oldest);
+    end = shared_load(&sh->end);
+    start = ctx->appended;
+    if (first && start < first->base) {
+        /* Some were dropped from the history before being written */
+        start = first->base;
+    }
+    for (seg = first, seq = start; seq < end; seq++) {
+        while (seq - seg->base >= SHARED_SEGMENT) {
+            seg = shared_load(&seg->next);
+        }
+        if (seg->owners[seq - seg->base] == ctx->id) {
+            len += history_escape(NULL, seg->lines[seq - seg->base]);
+        }
+    }
+    buf = (char *)mallocFn(len + 1);
+    *size = 0;
+    for (seg = first, seq = start; buf && seq < end; seq++) {
+        while (seq - seg->base >= SHARED_SEGMENT) {
+            seg = shared_load(&seg->next);
+        }
+        if (seg->owners[seq - seg->base] == ctx->id) {
+            *size += history_escape(buf + *size, seg->lines[seq - seg->base]);
+        }
+    }
+    shared_leave(sh);
+    return buf;
+}
+#else
+static char *shared_encode(linenoiseContext *ctx, size_t *size)
+{
+    (void)ctx;
+    (void)size;
+    return NULL;
+}
+#endif
+
+/* Notes that the history file now holds all of the context's lines */
+static void history_written(linenoiseContext *ctx)
+{
+    ctx->history.written = ctx->history.seq;
+#ifndef NO_SHARED_HISTORY
+    if (ctx->shared) {
+        ctx->appended = shared_load(&ctx->shared->end);
+    }
+#endif
+}
+
+/* Returns the offset of the last 'lines' lines of the history file in 'buf',
+ * which never contain a newline since it is escaped.
+ */
+static size_t history_tail(const char *buf, size_t size, int lines)
+{
+    size_t start;
+
+    for (start = size ? size - 1 : 0; start > 0; start--) {
+        if (buf[start - 1] == '\n' && --lines == 0) {
             break;
-        default:
-	    if (characterCallback[(int)c]) { 
-              int rcode;
-
-              rcode = characterCallback[(int)c](current->buf,current->len,c);
-              refreshLine(current->prompt, current);
-              if (rcode == 1) {
-		continue;
-	      }
-	    }
-
-            /* Only tab is allowed without ^V */
-            if (c == '\t' || c >= ' ') {
-                if (insert_char(current, current->pos, c) == 1) {
-                    refreshLine(current->prompt, current);
-                }
+        }
+    }
+    return start;
+}
+
+#ifdef USE_TERMIOS
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-	    break;
+            return -1;
         }
+        buf += n;
+        len -= n;
     }
-    return current->len;
+    return 0;
 }
 
-char *linenoise(const char *prompt)
+/**
+ * Replaces the history file with 'size' bytes from 'buf'. They are written to
+ * a new file which is renamed over the old one, so that the history survives
+ * a crash part way through and anyone still reading the old file is unaffected.
+ */
+static int history_replace(linenoiseContext *ctx, const char *filename, const char *buf, size_t size)
 {
-    int count;
-    struct current current;
-    char buf[LINENOISE_MAX_LINE];
+    char *tmpname = (char *)mallocFn(strlen(filename) + 16);
+    struct stat st;
+    int fd;
+    int ret;
 
-    if (enableRawMode(&current) == -1) {
-	printf("%s", prompt);
-        fflush(stdout);
-        if (fgets(buf, sizeof(buf), stdin) == NULL) {
-		return NULL;
+    if (tmpname == NULL) {
+        return -1;
+    }
+    sprintf(tmpname, "%s.%d", filename, (int)getpid());
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        freeFn(tmpname);
+        return -1;
+    }
+    if (stat(filename, &st) == 0) {
+        fchmod(fd, st.st_mode & 07777);
+    }
+    ret = write_all(fd, buf, size);
+    if (ret == 0 && ctx->history_fsync) {
+        ret = fsync(fd);
+    }
+    if (close(fd) == -1) {
+        ret = -1;
+    }
+    if (ret == 0) {
+        ret = rename(tmpname, filename);
+    }
+    if (ret == -1) {
+        unlink(tmpname);
+    }
+    freeFn(tmpname);
+    return ret;
+}
+#endif
+
+/**
+ * Encodes the history entries in the binary history file format,
+ * with the optional fields in 'flags'.
+ *
+ * Returns the file contents, of '*size' bytes, or NULL on error.
+ */
+static char *history_encode_binary(struct history *h, int flags, size_t *size)
+{
+    size_t hdr = history_record_header(flags);
+    size_t len = HISTORY_MAGIC_LEN;
+    size_t index;
+    unsigned char *buf, *p;
+    int count = 0;
+    int j;
+
+    for (j = 0; j < h->len; j++) {
+        const char *str = history_get(h, j);
+
+        if (str) {
+            len += hdr + strlen(str) + 1;
+            count++;
+        }
+    }
+    index = len;
+    len += 4 * count + HISTORY_FOOTER_LEN;
+    if (len > 0xffffffffUL) {
+        /* Offsets are 4 bytes */
+        errno = EFBIG;
+        return NULL;
+    }
+    buf = p = (unsigned char *)mallocFn(len);
+    if (buf == NULL) {
+        return NULL;
+    }
+    memcpy(p, HISTORY_MAGIC, HISTORY_MAGIC_LEN);
+    p += HISTORY_MAGIC_LEN;
+    count = 0;
+    for (j = 0; j < h->len; j++) {
+        const char *str = history_get(h, j);
+        size_t n;
+
+        if (str == NULL) {
+            continue;
+        }
+        n = strlen(str);
+        put_u32(buf + index + 4 * count++, p - buf);
+        put_u32(p, n);
+        p += 4;
+        if (flags & LINENOISE_HISTORY_CHECKSUM) {
+            put_u32(p, history_hash(str, n));
+            p += 4;
         }
-        count = strlen(buf);
-        if (count && buf[count-1] == '\n') {
-            count--;
-            buf[count] = '\0';
+        if (flags & LINENOISE_HISTORY_TIMESTAMP) {
+            unsigned long long when = h->times[history_slot(h, j) - h->lines];
+
+            put_u32(p, when);
+            put_u32(p + 4, when >> 32);
+            p += 8;
         }
+        memcpy(p, str, n + 1);
+        p += n + 1;
+    }
+    p += 4 * count;
+    put_u32(p, index);
+    put_u32(p + 4, count);
+    put_u32(p + 8, flags & HISTORY_FLAGS);
+    memcpy(p + 12, HISTORY_FOOTER_MAGIC, 4);
+    *size = len;
+    return (char *)buf;
+}
+
+/* Save the history in the specified file. On success 0 is returned
+ * otherwise -1 is returned. */
+int linenoiseCtxHistorySave(linenoiseContext *ctx, const char *filename) {
+    struct history *h = &ctx->history;
+    int binary = ctx->history_format & LINENOISE_HISTORY_BINARY;
+    FILE *fp;
+    char *buf;
+    size_t size;
+    int ret = 0;
+
+    history_sync(ctx);
+    /* Encode the lines first, since some may still be in the file */
+    buf = binary ? history_encode_binary(h, ctx->history_format, &size) : history_encode(h, 0, &size);
+    if (buf == NULL) return -1;
+#ifdef USE_TERMIOS
+    if (binary) {
+        /* Another process may have mapped the file to read its lines */
+        ret = history_replace(ctx, filename, buf, size);
     }
     else
+#endif
     {
-        current.buf = buf;
-        current.bufmax = sizeof(buf);
-        current.len = 0;
-        current.chars = 0;
-        current.pos = 0;
-        current.prompt = prompt;
-
-        count = linenoisePrompt(&current);
-        disableRawMode(&current);
-        printf("\n");
-        if (count == -1) {
-            return NULL;
+        fp = fopen(filename, binary ? "wb" : "w");
+        if (fp == NULL || fwrite(buf, 1, size, fp) != size) {
+            ret = -1;
         }
+        if (fp && fclose(fp) != 0) {
+            ret = -1;
+        }
+    }
+    freeFn(buf);
+    if (ret == 0) {
+        history_written(ctx);
     }
-    return strdup(buf);
+    return ret;
 }
 
-/* Register a callback function to be called when a character is pressed */
-void linenoiseSetCharacterCallback(linenoiseCharacterCallback *fn, char c) {
-    if (c < ' ') return;
+int linenoiseHistorySave(const char *filename) {
+    return linenoiseCtxHistorySave(default_ctx(), filename);
+}
+
+#ifdef USE_TERMIOS
+/**
+ * Rewrites the history file, which is open as 'fd' and locked, with only its
+ * last 'max_len' lines. These may include lines appended by other processes.
+ */
+static int history_compact_file(linenoiseContext *ctx, const char *filename, int fd, off_t size)
+{
+    char *buf = (char *)mallocFn(size + 1);
+    off_t got = 0;
+    off_t start;
+    int ret = -1;
+
+    if (buf == NULL) {
+        return -1;
+    }
+    while (got < size) {
+        ssize_t n = pread(fd, buf + got, size - got, got);
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            goto out;
+        }
+        got += n;
+    }
+
+    start = history_tail(buf, size, ctx->history.max_len);
+    if (start > 0) {
+        if (history_replace(ctx, filename, buf + start, size - start) == -1) {
+            goto out;
+        }
+        size -= start;
+    }
+    /* Let the file grow to twice the size before compacting again */
+    ctx->compact_size = size * 2 + LINENOISE_MAX_LINE;
+    ret = 0;
+out:
+    freeFn(buf);
+    return ret;
+}
+#endif
+
+/**
+ * Appends the history entries added since the history was last loaded, saved
+ * or appended to the file, which is created if need be. This is much cheaper
+ * than saving the whole history after each line, and several processes can
+ * append to the same file.
+ *
+ * Once the file has grown to twice its size after the last compaction,
+ * it is compacted to the last history max length lines.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+int linenoiseCtxHistoryAppend(linenoiseContext *ctx, const char *filename)
+{
+#ifdef USE_TERMIOS
+    struct history *h = &ctx->history;
+    struct stat st, path_st;
+    char magic[HISTORY_MAGIC_LEN];
+    char *buf;
+    size_t size;
+    int first;
+    int fd;
+    int ret;
+
+    if (ctx->history_format & LINENOISE_HISTORY_BINARY) {
+        return linenoiseCtxHistorySave(ctx, filename);
+    }
+    history_sync(ctx);
+    if (ctx->shared) {
+        /* The other contexts append the lines they added themselves */
+        buf = shared_encode(ctx, &size);
+    }
+    else {
+        first = h->len - (int)(h->seq - h->written);
+        if (first < 0) {
+            /* Some were dropped from the history before being written */
+            first = 0;
+        }
+        if (first == h->len) {
+            return 0;
+        }
+        buf = history_encode(h, first, &size);
+    }
+    if (buf == NULL) {
+        return -1;
+    }
+    if (size == 0) {
+        freeFn(buf);
+        return 0;
+    }
+
+    for (;;) {
+        fd = open(filename, O_RDWR | O_APPEND | O_CREAT, 0666);
+        if (fd == -1) {
+            freeFn(buf);
+            return -1;
+        }
+        if (flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1) {
+            close(fd);
+            freeFn(buf);
+            return -1;
+        }
+        /* Another process may have compacted the file, replacing it, while waiting for the lock */
+        if (stat(filename, &path_st) == 0 && path_st.st_ino == st.st_ino && path_st.st_dev == st.st_dev) {
+            break;
+        }
+        close(fd);
+    }
+
+    if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && memcmp(magic, HISTORY_MAGIC, sizeof(magic)) == 0) {
+        /* Lines can't be appended to a binary history file */
+        close(fd);
+        freeFn(buf);
+        return linenoiseCtxHistorySave(ctx, filename);
+    }
+
+    if (ctx->compact_size == 0) {
+        /* The first append, so the file as it is counts as compacted */
+        ctx->compact_size = st.st_size * 2 + LINENOISE_MAX_LINE;
+    }
+    ret = write_all(fd, buf, size);
+    if (ret == 0 && ctx->history_fsync) {
+        ret = fsync(fd);
+    }
+    if (ret == 0) {
+        history_written(ctx);
+        if (st.st_size + (off_t)size > ctx->compact_size) {
+            ret = history_compact_file(ctx, filename, fd, st.st_size + size);
+        }
+    }
+    close(fd);
+    freeFn(buf);
+    return ret;
+#else
+    return linenoiseCtxHistorySave(ctx, filename);
+#endif
+}
+
+int linenoiseHistoryAppend(const char *filename)
+{
+    return linenoiseCtxHistoryAppend(default_ctx(), filename);
+}
+
+/* Makes linenoiseCtxHistoryAppend() wait for the lines to reach the disk */
+void linenoiseCtxSetHistoryFsync(linenoiseContext *ctx, int enable)
+{
+#ifdef USE_TERMIOS
+    ctx->history_fsync = enable;
+#else
+    (void)ctx;
+    (void)enable;
+#endif
+}
+
+void linenoiseSetHistoryFsync(int enable)
+{
+    linenoiseCtxSetHistoryFsync(default_ctx(), enable);
+}
+
+/**
+ * Sets the format in which linenoiseCtxHistorySave() writes the history file:
+ * LINENOISE_HISTORY_TEXT, or LINENOISE_HISTORY_BINARY plus optionally
+ * LINENOISE_HISTORY_CHECKSUM and LINENOISE_HISTORY_TIMESTAMP.
+ * Either format can be loaded.
+ */
+void linenoiseCtxSetHistoryFormat(linenoiseContext *ctx, int format)
+{
+    ctx->history_format = format;
+}
+
+void linenoiseSetHistoryFormat(int format)
+{
+    linenoiseCtxSetHistoryFormat(default_ctx(), format);
+}
+
+/**
+ * Reads a complete line from 'fp', however long, into '*buf',
+ * which is grown (and '*bufmax' updated) as needed.
+ *
+ * Returns the length of the line, or -1 at end of file or if out of memory.
+ */
+static int read_line(FILE *fp, char **buf, int *bufmax)
+{
+    int len = 0;
 
-    characterCallback[(int)c] = fn;
+    while (fgets(*buf + len, *bufmax - len, fp) != NULL) {
+        char *newbuf;
+
+        len += strlen(*buf + len);
+        if (len < *bufmax - 1 || (*buf)[len - 1] == '\n') {
+            /* A complete line, or one with an embedded null which ends it */
+            return len;
+        }
+        newbuf = (char *)reallocFn(*buf, *bufmax * 2);
+        if (newbuf == NULL) {
+            return -1;
+        }
+        *buf = newbuf;
+        *bufmax *= 2;
+    }
+    return len ? len : -1;
 }
 
-/* Using a circular buffer is smarter, but a bit more complex to handle. */
-int linenoiseHistoryAdd(const char *line) {
-    char *linecopy;
-
-    if (history_max_len == 0) return 0;
-    if (history == NULL) {
-        history = (char **)malloc(sizeof(char*)*history_max_len);
-        if (history == NULL) return 0;
-        memset(history,0,(sizeof(char*)*history_max_len));
+/**
+ * Loads the binary history file in 'data', which is mapped if 'mapped' is set
+ * and otherwise allocated.
+ *
+ * If the history is empty, the last lines are only found in the index, and
+ * 'data' is kept to read them from when they are needed. Otherwise the lines
+ * are read straight away.
+ *
+ * Returns 1 if 'data' isn't a binary history file. Otherwise takes over 'data'
+ * and returns 0, or -1 if the file is damaged or out of memory.
+ */
+static int history_load_binary(linenoiseContext *ctx, const unsigned char *data, size_t size, int mapped)
+{
+    struct history *h = &ctx->history;
+    struct history_file file;
+    const unsigned char *footer;
+    unsigned count;
+    unsigned n;
+    unsigned j;
+
+    if (size < HISTORY_MAGIC_LEN || memcmp(data, HISTORY_MAGIC, HISTORY_MAGIC_LEN) != 0) {
+        return 1;
+    }
+    file.data = data;
+    file.size = size;
+    file.mapped = mapped;
+    footer = data + size - HISTORY_FOOTER_LEN;
+    if (size < HISTORY_MAGIC_LEN + HISTORY_FOOTER_LEN || memcmp(footer + 12, HISTORY_FOOTER_MAGIC, 4) != 0) {
+        history_file_unmap(&file);
+        return -1;
+    }
+    file.end = get_u32(footer);
+    count = get_u32(footer + 4);
+    file.flags = get_u32(footer + 8) & HISTORY_FLAGS;
+    if (file.end < HISTORY_MAGIC_LEN || file.end > size - HISTORY_FOOTER_LEN ||
+        (size - HISTORY_FOOTER_LEN - file.end) / 4 != count || (size - HISTORY_FOOTER_LEN - file.end) % 4) {
+        history_file_unmap(&file);
+        return -1;
     }
 
-    /* do not insert duplicate lines into history */
-    if (history_len > 0 && strcmp(line, history[history_len - 1]) == 0) {
+    /* Only the last lines fit */
+    n = count < (unsigned)h->max_len ? count : (unsigned)h->max_len;
+    file.index = data + file.end + 4 * (count - n);
+    file.first = 0;
+
+    if (n && h->len == 0 && !ctx->shared && !h->erase_dups) {
+        file.first = h->seq;
+        h->file = (struct history_file *)mallocFn(sizeof(file));
+        if (h->file == NULL || !history_alloc(h)) {
+            freeFn(h->file);
+            h->file = NULL;
+            history_file_unmap(&file);
+            return -1;
+        }
+        /* Each line is read from the file by history_get() */
+        *h->file = file;
+        memset(h->lines, 0, sizeof(char *) * h->max_len);
+        h->head = 0;
+        h->len = n;
+        h->seq += n;
         return 0;
     }
 
-    linecopy = strdup(line);
-    if (!linecopy) return 0;
-    if (history_len == history_max_len) {
-        free(history[0]);
-        memmove(history,history+1,sizeof(char*)*(history_max_len-1));
-        history_len--;
+    for (j = 0; j < n; j++) {
+        time_t when = 0;
+        const char *line = history_file_line(&file, j, &when);
+
+        if (ctx->shared) {
+            linenoiseCtxHistoryAdd(ctx, line);
+        }
+        /* do not insert duplicate lines into history */
+        else if (h->len == 0 || strcmp(line, history_get(h, h->len - 1)) != 0) {
+            history_add(h, line, when);
+        }
     }
-    history[history_len] = linecopy;
-    history_len++;
-    return 1;
+    history_file_unmap(&file);
+    return 0;
 }
 
-int linenoiseHistorySetMaxLen(int len) {
-    char **newHistory;
-
-    if (len < 1) return 0;
-    if (history) {
-        int tocopy = history_len;
+#ifdef USE_TERMIOS
+/**
+ * Adds the lines of the history file in 'buf' to the history.
+ *
+ * Only the lines which fit in the history are decoded, which are found by
+ * scanning back from the end. Each line is decoded by copying the spans
+ * between backslashes.
+ *
+ * Returns 0 on success or -1 if out of memory.
+ */
+static int history_load_lines(linenoiseContext *ctx, const char *buf, size_t size)
+{
+    struct history *h = &ctx->history;
+    const char *p = buf + history_tail(buf, size, h->max_len);
+    const char *end = buf + size;
+    char *line = NULL;
+    size_t linemax = 0;
 
-        newHistory = (char **)malloc(sizeof(char*)*len);
-        if (newHistory == NULL) return 0;
-        if (len < tocopy) tocopy = len;
-        memcpy(newHistory,history+(history_max_len-tocopy), sizeof(char*)*tocopy);
-        free(history);
-        history = newHistory;
+    if (h->max_len == 0) {
+        return 0;
     }
-    history_max_len = len;
-    if (history_len > history_max_len)
-        history_len = history_max_len;
-    return 1;
-}
+    while (p < end) {
+        const char *eol = (const char *)memchr(p, '\n', end - p);
+        const char *next;
+        char *dest;
 
-/* Save the history in the specified file. On success 0 is returned
- * otherwise -1 is returned. */
-int linenoiseHistorySave(const char *filename) {
-    FILE *fp = fopen(filename,"w");
-    int j;
+        if (eol == NULL) {
+            eol = end;
+        }
+        next = eol + 1;
+        if (eol != p && eol[-1] == '\r') {
+            eol--;
+        }
+        if ((size_t)(eol - p) >= linemax) {
+            char *newline;
 
-    if (fp == NULL) return -1;
-    for (j = 0; j < history_len; j++) {
-        const char *str = history[j];
-        /* Need to encode backslash, nl and cr */
-        while (*str) {
-            if (*str == '\\') {
-                fputs("\\\\", fp);
-            }
-            else if (*str == '\n') {
-                fputs("\\n", fp);
+            linemax = eol - p + LINENOISE_MAX_LINE;
+            newline = (char *)reallocFn(line, linemax);
+            if (newline == NULL) {
+                freeFn(line);
+                return -1;
             }
-            else if (*str == '\r') {
-                fputs("\\r", fp);
+            line = newline;
+        }
+
+        /* Decode backslash escaped values */
+        for (dest = line; p < eol; ) {
+            const char *bs = (const char *)memchr(p, '\\', eol - p);
+            size_t n = (bs ? bs : eol) - p;
+
+            memcpy(dest, p, n);
+            dest += n;
+            p += n;
+            if (bs && bs + 1 < eol) {
+                *dest++ = bs[1] == 'n' ? '\n' : bs[1] == 'r' ? '\r' : bs[1];
+                p += 2;
             }
-            else {
-                fputc(*str, fp);
+            else if (bs) {
+                *dest++ = *p++;
             }
-            str++;
         }
-        fputc('\n', fp);
-    }
+        *dest = 0;
+        p = next;
 
-    fclose(fp);
+        if (ctx->shared) {
+            linenoiseCtxHistoryAdd(ctx, line);
+        }
+        /* do not insert duplicate lines into history */
+        else if (h->len == 0 || strcmp(line, history_get(h, h->len - 1)) != 0) {
+            history_add(h, line, 0);
+        }
+    }
+    freeFn(line);
     return 0;
 }
 
+/* Loads the history file by mapping it, which is much faster than reading
+ * it. Returns 1 if it can't be mapped.
+ */
+static int history_load_mmap(linenoiseContext *ctx, const char *filename)
+{
+    struct stat st;
+    void *map;
+    int fd = open(filename, O_RDONLY);
+    int ret;
+
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return 1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 1;
+    }
+    ret = history_load_binary(ctx, (const unsigned char *)map, st.st_size, 1);
+    if (ret == 1) {
+        ret = history_load_lines(ctx, (const char *)map, st.st_size);
+        munmap(map, st.st_size);
+    }
+    return ret;
+}
+#endif
+
 /* Load the history from the specified file. If the file does not exist
  * zero is returned and no operation is performed.
  *
  * If the file exists and the operation succeeded 0 is returned, otherwise
  * on error -1 is returned. */
-int linenoiseHistoryLoad(const char *filename) {
-    FILE *fp = fopen(filename,"r");
-    char buf[LINENOISE_MAX_LINE];
+int linenoiseCtxHistoryLoad(linenoiseContext *ctx, const char *filename) {
+    FILE *fp;
+    char *buf;
+    int bufmax = LINENOISE_MAX_LINE;
+    int len;
 
+#ifdef USE_TERMIOS
+    len = history_load_mmap(ctx, filename);
+    if (len != 1) {
+        history_written(ctx);
+        return len;
+    }
+#endif
+    fp = fopen(filename,"rb");
     if (fp == NULL) return -1;
 
-    while (fgets(buf,LINENOISE_MAX_LINE,fp) != NULL) {
+    buf = (char *)mallocFn(bufmax);
+    if (buf == NULL) {
+        fclose(fp);
+        return -1;
+    }
+
+    if (fread(buf, 1, HISTORY_MAGIC_LEN, fp) == HISTORY_MAGIC_LEN && memcmp(buf, HISTORY_MAGIC, HISTORY_MAGIC_LEN) == 0) {
+        /* A binary history file, so read all of it */
+        long size;
+
+        freeFn(buf);
+        buf = NULL;
+        if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) > 0 && fseek(fp, 0, SEEK_SET) == 0 &&
+            (buf = (char *)mallocFn(size)) != NULL && fread(buf, 1, size, fp) == (size_t)size) {
+            fclose(fp);
+            len = history_load_binary(ctx, (const unsigned char *)buf, size, 0);
+            history_written(ctx);
+            return len;
+        }
+        freeFn(buf);
+        fclose(fp);
+        return -1;
+    }
+    rewind(fp);
+
+    while ((len = read_line(fp, &buf, &bufmax)) >= 0) {
         char *src, *dest;
 
         /* Decode backslash escaped values */
         for (src = dest = buf; *src; src++) {
             char ch = *src;
 
-            if (ch == '\\') {
+            if (ch == '\\' && src[1]) {
                 src++;
                 if (*src == 'n') {
                     ch = '\n';
@@ -1414,38 +6612,393 @@ int linenoiseHistoryLoad(const char *filename) {
             *dest++ = ch;
         }
         /* Remove trailing newline */
-        if (dest != buf && (dest[-1] == '\n' || dest[-1] == '\r')) {
+        if (dest != buf && dest[-1] == '\n') {
+            dest--;
+        }
+        if (dest != buf && dest[-1] == '\r') {
             dest--;
         }
         *dest = 0;
 
-        linenoiseHistoryAdd(buf);
+        linenoiseCtxHistoryAdd(ctx, buf);
     }
+    freeFn(buf);
     fclose(fp);
+    history_written(ctx);
     return 0;
 }
 
+int linenoiseHistoryLoad(const char *filename) {
+    return linenoiseCtxHistoryLoad(default_ctx(), filename);
+}
+
+/**
+ * If 'enable' is set, adding a line which is already in the history erases
+ * the older copy, so that each line appears only once.
+ */
+void linenoiseCtxSetHistoryEraseDups(linenoiseContext *ctx, int enable)
+{
+    struct history *h = &ctx->history;
+
+    h->erase_dups = enable;
+    if (!enable) {
+        freeFn(h->dups);
+        h->dups = NULL;
+        h->dups_size = 0;
+    }
+    else if (h->dups == NULL && h->lines) {
+        /* Erase the duplicates already in the history */
+        history_dups_build(h);
+        if (h->erased > h->len / 2) {
+            history_squeeze(h);
+        }
+    }
+}
+
+void linenoiseSetHistoryEraseDups(int enable)
+{
+    linenoiseCtxSetHistoryEraseDups(default_ctx(), enable);
+}
+
+void linenoiseCtxHistoryFree(linenoiseContext *ctx) {
+    history_free(&ctx->history);
+}
+
+void linenoiseHistoryFree(void) {
+    linenoiseCtxHistoryFree(default_ctx());
+}
+
+linenoiseSharedHistory *linenoiseSharedHistoryCreate(int max_len)
+{
+#ifndef NO_SHARED_HISTORY
+    linenoiseSharedHistory *sh;
+
+    if (max_len < 1) return NULL;
+    sh = (linenoiseSharedHistory *)mallocFn(sizeof(*sh));
+    if (sh) {
+        memset(sh, 0, sizeof(*sh));
+        sh->max_len = max_len;
+    }
+    return sh;
+#else
+    (void)max_len;
+    return NULL;
+#endif
+}
+
+void linenoiseSharedHistoryFree(linenoiseSharedHistory *sh)
+{
+#ifndef NO_SHARED_HISTORY
+    struct shared_segment *seg;
+
+    if (sh == NULL) return;
+    while ((seg = sh->oldest) != NULL) {
+        sh->oldest = seg->next;
+        shared_segment_free(seg, sh->end);
+    }
+    shared_reclaim(sh);
+    freeFn(sh);
+#else
+    (void)sh;
+#endif
+}
+
+/* Makes the context use the lines of 'sh', in place of its own history.
+ * NULL detaches it again, keeping a copy of the lines it had.
+ */
+void linenoiseCtxSetSharedHistory(linenoiseContext *ctx, linenoiseSharedHistory *sh)
+{
+    if (sh && sh != ctx->shared) {
+        history_free(&ctx->history);
+        ctx->synced = 0;
+        ctx->shared = sh;
+        /* The lines so far are other contexts' to write */
+        history_written(ctx);
+    }
+    ctx->shared = sh;
+}
+
+void linenoiseSetSharedHistory(linenoiseSharedHistory *sh)
+{
+    linenoiseCtxSetSharedHistory(default_ctx(), sh);
+}
+
+static void reverse_slots(char **first, char **last)
+{
+    while (first < --last) {
+        char *tmp = *first;
+        *first++ = *last;
+        *last = tmp;
+    }
+}
+
 /* Provide access to the history buffer.
  *
  * If 'len' is not NULL, the length is stored in *len.
+ *
+ * The circular buffer is rotated in place so that the oldest entry
+ * is first. The array remains valid until the history is next modified.
  */
-char **linenoiseHistory(int *len) {
+char **linenoiseCtxHistory(linenoiseContext *ctx, int *len) {
+    struct history *h = &ctx->history;
+    int j;
+
+    history_sync(ctx);
+    if (h->erased) {
+        history_squeeze(h);
+    }
+    for (j = 0; j < h->len; j++) {
+        history_get(h, j);
+    }
+    if (h->lines && h->head) {
+        time_t *times = (time_t *)mallocFn(sizeof(time_t)*h->max_len);
+
+        if (times) {
+            for (j = 0; j < h->max_len; j++) {
+                times[j] = h->times[(h->head + j) % h->max_len];
+            }
+            freeFn(h->times);
+            h->times = times;
+        }
+        else {
+            /* Out of memory, so forget when the lines were added */
+            memset(h->times, 0, sizeof(time_t)*h->max_len);
+        }
+        reverse_slots(h->lines, h->lines + h->head);
+        reverse_slots(h->lines + h->head, h->lines + h->max_len);
+        reverse_slots(h->lines, h->lines + h->max_len);
+        h->head = 0;
+    }
     if (len) {
-        *len = history_len;
+        *len = h->len;
     }
-    return history;
+    return h->lines;
 }
 
-int linenoiseCols(void)
+char **linenoiseHistory(int *len) {
+    return linenoiseCtxHistory(default_ctx(), len);
+}
+
+/* Returns history entry 'index', where 0 is the oldest, or NULL if there is none. */
+const char *linenoiseCtxHistoryGet(linenoiseContext *ctx, int index) {
+    struct history *h = &ctx->history;
+
+    history_sync(ctx);
+    if (h->erased) {
+        /* Which renumbers the lines, so comes before the check */
+        history_squeeze(h);
+    }
+    if (index < 0 || index >= h->len) {
+        return NULL;
+    }
+    return history_get(h, index);
+}
+
+const char *linenoiseHistoryGet(int index) {
+    return linenoiseCtxHistoryGet(default_ctx(), index);
+}
+
+int linenoiseCtxCols(linenoiseContext *ctx)
 {
     struct current current;
 
+    memset(&current, 0, sizeof(current));
+    current.ctx = ctx;
+#ifdef USE_TERMIOS
+    current.fd = ctx->infd;
+    current.outfd = ctx->outfd;
+#endif
     getWindowSize(&current);
+    outputFree(&current);
 
     return current.cols;
 }
 
+int linenoiseCols(void)
+{
+    return linenoiseCtxCols(default_ctx());
+}
+
+void linenoiseCtxSetHistoryCallback(linenoiseContext *ctx, linenoiseHistoryCallback *fn)
+{
+	ctx->historyCallback = fn;
+}
+
 void linenoiseSetHistoryCallback(linenoiseHistoryCallback *fn)
 {
-	historyCallback = fn;
+	linenoiseCtxSetHistoryCallback(default_ctx(), fn);
+}
+
+void linenoiseCtxSetHintsCallback(linenoiseContext *ctx, linenoiseHintsCallback *fn)
+{
+	ctx->hintsCallback = fn;
+}
+
+void linenoiseSetHintsCallback(linenoiseHintsCallback *fn)
+{
+	linenoiseCtxSetHintsCallback(default_ctx(), fn);
+}
+
+void linenoiseCtxSetFreeHintsCallback(linenoiseContext *ctx, linenoiseFreeHintsCallback *fn)
+{
+	ctx->freeHintsCallback = fn;
+}
+
+void linenoiseSetFreeHintsCallback(linenoiseFreeHintsCallback *fn)
+{
+	linenoiseCtxSetFreeHintsCallback(default_ctx(), fn);
+}
+
+void linenoiseCtxSetHighlightCallback(linenoiseContext *ctx, linenoiseHighlightCallback *fn)
+{
+	ctx->highlightCallback = fn;
+}
+
+void linenoiseSetHighlightCallback(linenoiseHighlightCallback *fn)
+{
+	linenoiseCtxSetHighlightCallback(default_ctx(), fn);
+}
+
+void linenoiseAddHighlight(linenoiseHighlights *hl, int start, int len, int color, int bold)
+{
+	if (start < 0) {
+		len += start;
+		start = 0;
+	}
+	if (len > hl->len - start) {
+		len = hl->len - start;
+	}
+	if (len > 0) {
+		memset(hl->attrs + start, make_attr(color, bold), len);
+	}
+}
+
+void linenoiseCtxSetBracketedPaste(linenoiseContext *ctx, int enable)
+{
+#ifdef USE_TERMIOS
+    ctx->bracketed_paste = enable;
+#else
+    (void)ctx;
+    (void)enable;
+#endif
+}
+
+void linenoiseSetBracketedPaste(int enable)
+{
+    linenoiseCtxSetBracketedPaste(default_ctx(), enable);
+}
+
+/**
+ * Sets how long to wait for the rest of an escape sequence once the input
+ * runs out part way through one, in ms. A lone ESC takes this long to be
+ * seen as such. With 0, only what has already been read is looked at.
+ */
+void linenoiseCtxSetEscapeTimeout(linenoiseContext *ctx, int ms)
+{
+#ifdef USE_TERMIOS
+    ctx->escape_timeout = ms < 0 ? 0 : ms;
+#else
+    (void)ctx;
+    (void)ms;
+#endif
+}
+
+void linenoiseSetEscapeTimeout(int ms)
+{
+    linenoiseCtxSetEscapeTimeout(default_ctx(), ms);
+}
+
+/**
+ * Starts keeping linenoiseStats from zero if 'enable' is set,
+ * otherwise stops, leaving them as they were.
+ */
+void linenoiseCtxSetStats(linenoiseContext *ctx, int enable)
+{
+    if (enable && !ctx->stats_enabled) {
+        memset(&ctx->stats, 0, sizeof(ctx->stats));
+        ctx->input_time = 0;
+    }
+    ctx->stats_enabled = enable;
+}
+
+void linenoiseSetStats(int enable)
+{
+    linenoiseCtxSetStats(default_ctx(), enable);
+}
+
+/* Copies the stats kept since linenoiseCtxSetStats() into '*stats' */
+void linenoiseCtxGetStats(linenoiseContext *ctx, linenoiseStats *stats)
+{
+    *stats = ctx->stats;
+}
+
+void linenoiseGetStats(linenoiseStats *stats)
+{
+    linenoiseCtxGetStats(default_ctx(), stats);
+}
+
+/**
+ * Lines too long for the window wrap onto as many rows as they need
+ * if 'enable' is set, rather than scrolling sideways.
+ * Takes effect from the next refresh.
+ */
+void linenoiseCtxSetMultiLine(linenoiseContext *ctx, int enable)
+{
+    ctx->multiline = enable;
+}
+
+void linenoiseSetMultiLine(int enable)
+{
+    linenoiseCtxSetMultiLine(default_ctx(), enable);
+}
+
+/**
+ * Returns an fd which becomes readable when linenoiseCtxEditFeed() has something
+ * to do other than read the terminal, such as show completions found asynchronously.
+ * An event loop should wait for it as well as the terminal. -1 if there is none.
+ */
+int linenoiseCtxWakeFd(linenoiseContext *ctx)
+{
+#ifdef USE_TERMIOS
+    return ctx->wakefd[0];
+#else
+    (void)ctx;
+    return -1;
+#endif
+}
+
+int linenoiseWakeFd(void)
+{
+    return linenoiseCtxWakeFd(default_ctx());
+}
+
+/**
+ * Says that the window changed size, so that the line is redrawn to suit.
+ * This is only needed when no SIGWINCH arrives for it, for instance when the
+ * context is on a pty other than the controlling terminal. It may be called
+ * from a signal handler or another thread.
+ */
+void linenoiseCtxWindowChanged(linenoiseContext *ctx)
+{
+    ctx->cols = 0;
+#ifdef USE_TERMIOS
+    if (ctx->wakefd[1] != -1) {
+        IGNORE_RC(write(ctx->wakefd[1], "", 1));
+    }
+#endif
+}
+
+void linenoiseWindowChanged(void)
+{
+    linenoiseCtxWindowChanged(default_ctx());
+}
+
+int linenoiseCtxRefreshWrites(linenoiseContext *ctx)
+{
+    return ctx->refresh_writes;
+}
+
+int linenoiseRefreshWrites(void)
+{
+    return linenoiseCtxRefreshWrites(default_ctx());
 }
@@ -42,16 +42,44 @@ extern "C" {
 #endif
 
 
+typedef struct linenoiseContext linenoiseContext;
+
+/* Formats for linenoiseSetHistoryFormat() */
+#define LINENOISE_HISTORY_TEXT 0
+#define LINENOISE_HISTORY_BINARY 1
+#define LINENOISE_HISTORY_CHECKSUM 2   /* With LINENOISE_HISTORY_BINARY, a checksum of each line */
+#define LINENOISE_HISTORY_TIMESTAMP 4  /* With LINENOISE_HISTORY_BINARY, when each line was added */
+
 #ifndef NO_COMPLETION
 
+/* Modes for linenoiseSetCompletionMode() */
+#define LINENOISE_COMPLETE_CYCLE 0  /* Each tab shows the next completion */
+#define LINENOISE_COMPLETE_LIST 1   /* Tab completes as far as possible, a second tab lists the completions */
+
 typedef struct linenoiseCompletions {
   size_t len;
   char **cvec;
+  size_t max;   /* Number of entries 'cvec' has room for */
+  struct linenoiseCompletionChunk *chunks; /* Where the strings are kept */
 } linenoiseCompletions;
 
 typedef void(linenoiseCompletionCallback)(const char *, linenoiseCompletions *);
 void linenoiseSetCompletionCallback(linenoiseCompletionCallback *);
 void linenoiseAddCompletion(linenoiseCompletions *, const char *);
+void linenoiseSetCompletionCache(int enable);
+void linenoiseSetCompletionMode(int mode);
+
+void linenoiseCtxSetCompletionCallback(linenoiseContext *ctx, linenoiseCompletionCallback *);
+void linenoiseCtxSetCompletionCache(linenoiseContext *ctx, int enable);
+void linenoiseCtxSetCompletionMode(linenoiseContext *ctx, int mode);
+
+/* Completions found in the background, see linenoiseCtxSetAsyncCompletionCallback() */
+typedef struct linenoiseCompletionRequest linenoiseCompletionRequest;
+typedef void(linenoiseAsyncCompletionCallback)(const char *, linenoiseCompletionRequest *, void *);
+int linenoiseSetAsyncCompletionCallback(linenoiseAsyncCompletionCallback *, void *userdata);
+int linenoiseCtxSetAsyncCompletionCallback(linenoiseContext *ctx, linenoiseAsyncCompletionCallback *, void *userdata);
+int linenoiseCompletionPush(linenoiseCompletionRequest *req, const char *str);
+void linenoiseCompletionDone(linenoiseCompletionRequest *req);
 
 #endif    // NO_COMPLETION
 
@@ -59,17 +87,206 @@ void linenoiseAddCompletion(linenoiseCompletions *, const char *);
 typedef int(linenoiseCharacterCallback)(const char *, size_t, char);
 void linenoiseSetCharacterCallback(linenoiseCharacterCallback *, char);
 
+/* Keys which can be bound, besides chars, which are their unicode value with utf-8 and otherwise their byte */
+#define LINENOISE_KEY_CTRL(c) ((c) & 0x1f)
+#define LINENOISE_KEY_UP -20
+#define LINENOISE_KEY_DOWN -21
+#define LINENOISE_KEY_LEFT -22
+#define LINENOISE_KEY_RIGHT -23
+#define LINENOISE_KEY_DELETE -24
+#define LINENOISE_KEY_HOME -25
+#define LINENOISE_KEY_END -26
+#define LINENOISE_KEY_INSERT -29
+#define LINENOISE_KEY_PAGE_UP -30
+#define LINENOISE_KEY_PAGE_DOWN -31
+#define LINENOISE_KEY_BACKTAB -32           /* Shift-Tab */
+#define LINENOISE_KEY_CTRL_LEFT -33         /* Also with alt rather than ctrl */
+#define LINENOISE_KEY_CTRL_RIGHT -34
+#define LINENOISE_KEY_CTRL_DELETE -35
+#define LINENOISE_KEY_F(n) (-40 - (n))      /* F1 to F12 */
+#define LINENOISE_KEY_META(c) (-128 - (c))  /* Alt with an ascii char */
+
+/* What a key can be bound to do with linenoiseBindKey() */
+enum {
+    LINENOISE_ACTION_DEFAULT,           /* Whatever the key did to begin with */
+    LINENOISE_ACTION_NONE,              /* Nothing */
+    LINENOISE_ACTION_INSERT,            /* Insert the key itself */
+    LINENOISE_ACTION_ENTER,             /* Return the line */
+    LINENOISE_ACTION_INTERRUPT,         /* Return NULL with errno EAGAIN, as ctrl-C does */
+    LINENOISE_ACTION_EOF,               /* Return NULL on an empty line, otherwise delete, as ctrl-D does */
+    LINENOISE_ACTION_BACKSPACE,
+    LINENOISE_ACTION_DELETE,
+    LINENOISE_ACTION_DELETE_WORD_LEFT,
+    LINENOISE_ACTION_DELETE_WORD_RIGHT,
+    LINENOISE_ACTION_DELETE_TO_START,
+    LINENOISE_ACTION_DELETE_TO_END,
+    LINENOISE_ACTION_LEFT,
+    LINENOISE_ACTION_RIGHT,
+    LINENOISE_ACTION_WORD_LEFT,
+    LINENOISE_ACTION_WORD_RIGHT,
+    LINENOISE_ACTION_HOME,
+    LINENOISE_ACTION_END,
+    LINENOISE_ACTION_HISTORY_PREV,
+    LINENOISE_ACTION_HISTORY_NEXT,
+    LINENOISE_ACTION_SEARCH,            /* Reverse incremental search of the history */
+    LINENOISE_ACTION_COMPLETE,          /* Complete the line, or insert the key without a completion callback */
+    LINENOISE_ACTION_TRANSPOSE,         /* Swap the chars either side of the cursor */
+    LINENOISE_ACTION_QUOTE,             /* Insert the next key as it is */
+    LINENOISE_ACTION_CLEAR_SCREEN,
+    LINENOISE_ACTION_COUNT
+};
+
+/* Returned by a linenoiseKeyCallback, or 0 to go on to the key's action and draw the line again */
+#define LINENOISE_KEY_HANDLED 1     /* Don't do the key's action */
+#define LINENOISE_KEY_UNCHANGED 2   /* Nothing was written to the terminal, so the line is still as it was */
+
+typedef int(linenoiseKeyCallback)(const char *buf, size_t len, int key, void *userdata);
+int linenoiseBindKey(int key, int action);
+int linenoiseBindKeyCallback(int key, linenoiseKeyCallback *fn, void *userdata);
+
 typedef const char *(linenoiseHistoryCallback)(const char *);
 void linenoiseSetHistoryCallback(linenoiseHistoryCallback *);
 
+/* Shown after the line as it is typed, see linenoiseSetHintsCallback() */
+typedef char *(linenoiseHintsCallback)(const char *, int *color, int *bold);
+typedef void(linenoiseFreeHintsCallback)(void *);
+void linenoiseSetHintsCallback(linenoiseHintsCallback *);
+void linenoiseSetFreeHintsCallback(linenoiseFreeHintsCallback *);
+
+/* Colours for parts of the line, see linenoiseSetHighlightCallback() */
+typedef struct linenoiseHighlights linenoiseHighlights;
+typedef void(linenoiseHighlightCallback)(const char *, linenoiseHighlights *);
+void linenoiseSetHighlightCallback(linenoiseHighlightCallback *);
+void linenoiseAddHighlight(linenoiseHighlights *hl, int start, int len, int color, int bold);
+
+/* Where the time goes, kept once enabled with linenoiseSetStats(). Times are in microseconds */
+#define LINENOISE_STATS_BUCKETS 20
+typedef struct linenoiseStats {
+  unsigned long keys;       /* Keys handled */
+  unsigned long long key_us; /* Time from taking each key from the input until the screen showed it */
+  unsigned long key_max_us;
+  /* Keys by that time: bucket 0 those under 1, then each under twice as
+   * long as the one before, the last counting all the rest */
+  unsigned long key_latency[LINENOISE_STATS_BUCKETS];
+  unsigned long refreshes;  /* Times the line was redrawn */
+  unsigned long long refresh_us;
+  unsigned long refresh_max_us;
+  unsigned long long refresh_bytes; /* Bytes written to redraw */
+  unsigned long refresh_max_bytes;
+  unsigned long refresh_max_writes; /* The most writes for one redraw */
+  unsigned long long bytes_written; /* Bytes written to the terminal, including redraws */
+  unsigned long writes;
+  unsigned long escape_waits; /* Times more of an escape sequence had to be waited for */
+  unsigned long escape_timeouts; /* ...and didn't come */
+  unsigned long long escape_wait_us;
+  unsigned long window_queries; /* Times the window size was looked up */
+  unsigned long long window_us;
+  unsigned long completion_calls; /* Completion callbacks */
+  unsigned long long completion_us;
+  unsigned long history_calls; /* History callbacks */
+  unsigned long long history_us;
+  unsigned long searches;   /* Reverse searches of the history, one per key */
+  unsigned long long search_us;
+} linenoiseStats;
+
+/* When stdin isn't a terminal, lines are read from it with stdio, one at a
+ * time, so reading stdin with stdio as well keeps the input in order */
 char *linenoise(const char *prompt);
+/* The line without a copy, until the next read, see linenoiseCtxReadView() */
+const char *linenoiseReadView(const char *prompt, size_t *len);
+
+/* A line read with linenoiseReadInto(), which reuses the buffer for the next */
+typedef struct linenoiseBuf {
+  char *buf;    /* The line, null terminated. Allocated with linenoiseSetAllocator()'s allocator */
+  size_t len;   /* Its length */
+  size_t max;   /* Size of 'buf', or 0 if nothing is allocated yet */
+} linenoiseBuf;
+int linenoiseReadInto(const char *prompt, linenoiseBuf *lb);
+void linenoiseBufFree(linenoiseBuf *lb);
+void linenoiseFree(void *ptr);
+void linenoiseSetAllocator(void *(*malloc_fn)(size_t), void *(*realloc_fn)(void *, size_t), void (*free_fn)(void *));
+
+extern char *linenoiseEditMore;
+int linenoiseEditStart(const char *prompt);
+char *linenoiseEditFeed(void);
+int linenoiseEditPending(void);
+void linenoiseEditStop(void);
+void linenoiseHide(void);
+void linenoiseShow(void);
+
 int linenoiseHistoryAdd(const char *line);
 int linenoiseHistorySetMaxLen(int len);
 int linenoiseHistorySave(const char *filename);
+int linenoiseHistoryAppend(const char *filename);
+void linenoiseSetHistoryFsync(int enable);
+void linenoiseSetHistoryFormat(int format);
+void linenoiseSetHistoryEraseDups(int enable);
 int linenoiseHistoryLoad(const char *filename);
 void linenoiseHistoryFree(void);
 char **linenoiseHistory(int *len);
+const char *linenoiseHistoryGet(int index);
 int linenoiseCols(void);
+void linenoiseSetBracketedPaste(int enable);
+void linenoiseSetEscapeTimeout(int ms);
+void linenoiseSetMultiLine(int enable);
+void linenoiseSetStats(int enable);
+void linenoiseGetStats(linenoiseStats *stats);
+int linenoiseRefreshWrites(void);
+int linenoiseWakeFd(void);
+void linenoiseWindowChanged(void);
+
+/* The same again for a context of its own, with its own terminal and history */
+linenoiseContext *linenoiseCtxCreate(int infd, int outfd);
+void linenoiseCtxFree(linenoiseContext *ctx);
+linenoiseContext *linenoiseCtxDefault(void);
+
+void linenoiseCtxSetCharacterCallback(linenoiseContext *ctx, linenoiseCharacterCallback *, char);
+int linenoiseCtxBindKey(linenoiseContext *ctx, int key, int action);
+int linenoiseCtxBindKeyCallback(linenoiseContext *ctx, int key, linenoiseKeyCallback *fn, void *userdata);
+void linenoiseCtxSetHistoryCallback(linenoiseContext *ctx, linenoiseHistoryCallback *);
+void linenoiseCtxSetHintsCallback(linenoiseContext *ctx, linenoiseHintsCallback *);
+void linenoiseCtxSetFreeHintsCallback(linenoiseContext *ctx, linenoiseFreeHintsCallback *);
+void linenoiseCtxSetHighlightCallback(linenoiseContext *ctx, linenoiseHighlightCallback *);
+
+char *linenoiseCtxRead(linenoiseContext *ctx, const char *prompt);
+const char *linenoiseCtxReadView(linenoiseContext *ctx, const char *prompt, size_t *len);
+int linenoiseCtxReadInto(linenoiseContext *ctx, const char *prompt, linenoiseBuf *lb);
+
+int linenoiseCtxEditStart(linenoiseContext *ctx, const char *prompt);
+char *linenoiseCtxEditFeed(linenoiseContext *ctx);
+int linenoiseCtxEditPending(linenoiseContext *ctx);
+void linenoiseCtxEditStop(linenoiseContext *ctx);
+void linenoiseCtxHide(linenoiseContext *ctx);
+void linenoiseCtxShow(linenoiseContext *ctx);
+
+int linenoiseCtxHistoryAdd(linenoiseContext *ctx, const char *line);
+int linenoiseCtxHistorySetMaxLen(linenoiseContext *ctx, int len);
+int linenoiseCtxHistorySave(linenoiseContext *ctx, const char *filename);
+int linenoiseCtxHistoryAppend(linenoiseContext *ctx, const char *filename);
+void linenoiseCtxSetHistoryFsync(linenoiseContext *ctx, int enable);
+void linenoiseCtxSetHistoryFormat(linenoiseContext *ctx, int format);
+void linenoiseCtxSetHistoryEraseDups(linenoiseContext *ctx, int enable);
+int linenoiseCtxHistoryLoad(linenoiseContext *ctx, const char *filename);
+void linenoiseCtxHistoryFree(linenoiseContext *ctx);
+char **linenoiseCtxHistory(linenoiseContext *ctx, int *len);
+const char *linenoiseCtxHistoryGet(linenoiseContext *ctx, int index);
+int linenoiseCtxCols(linenoiseContext *ctx);
+void linenoiseCtxSetBracketedPaste(linenoiseContext *ctx, int enable);
+void linenoiseCtxSetEscapeTimeout(linenoiseContext *ctx, int ms);
+void linenoiseCtxSetMultiLine(linenoiseContext *ctx, int enable);
+void linenoiseCtxSetStats(linenoiseContext *ctx, int enable);
+void linenoiseCtxGetStats(linenoiseContext *ctx, linenoiseStats *stats);
+int linenoiseCtxRefreshWrites(linenoiseContext *ctx);
+int linenoiseCtxWakeFd(linenoiseContext *ctx);
+void linenoiseCtxWindowChanged(linenoiseContext *ctx);
+
+/* A history which several contexts can use at once, from any thread.
+ * Reading it takes no lock, while adding a line waits for other writers */
+typedef struct linenoiseSharedHistory linenoiseSharedHistory;
+linenoiseSharedHistory *linenoiseSharedHistoryCreate(int max_len);
+void linenoiseSharedHistoryFree(linenoiseSharedHistory *sh);
+void linenoiseCtxSetSharedHistory(linenoiseContext *ctx, linenoiseSharedHistory *sh);
+void linenoiseSetSharedHistory(linenoiseSharedHistory *sh);
 
 
 #ifdef __cplusplus
@@ -13,7 +13,23 @@
 #include "utf8.h"
 
 #ifdef USE_UTF8
-int utf8_fromunicode(char *p, unsigned short uc)
+#include "utf8_width.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/* Compiled for avx2 regardless of -march and only used if the cpu has it */
+#include <immintrin.h>
+#define HAVE_AVX2
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON
+#endif
+
+int utf8_fromunicode(char *p, unsigned uc)
 {
     if (uc <= 0x7f) {
         *p = uc;
@@ -24,12 +40,19 @@ int utf8_fromunicode(char *p, unsigned short uc)
         *p = 0x80 | (uc & 0x3f);
         return 2;
     }
-    else {
+    else if (uc <= 0xffff) {
         *p++ = 0xe0 | ((uc & 0xf000) >> 12);
         *p++ = 0x80 | ((uc & 0xfc0) >> 6);
         *p = 0x80 | (uc & 0x3f);
         return 3;
     }
+    else {
+        *p++ = 0xf0 | ((uc & 0x1c0000) >> 18);
+        *p++ = 0x80 | ((uc & 0x3f000) >> 12);
+        *p++ = 0x80 | ((uc & 0xfc0) >> 6);
+        *p = 0x80 | (uc & 0x3f);
+        return 4;
+    }
 }
 
 int utf8_charlen(int c)
@@ -50,13 +73,10 @@ int utf8_charlen(int c)
     return -1;
 }
 
-int utf8_strlen(const char *str, int bytelen)
+static int utf8_strlen_scalar(const char *str, int bytelen)
 {
     int charlen = 0;
-    if (bytelen < 0) {
-        bytelen = strlen(str);
-    }
-    while (bytelen) {
+    while (bytelen > 0) {
         int c;
         int l = utf8_tounicode(str, &c);
         charlen++;
@@ -66,7 +86,7 @@ int utf8_strlen(const char *str, int bytelen)
     return charlen;
 }
 
-int utf8_index(const char *str, int index)
+static int utf8_index_scalar(const char *str, int index)
 {
     const char *s = str;
     while (index--) {
@@ -76,6 +96,250 @@ int utf8_index(const char *str, int index)
     return s - str;
 }
 
+#if defined(HAVE_SSE2) || defined(HAVE_AVX2) || defined(HAVE_NEON)
+/*
+ * The vector versions classify a block of 16 or 32 bytes at a time into
+ * bitmasks, one bit per byte. If the block holds only complete 1-3 byte
+ * sequences, the number of chars is simply the number of bytes which
+ * are not continuation bytes. A sequence which runs into the next block
+ * is left for the next block. Anything else (invalid or 4 byte sequences)
+ * is decoded a char at a time so that the result is always identical to
+ * the scalar version.
+ */
+static int popcount32(unsigned long x)
+{
+#ifdef __GNUC__
+    return __builtin_popcountl(x);
+#else
+    int n = 0;
+    while (x) {
+        x &= x - 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/**
+ * 'high' has a bit for each byte >= 0x80, 'cont' for each < 0xc0,
+ * 'lt20' for each < 0xe0 and 'lt10' for each < 0xf0 (the latter three
+ * only for bytes >= 0x80).
+ *
+ * Returns the number of chars in the block and sets '*width' to the
+ * number of bytes they occupy, or returns -1 if the block needs to be
+ * decoded a char at a time.
+ */
+static int block_chars(unsigned long high, unsigned long cont, unsigned long lt20, unsigned long lt10, int *width)
+{
+    unsigned long long mask = (1ULL << *width) - 1;
+    unsigned long long lead2 = lt20 & ~cont;
+    unsigned long long lead3 = lt10 & ~lt20;
+    unsigned long long expect = (lead2 | lead3) << 1 | lead3 << 2;
+
+    if (expect & ~mask) {
+        /* Stop before the last sequence, since it is incomplete */
+        int n = *width - 2;
+        if (!((lead3 >> n) & 1)) {
+            n++;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        mask = (1ULL << n) - 1;
+        *width = n;
+        lead2 &= mask;
+        lead3 &= mask;
+        expect = (lead2 | lead3) << 1 | lead3 << 2;
+    }
+    if ((high & ~lt10 & mask) || expect != (cont & mask)) {
+        return -1;
+    }
+    return *width - popcount32(cont & mask);
+}
+
+/* Decodes the block at 'str' a char at a time, stopping early if '*index'
+ * chars have been decoded. A negative '*index' means no limit.
+ */
+static const char *block_decode(const char *str, int width, int *index, int *charlen)
+{
+    const char *stop = str + width;
+    while (str < stop && *index) {
+        int c;
+        str += utf8_tounicode(str, &c);
+        (*index)--;
+        (*charlen)++;
+    }
+    return str;
+}
+
+#define UTF8_VECTOR_IMPL(NAME, WIDTH, CLASSIFY, ATTR) \
+ATTR static int utf8_strlen_##NAME(const char *str, int bytelen) \
+{ \
+    const char *end = str + bytelen; \
+    int charlen = 0; \
+    int unlimited = -1; \
+    while (end - str >= WIDTH) { \
+        unsigned long high, cont, lt20, lt10; \
+        int width = WIDTH; \
+        int n; \
+        CLASSIFY(str, high, cont, lt20, lt10); \
+        n = high ? block_chars(high, cont, lt20, lt10, &width) : WIDTH; \
+        if (n < 0) { \
+            str = block_decode(str, WIDTH, &unlimited, &charlen); \
+            continue; \
+        } \
+        charlen += n; \
+        str += width; \
+    } \
+    return str < end ? charlen + utf8_strlen_scalar(str, end - str) : charlen; \
+} \
+\
+ATTR static int utf8_index_##NAME(const char *str, int index) \
+{ \
+    /* At least 'index' bytes must remain before the null, so a whole block is safe to load */ \
+    const char *s = str; \
+    int charlen = 0; \
+    while (index >= WIDTH) { \
+        unsigned long high, cont, lt20, lt10; \
+        int width = WIDTH; \
+        int n; \
+        CLASSIFY(s, high, cont, lt20, lt10); \
+        n = high ? block_chars(high, cont, lt20, lt10, &width) : WIDTH; \
+        if (n < 0) { \
+            s = block_decode(s, WIDTH, &index, &charlen); \
+            continue; \
+        } \
+        index -= n; \
+        s += width; \
+    } \
+    return s - str + utf8_index_scalar(s, index); \
+}
+
+#ifdef HAVE_SSE2
+#define CLASSIFY_SSE2(P, HIGH, CONT, LT20, LT10) do { \
+        __m128i v = _mm_loadu_si128((const __m128i *)(P)); \
+        HIGH = (unsigned)_mm_movemask_epi8(v); \
+        if (HIGH) { \
+            CONT = (unsigned)_mm_movemask_epi8(_mm_cmplt_epi8(v, _mm_set1_epi8(-64))); \
+            LT20 = (unsigned)_mm_movemask_epi8(_mm_cmplt_epi8(v, _mm_set1_epi8(-32))); \
+            LT10 = (unsigned)_mm_movemask_epi8(_mm_cmplt_epi8(v, _mm_set1_epi8(-16))); \
+        } \
+    } while (0)
+
+UTF8_VECTOR_IMPL(sse2, 16, CLASSIFY_SSE2, )
+#endif
+
+#ifdef HAVE_AVX2
+#define CLASSIFY_AVX2(P, HIGH, CONT, LT20, LT10) do { \
+        __m256i v = _mm256_loadu_si256((const __m256i *)(P)); \
+        HIGH = (unsigned)_mm256_movemask_epi8(v); \
+        if (HIGH) { \
+            CONT = (unsigned)_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8(-64), v)); \
+            LT20 = (unsigned)_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8(-32), v)); \
+            LT10 = (unsigned)_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8(-16), v)); \
+        } \
+    } while (0)
+
+UTF8_VECTOR_IMPL(avx2, 32, CLASSIFY_AVX2, __attribute__((target("avx2"))))
+#endif
+
+#ifdef HAVE_NEON
+static unsigned neon_movemask(uint8x16_t v)
+{
+    static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t m = vandq_u8(v, vld1q_u8(bits));
+    return vaddv_u8(vget_low_u8(m)) | (vaddv_u8(vget_high_u8(m)) << 8);
+}
+
+#define CLASSIFY_NEON(P, HIGH, CONT, LT20, LT10) do { \
+        int8x16_t v = vld1q_s8((const int8_t *)(P)); \
+        HIGH = neon_movemask(vcltq_s8(v, vdupq_n_s8(0))); \
+        if (HIGH) { \
+            CONT = neon_movemask(vcltq_s8(v, vdupq_n_s8(-64))); \
+            LT20 = neon_movemask(vcltq_s8(v, vdupq_n_s8(-32))); \
+            LT10 = neon_movemask(vcltq_s8(v, vdupq_n_s8(-16))); \
+        } \
+    } while (0)
+
+UTF8_VECTOR_IMPL(neon, 16, CLASSIFY_NEON, )
+#endif
+#endif
+
+struct utf8_impl {
+    const char *name;
+    int (*strlen_fn)(const char *str, int bytelen);
+    int (*index_fn)(const char *str, int index);
+    int (*supported)(void);
+};
+
+#ifdef HAVE_AVX2
+static int have_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+/* In order of preference */
+static const struct utf8_impl utf8_impls[] = {
+#ifdef HAVE_AVX2
+    { "avx2", utf8_strlen_avx2, utf8_index_avx2, have_avx2 },
+#endif
+#ifdef HAVE_SSE2
+    { "sse2", utf8_strlen_sse2, utf8_index_sse2, NULL },
+#endif
+#ifdef HAVE_NEON
+    { "neon", utf8_strlen_neon, utf8_index_neon, NULL },
+#endif
+    { "scalar", utf8_strlen_scalar, utf8_index_scalar, NULL },
+    { NULL, NULL, NULL, NULL }
+};
+
+static const struct utf8_impl *utf8_current = NULL;
+
+const char *utf8_select(const char *name)
+{
+    const struct utf8_impl *impl;
+
+    for (impl = utf8_impls; impl->name; impl++) {
+        if ((name == NULL || strcmp(name, impl->name) == 0) && (impl->supported == NULL || impl->supported())) {
+            utf8_current = impl;
+            return impl->name;
+        }
+    }
+    return NULL;
+}
+
+int utf8_strlen(const char *str, int bytelen)
+{
+    if (bytelen < 0) {
+        bytelen = strlen(str);
+    }
+    if (utf8_current == NULL) {
+        utf8_select(NULL);
+    }
+    return utf8_current->strlen_fn(str, bytelen);
+}
+
+int utf8_index(const char *str, int index)
+{
+    if (utf8_current == NULL) {
+        utf8_select(NULL);
+    }
+    return utf8_current->index_fn(str, index);
+}
+
+int utf8_width(int uc)
+{
+    if (uc < 0x300) {
+        /* Nothing before the combining marks is wide or zero width */
+        return 1;
+    }
+    if (uc > 0x10ffff) {
+        return 1;
+    }
+    return (utf8_width_blocks[utf8_width_index[uc >> 8]][(uc & 0xff) >> 2] >> ((uc & 3) * 2)) & 3;
+}
+
 int utf8_charequal(const char *s1, const char *s2)
 {
     int c1, c2;
@@ -106,6 +370,12 @@ int utf8_tounicode(const char *str, int *uc)
             return 3;
         }
     }
+    else if (s[0] < 0xf5) {
+        if (((str[1] & 0xc0) == 0x80) && ((str[2] & 0xc0) == 0x80) && ((str[3] & 0xc0) == 0x80)) {
+            *uc = ((s[0] & ~0xf0) << 18) | ((s[1] & ~0x80) << 12) | ((s[2] & ~0x80) << 6) | (s[3] & ~0x80);
+            return 4;
+        }
+    }
 
     /* Invalid sequence, so just return the byte */
     *uc = *s;
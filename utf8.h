@@ -16,22 +16,21 @@
 #define utf8_tounicode(S, CP) (*(CP) = (unsigned char)*(S), 1)
 #define utf8_index(C, I) (I)
 #define utf8_charlen(C) 1
+#define utf8_width(C) 1
 
 #else
 /**
- * Converts the given unicode codepoint (0 - 0xffff) to utf-8
+ * Converts the given unicode codepoint (0 - 0x10ffff) to utf-8
  * and stores the result at 'p'.
  * 
- * Returns the number of utf-8 characters (1-3).
+ * Returns the number of utf-8 characters (1-4).
  */
-int utf8_fromunicode(char *p, unsigned short uc);
+int utf8_fromunicode(char *p, unsigned uc);
 
 /**
  * Returns the length of the utf-8 sequence starting with 'c'.
  * 
  * Returns 1-4, or -1 if this is not a valid start byte.
- *
- * Note that charlen=4 is not supported by the rest of the API.
  */
 int utf8_charlen(int c);
 
@@ -43,8 +42,6 @@ int utf8_charlen(int c);
  * sequence are treated as individual characters.
  *
  * The string *must* be null terminated.
- *
- * Does not support unicode code points > \uffff
  */
 int utf8_strlen(const char *str, int bytelen);
 
@@ -58,6 +55,17 @@ int utf8_strlen(const char *str, int bytelen);
  */
 int utf8_index(const char *str, int charindex);
 
+/**
+ * Selects the implementation of utf8_strlen() and utf8_index()
+ * by name: "avx2", "sse2", "neon" or "scalar". NULL selects
+ * the fastest one supported by this build and cpu, which is
+ * otherwise done automatically on first use.
+ *
+ * Returns the name of the chosen implementation, or NULL
+ * if the requested one is not available.
+ */
+const char *utf8_select(const char *name);
+
 /**
  * Returns the unicode codepoint corresponding to the
  * utf-8 sequence 'str'.
@@ -69,11 +77,16 @@ int utf8_index(const char *str, int charindex);
  * at the end of the string will be returned as individual bytes.
  *
  * If it is not null terminated, the length *must* be checked first.
- *
- * Does not support unicode code points > \uffff
  */
 int utf8_tounicode(const char *str, int *uc);
 
+/**
+ * Returns the number of columns the unicode codepoint 'uc' takes
+ * on a terminal: 0 for combining marks and the like, 2 for
+ * east asian wide chars and 1 for the rest.
+ */
+int utf8_width(int uc);
+
 #endif
 
 #endif
@@ -0,0 +1,103 @@
+/* Micro-benchmark for the utf8_strlen() and utf8_index() implementations.
+ *
+ * Each implementation is checked against the scalar version, then timed
+ * over ascii, mixed latin and CJK text.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "utf8.h"
+
+#define TEXT_SIZE 4096
+#define ITERATIONS 20000
+
+static const char *impls[] = { "scalar", "sse2", "avx2", "neon", NULL };
+
+static char *make_text(const char *pattern)
+{
+    char *text = malloc(TEXT_SIZE + 1);
+    size_t plen = strlen(pattern);
+    size_t n = 0;
+
+    while (n + plen <= TEXT_SIZE) {
+        memcpy(text + n, pattern, plen);
+        n += plen;
+    }
+    text[n] = 0;
+    return text;
+}
+
+static double elapsed(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void bench(const char *label, const char *text)
+{
+    int len = strlen(text);
+    int chars;
+    int i;
+    const char **impl;
+
+    utf8_select("scalar");
+    chars = utf8_strlen(text, len);
+    printf("%s: %d bytes, %d chars\n", label, len, chars);
+
+    for (impl = impls; *impl; impl++) {
+        clock_t start;
+        double t1, t2;
+        volatile int sink = 0;
+
+        if (!utf8_select(*impl)) {
+            continue;
+        }
+        if (utf8_strlen(text, len) != chars || utf8_index(text, chars) != len) {
+            printf("  %-8s MISMATCH\n", *impl);
+            continue;
+        }
+        for (i = 0; i < chars; i += 7) {
+            utf8_select("scalar");
+            sink = utf8_index(text, i);
+            utf8_select(*impl);
+            if (utf8_index(text, i) != sink || utf8_strlen(text, sink) != i) {
+                printf("  %-8s MISMATCH at char %d\n", *impl, i);
+                break;
+            }
+        }
+
+        start = clock();
+        for (i = 0; i < ITERATIONS; i++) {
+            sink += utf8_strlen(text, len);
+        }
+        t1 = elapsed(start);
+
+        start = clock();
+        for (i = 0; i < ITERATIONS; i++) {
+            sink += utf8_index(text, chars);
+        }
+        t2 = elapsed(start);
+
+        printf("  %-8s strlen %7.1f MB/s   index %7.1f MB/s\n", *impl,
+            len * (double)ITERATIONS / t1 / 1e6, len * (double)ITERATIONS / t2 / 1e6);
+    }
+}
+
+int main(void)
+{
+    char *ascii = make_text("SELECT name, id FROM users WHERE id > 10; ");
+    char *mixed = make_text("Größe café naïve Ångström déjà vu, ");
+    char *cjk = make_text("\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\xe3\x81\xae\xe6\x96\x87\xe7\xab\xa0\xe3\x80\x82");
+    char *invalid = make_text("ab\x80" "c\xe6\x97" "d\xf0\x9f\x98\x80" "e\xc3");
+
+    bench("ascii", ascii);
+    bench("mixed", mixed);
+    bench("cjk", cjk);
+    bench("invalid", invalid);
+
+    free(ascii);
+    free(mixed);
+    free(cjk);
+    free(invalid);
+    return 0;
+}
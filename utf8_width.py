@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+"""Writes utf8_width.h, the display width of every unicode code point.
+
+The widths come from the unicode database of the python running this:
+    python3 utf8_width.py > utf8_width.h
+
+Combining marks, format chars and the medial and final hangul jamo are 0
+columns wide, east asian wide and fullwidth chars are 2, and all else 1.
+Unassigned code points in the CJK ranges are taken to be wide.
+"""
+import unicodedata
+
+BLOCK = 256
+WIDE_RANGES = [(0x3400, 0x4dbf), (0x4e00, 0x9fff), (0xf900, 0xfaff),
+               (0x20000, 0x2fffd), (0x30000, 0x3fffd)]
+
+
+def width(cp):
+    if cp < 0x20 or 0x7f <= cp < 0xa0 or cp == 0xad:
+        return 1
+    c = chr(cp)
+    cat = unicodedata.category(c)
+    if cat in ('Mn', 'Me', 'Cf') or 0x1160 <= cp <= 0x11ff or 0xd7b0 <= cp <= 0xd7ff or cp == 0x200b:
+        return 0
+    if unicodedata.east_asian_width(c) in ('W', 'F'):
+        return 2
+    if cat == 'Cn' and any(lo <= cp <= hi for lo, hi in WIDE_RANGES):
+        return 2
+    return 1
+
+
+def main():
+    blocks = []
+    index = []
+    seen = {}
+    for start in range(0, 0x110000, BLOCK):
+        packed = [0] * (BLOCK // 4)
+        for cp in range(start, start + BLOCK):
+            packed[(cp - start) // 4] |= width(cp) << ((cp % 4) * 2)
+        packed = tuple(packed)
+        if packed not in seen:
+            seen[packed] = len(blocks)
+            blocks.append(packed)
+        index.append(seen[packed])
+    assert len(blocks) <= 256
+
+    print('/* Generated by utf8_width.py from unicode %s. Do not edit. */' % unicodedata.unidata_version)
+    print('')
+    print('/* Index into utf8_width_blocks of each block of %d code points */' % BLOCK)
+    print('static const unsigned char utf8_width_index[%d] = {' % len(index))
+    for i in range(0, len(index), 16):
+        print('    ' + ' '.join('%d,' % n for n in index[i:i + 16]))
+    print('};')
+    print('')
+    print('/* The width of each code point of a block, in 2 bits from the lowest */')
+    print('static const unsigned char utf8_width_blocks[%d][%d] = {' % (len(blocks), BLOCK // 4))
+    for b in blocks:
+        print('    {')
+        for i in range(0, len(b), 16):
+            print('        ' + ' '.join('0x%02x,' % n for n in b[i:i + 16]))
+        print('    },')
+    print('};')
+
+
+main()